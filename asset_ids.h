@@ -24,12 +24,122 @@ enum Named_Asset_IDs {
 	NUM_NAMED_ASSET_IDS = NUM_MODEL_IDS + NUM_FONT_IDS + NUM_SOUND_IDS
 };
 
-//#pragma pack(1)
+// Computed by the packer for every model and mesh, in model space.
+struct Asset_Bounds {
+	float aabb_min[3];
+	float aabb_max[3];
+	float sphere_center[3];
+	float sphere_radius;
+};
+
+// Asset file, version 4.
+// The file starts with an Asset_File_Header and ends with a table of contents, one Asset_Toc_Entry per asset. Every entry's payload
+// starts on an ASSET_ENTRY_ALIGNMENT boundary, so it can be mapped or read on its own with a single request, and the arrays
+// inside a payload start on ASSET_ARRAY_ALIGNMENT boundaries. Offsets inside a payload are relative to the start of the payload.
+// All offsets and sizes are 64 bit.
+// A compressed entry is stored as an Asset_Chunk_Table followed by the chunks. Each chunk is ASSET_CHUNK_SIZE bytes of payload
+// (less for the last one) compressed on its own with lz.h, so chunks can be decompressed in parallel. A chunk that didn't
+// shrink is stored as is, which shows as a stored size equal to its uncompressed size.
+
+#define ASSET_FILE_MAGIC 0x32484841 // "AHH2"
+#define ASSET_FILE_VERSION 4
+#define ASSET_ENTRY_ALIGNMENT 4096
+#define ASSET_ARRAY_ALIGNMENT 64
+#define ASSET_CHUNK_SIZE (256 * 1024)
+
+enum Asset_Compression {
+	ASSET_COMPRESSION_NONE,
+	ASSET_COMPRESSION_LZ, // Both lz.h levels decompress the same way.
+};
+
+enum Asset_Type {
+	ASSET_TYPE_MODEL,   // Asset_Model, id is the Model_ID.
+	ASSET_TYPE_MESH,    // Asset_Mesh_Table for the model with the same id.
+	ASSET_TYPE_TEXTURE, // Asset_Texture, id is the mesh texture index.
+	ASSET_TYPE_FONT,    // Reserved, id is the Font_ID.
+	NUM_ASSET_TYPES
+};
+
 struct Asset_File_Header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t num_mesh_textures; // We don't give each mesh texture it's own Asset_ID since we won't be referencing it directly.
+	uint64_t toc_offset;
+};
+
+struct Asset_Toc_Entry {
+	uint32_t type;
+	uint32_t id;
+	uint64_t offset;
+	uint64_t size; // As stored in the file.
+	uint64_t uncompressed_size;
+	uint32_t compression;
+	uint32_t pad;
+};
+
+struct Asset_Chunk_Table {
+	uint32_t num_chunks;
+	uint32_t pad;
+	uint64_t chunk_offsets[0]; // num_chunks + 1 of them, chunk i is [chunk_offsets[i], chunk_offsets[i + 1]).
+};
+
+// Model_Vertex vertices, then uint32_t indices relative to the first vertex.
+struct Asset_Model {
+	uint32_t num_vertices;
+	uint32_t num_indices;
+	uint64_t vertices_offset;
+	uint64_t indices_offset;
+	Asset_Bounds bounds;
+};
+
+#define ASSET_NO_TEXTURE ((uint32_t)-1)
+
+struct Asset_Mesh {
+	uint32_t num_indices;
+	uint32_t first_index; // Into the model's indices.
+	uint32_t specular_texture; // Mesh texture index, or ASSET_NO_TEXTURE.
+	uint32_t diffuse_texture;
+	Asset_Bounds bounds;
+};
+
+struct Asset_Mesh_Table {
+	uint32_t num_meshes;
+	uint32_t pad;
+	Asset_Mesh meshes[0];
+};
+
+// Textures are stored block compressed with bc.h, with the full mip chain built by the packer. Level 0 is the full size image and
+// each level after it is half the size of the one before, rounded down, down to 1x1. Levels are rows of 4x4 blocks, with the blocks
+// past the edge of levels smaller than a block padded out by repeating the edge pixels.
+enum Asset_Texture_Format {
+	ASSET_TEXTURE_BC1, // Opaque textures.
+	ASSET_TEXTURE_BC3, // Textures with any alpha below 255.
+};
+
+#define ASSET_MAX_TEXTURE_LEVELS 16
+
+struct Asset_Texture_Level {
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset;
+	uint64_t size;
+};
+
+struct Asset_Texture {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t num_levels;
+	Asset_Texture_Level levels[ASSET_MAX_TEXTURE_LEVELS];
+};
+
+// The version 1 header, only used by the packer to convert old files. Version 1 payloads are packed back to back with 32 bit
+// texture offsets, see convert_v1_asset_file() in asset_packer.cpp.
+struct Asset_File_Header_V1 {
 	long named_asset_offsets[NUM_NAMED_ASSET_IDS];
 	uint32_t num_mesh_textures;
-	long mesh_texture_table_offset; // We don't give each mesh texture it's own Asset_ID since we won't be referencing it directly.
+	long mesh_texture_table_offset;
 };
-//#pragma pack(pop)
 
 #endif
@@ -4,9 +4,11 @@
 #include <assert.h>
 #include <string.h>
 #include <stdarg.h>
+#include <math.h>
 #include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
@@ -24,6 +26,8 @@ namespace std {
 }
 
 #include "asset_ids.h"
+#include "lz.h"
+#include "bc.h"
 
 struct Model_Vertex {
 	float position[3];
@@ -108,16 +112,492 @@ ID_To_Filename model_map[] = {
 
 std::map<std::string, uint32_t> texture_map;
 
-// TODO: This won't work for large file (>2GB). ftell might not work properly with file larger than 2GB because it returns a signed long as the offset.
-// Might have to use some OS specific offset query function.
+// Bounds of the vertices referenced by inds. The sphere is centered on the box, but its radius comes from the vertices themselves,
+// which is tighter than the box's half diagonal.
+static Asset_Bounds
+compute_bounds(const std::vector<Model_Vertex> &verts, const uint32_t *inds, size_t num_inds)
+{
+	Asset_Bounds b;
+	for (int i = 0; i < 3; ++i) {
+		b.aabb_min[i] = num_inds ? verts[inds[0]].position[i] : 0.0f;
+		b.aabb_max[i] = b.aabb_min[i];
+	}
+	for (size_t i = 0; i < num_inds; ++i) {
+		const float *p = verts[inds[i]].position;
+		for (int j = 0; j < 3; ++j) {
+			if (p[j] < b.aabb_min[j]) b.aabb_min[j] = p[j];
+			if (p[j] > b.aabb_max[j]) b.aabb_max[j] = p[j];
+		}
+	}
+	float radius2 = 0.0f;
+	for (int i = 0; i < 3; ++i)
+		b.sphere_center[i] = (b.aabb_min[i] + b.aabb_max[i]) * 0.5f;
+	for (size_t i = 0; i < num_inds; ++i) {
+		const float *p = verts[inds[i]].position;
+		float dx = p[0] - b.sphere_center[0], dy = p[1] - b.sphere_center[1], dz = p[2] - b.sphere_center[2];
+		float d2 = dx*dx + dy*dy + dz*dz;
+		if (d2 > radius2)
+			radius2 = d2;
+	}
+	b.sphere_radius = sqrtf(radius2);
+	return b;
+}
+
+// Writes an asset file front to back. Positions are tracked here rather than with ftell so they're 64 bit everywhere.
+// Entry payloads are built up in memory so they can be compressed as a whole when the entry ends.
+struct Asset_Writer {
+	FILE *file;
+	uint64_t pos;
+	std::vector<Asset_Toc_Entry> toc;
+	bool in_entry;
+	std::vector<uint8_t> entry;
+	bool compress;
+	Lz_Level level;
+	uint64_t raw_bytes;
+	uint64_t stored_bytes;
+};
+
+static void
+write_file_bytes(Asset_Writer *w, const void *data, uint64_t n)
+{
+	if (n && fwrite(data, n, 1, w->file) != 1) {
+		printf("Failed to write %llu bytes at %llu\n", (unsigned long long)n, (unsigned long long)w->pos);
+		exit(1);
+	}
+	w->pos += n;
+}
+
+static void
+write_bytes(Asset_Writer *w, const void *data, uint64_t n)
+{
+	if (!w->in_entry) {
+		write_file_bytes(w, data, n);
+		return;
+	}
+	const uint8_t *bytes = (const uint8_t *)data;
+	w->entry.insert(w->entry.end(), bytes, bytes + n);
+}
+
+static uint64_t
+align_up(uint64_t n, uint64_t alignment)
+{
+	return (n + alignment - 1) & ~(alignment - 1);
+}
+
+// Inside an entry, alignment is relative to the start of the payload. Payloads start on ASSET_ENTRY_ALIGNMENT boundaries, so
+// for uncompressed entries that's the same as aligning the file position.
+static void
+pad_to(Asset_Writer *w, uint64_t alignment)
+{
+	static const char zeros[ASSET_ENTRY_ALIGNMENT] = {};
+	uint64_t pos = w->in_entry ? w->entry.size() : w->pos;
+	write_bytes(w, zeros, align_up(pos, alignment) - pos);
+}
+
+static bool
+open_asset_writer(Asset_Writer *w, const char *path, bool compress, Lz_Level level)
+{
+	w->file = fopen(path, "wb");
+	if (!w->file) {
+		printf("Failed to open %s for writing\n", path);
+		return false;
+	}
+	w->pos = 0;
+	w->toc.clear();
+	w->in_entry = false;
+	w->compress = compress;
+	w->level = level;
+	w->raw_bytes = w->stored_bytes = 0;
+	// The real header goes in once the table of contents has been written.
+	Asset_File_Header placeholder = {};
+	write_bytes(w, &placeholder, sizeof(placeholder));
+	return true;
+}
+
+static void
+begin_entry(Asset_Writer *w, Asset_Type type, uint32_t id)
+{
+	pad_to(w, ASSET_ENTRY_ALIGNMENT);
+	w->toc.push_back({ (uint32_t)type, id, w->pos, 0, 0, ASSET_COMPRESSION_NONE, 0 });
+	w->in_entry = true;
+	w->entry.clear();
+}
+
+// Compresses the payload in ASSET_CHUNK_SIZE pieces. Falls back to storing the entry raw if compression doesn't pay for the
+// chunk table.
+static bool
+write_compressed_entry(Asset_Writer *w)
+{
+	static Lz_Hash_Chains chains;
+	uint64_t n = w->entry.size();
+	uint32_t num_chunks = (n + ASSET_CHUNK_SIZE - 1) / ASSET_CHUNK_SIZE;
+	uint64_t table_size = align_up(sizeof(Asset_Chunk_Table) + sizeof(uint64_t) * (num_chunks + 1), ASSET_ARRAY_ALIGNMENT);
+	std::vector<uint8_t> out(table_size);
+	std::vector<uint8_t> chunk(lz_compress_bound(ASSET_CHUNK_SIZE));
+	std::vector<uint64_t> offsets(num_chunks + 1);
+	for (uint32_t i = 0; i < num_chunks; ++i) {
+		uint64_t begin = (uint64_t)i * ASSET_CHUNK_SIZE;
+		uint64_t size = std::min<uint64_t>(ASSET_CHUNK_SIZE, n - begin);
+		size_t compressed_size = lz_compress(&w->entry[begin], size, chunk.data(), w->level, &chains);
+		offsets[i] = out.size();
+		if (compressed_size < size)
+			out.insert(out.end(), chunk.begin(), chunk.begin() + compressed_size);
+		else
+			out.insert(out.end(), w->entry.begin() + begin, w->entry.begin() + begin + size);
+	}
+	offsets[num_chunks] = out.size();
+	if (out.size() >= n)
+		return false;
+	Asset_Chunk_Table table = { num_chunks, 0 };
+	memcpy(out.data(), &table, sizeof(table));
+	memcpy(out.data() + sizeof(table), offsets.data(), sizeof(uint64_t) * offsets.size());
+	write_file_bytes(w, out.data(), out.size());
+	w->toc.back().compression = ASSET_COMPRESSION_LZ;
+	return true;
+}
+
+static void
+end_entry(Asset_Writer *w)
+{
+	w->in_entry = false;
+	Asset_Toc_Entry *e = &w->toc.back();
+	if (!w->compress || w->entry.empty() || !write_compressed_entry(w))
+		write_file_bytes(w, w->entry.data(), w->entry.size());
+	e->uncompressed_size = w->entry.size();
+	e->size = w->pos - e->offset;
+	w->raw_bytes += e->uncompressed_size;
+	w->stored_bytes += e->size;
+}
+
+static void
+close_asset_writer(Asset_Writer *w, uint32_t num_mesh_textures)
+{
+	printf("%llu payload bytes stored as %llu\n", (unsigned long long)w->raw_bytes, (unsigned long long)w->stored_bytes);
+	pad_to(w, ASSET_ARRAY_ALIGNMENT);
+	Asset_File_Header header = { ASSET_FILE_MAGIC, ASSET_FILE_VERSION, (uint32_t)w->toc.size(), num_mesh_textures, w->pos };
+	write_bytes(w, w->toc.data(), sizeof(Asset_Toc_Entry) * w->toc.size());
+	fseek(w->file, 0, SEEK_SET);
+	fwrite(&header, sizeof(header), 1, w->file);
+	fclose(w->file);
+}
+
+static void
+write_model(Asset_Writer *w, uint32_t id, const Model_Vertex *verts, uint32_t num_verts, const uint32_t *inds, uint32_t num_inds,
+            const Asset_Mesh *meshes, uint32_t num_meshes, const Asset_Bounds &bounds)
+{
+	Asset_Model am;
+	am.num_vertices = num_verts;
+	am.num_indices = num_inds;
+	am.vertices_offset = align_up(sizeof(Asset_Model), ASSET_ARRAY_ALIGNMENT);
+	am.indices_offset = align_up(am.vertices_offset + sizeof(Model_Vertex) * (uint64_t)num_verts, ASSET_ARRAY_ALIGNMENT);
+	am.bounds = bounds;
+	begin_entry(w, ASSET_TYPE_MODEL, id);
+	write_bytes(w, &am, sizeof(am));
+	pad_to(w, ASSET_ARRAY_ALIGNMENT);
+	write_bytes(w, verts, sizeof(Model_Vertex) * (uint64_t)num_verts);
+	pad_to(w, ASSET_ARRAY_ALIGNMENT);
+	write_bytes(w, inds, sizeof(uint32_t) * (uint64_t)num_inds);
+	end_entry(w);
+
+	Asset_Mesh_Table table = { num_meshes, 0 };
+	begin_entry(w, ASSET_TYPE_MESH, id);
+	write_bytes(w, &table, sizeof(table));
+	write_bytes(w, meshes, sizeof(Asset_Mesh) * (uint64_t)num_meshes);
+	end_entry(w);
+}
+
+// Mip levels are filtered in linear light as RGBA floats, since averaging the sRGB encoded values darkens every level.
+// Alpha is filtered as is.
+struct Mip_Image {
+	uint32_t width;
+	uint32_t height;
+	std::vector<float> pixels;
+};
+
+static float
+srgb_to_linear(uint8_t c)
+{
+	float v = c / 255.0f;
+	return v <= 0.04045f ? v / 12.92f : powf((v + 0.055f) / 1.055f, 2.4f);
+}
+
+static uint8_t
+linear_to_srgb(float v)
+{
+	v = v <= 0.0031308f ? v * 12.92f : 1.055f * powf(v, 1.0f / 2.4f) - 0.055f;
+	return (uint8_t)std::min(std::max(v * 255.0f + 0.5f, 0.0f), 255.0f);
+}
+
+struct Filter_Tap {
+	uint32_t index;
+	float weight;
+};
+
+// Taps of a tent filter as wide as the downscale factor, so a 2x reduction is the [1 3 3 1] / 8 kernel in each direction. Sample
+// positions wrap, since the engine samples every texture with GL_REPEAT.
+static std::vector<std::vector<Filter_Tap>>
+make_filter_taps(uint32_t src_size, uint32_t dst_size)
+{
+	std::vector<std::vector<Filter_Tap>> taps(dst_size);
+	float scale = (float)src_size / dst_size;
+	for (uint32_t x = 0; x < dst_size; ++x) {
+		float center = (x + 0.5f) * scale - 0.5f;
+		float total = 0.0f;
+		for (int i = (int)floorf(center - scale) + 1; i < center + scale; ++i) {
+			float weight = 1.0f - fabsf(i - center) / scale;
+			if (weight <= 0.0f)
+				continue;
+			taps[x].push_back({ (uint32_t)(((i % (int)src_size) + src_size) % src_size), weight });
+			total += weight;
+		}
+		for (Filter_Tap &t : taps[x])
+			t.weight /= total;
+	}
+	return taps;
+}
+
+static Mip_Image
+downsample(const Mip_Image &src)
+{
+	Mip_Image dst;
+	dst.width = std::max(src.width / 2, 1u);
+	dst.height = std::max(src.height / 2, 1u);
+	auto x_taps = make_filter_taps(src.width, dst.width);
+	auto y_taps = make_filter_taps(src.height, dst.height);
+	// Horizontal pass into a dst.width x src.height image, then vertical.
+	std::vector<float> rows((size_t)dst.width * src.height * 4, 0.0f);
+	for (uint32_t y = 0; y < src.height; ++y) {
+		for (uint32_t x = 0; x < dst.width; ++x) {
+			float *out = &rows[((size_t)y * dst.width + x) * 4];
+			for (const Filter_Tap &t : x_taps[x]) {
+				const float *in = &src.pixels[((size_t)y * src.width + t.index) * 4];
+				for (int c = 0; c < 4; ++c)
+					out[c] += t.weight * in[c];
+			}
+		}
+	}
+	dst.pixels.assign((size_t)dst.width * dst.height * 4, 0.0f);
+	for (uint32_t y = 0; y < dst.height; ++y) {
+		for (const Filter_Tap &t : y_taps[y]) {
+			for (uint32_t x = 0; x < dst.width; ++x) {
+				const float *in = &rows[((size_t)t.index * dst.width + x) * 4];
+				float *out = &dst.pixels[((size_t)y * dst.width + x) * 4];
+				for (int c = 0; c < 4; ++c)
+					out[c] += t.weight * in[c];
+			}
+		}
+	}
+	return dst;
+}
+
+static std::vector<uint8_t>
+compress_mip_level(const Mip_Image &img, Asset_Texture_Format format)
+{
+	uint32_t blocks_x = (img.width + 3) / 4, blocks_y = (img.height + 3) / 4;
+	size_t block_size = format == ASSET_TEXTURE_BC3 ? BC3_BLOCK_SIZE : BC1_BLOCK_SIZE;
+	std::vector<uint8_t> out((size_t)blocks_x * blocks_y * block_size);
+	uint8_t block[16 * 4];
+	for (uint32_t by = 0; by < blocks_y; ++by) {
+		for (uint32_t bx = 0; bx < blocks_x; ++bx) {
+			for (uint32_t p = 0; p < 16; ++p) {
+				uint32_t x = std::min(bx*4 + p%4, img.width - 1), y = std::min(by*4 + p/4, img.height - 1);
+				const float *in = &img.pixels[((size_t)y * img.width + x) * 4];
+				for (int c = 0; c < 3; ++c)
+					block[p*4 + c] = linear_to_srgb(in[c]);
+				block[p*4 + 3] = (uint8_t)std::min(std::max(in[3] * 255.0f + 0.5f, 0.0f), 255.0f);
+			}
+			uint8_t *dst = &out[((size_t)by * blocks_x + bx) * block_size];
+			if (format == ASSET_TEXTURE_BC3)
+				bc3_encode_block(block, dst);
+			else
+				bc1_encode_block(block, dst);
+		}
+	}
+	return out;
+}
+
+// Takes 3 (RGB) or 4 (RGBA) bytes per pixel and writes the whole mip chain block compressed.
+static void
+write_texture(Asset_Writer *w, uint32_t index, uint32_t width, uint32_t height, uint32_t pitch, uint32_t bytes_per_pixel, const void *pixels)
+{
+	Mip_Image img;
+	img.width = width;
+	img.height = height;
+	img.pixels.resize((size_t)width * height * 4);
+	bool has_alpha = false;
+	for (uint32_t y = 0; y < height; ++y) {
+		const uint8_t *row = (const uint8_t *)pixels + (size_t)y * pitch;
+		for (uint32_t x = 0; x < width; ++x) {
+			float *out = &img.pixels[((size_t)y * width + x) * 4];
+			for (int c = 0; c < 3; ++c)
+				out[c] = srgb_to_linear(row[x * bytes_per_pixel + c]);
+			uint8_t alpha = bytes_per_pixel == 4 ? row[x*4 + 3] : 255;
+			out[3] = alpha / 255.0f;
+			has_alpha |= alpha != 255;
+		}
+	}
+	Asset_Texture at = {};
+	at.width = width;
+	at.height = height;
+	at.format = has_alpha ? ASSET_TEXTURE_BC3 : ASSET_TEXTURE_BC1;
+	std::vector<std::vector<uint8_t>> levels;
+	uint64_t offset = align_up(sizeof(Asset_Texture), ASSET_ARRAY_ALIGNMENT);
+	for (;;) {
+		assert(at.num_levels < ASSET_MAX_TEXTURE_LEVELS);
+		levels.push_back(compress_mip_level(img, (Asset_Texture_Format)at.format));
+		at.levels[at.num_levels++] = { img.width, img.height, offset, levels.back().size() };
+		offset = align_up(offset + levels.back().size(), ASSET_ARRAY_ALIGNMENT);
+		if (img.width == 1 && img.height == 1)
+			break;
+		img = downsample(img);
+	}
+
+	begin_entry(w, ASSET_TYPE_TEXTURE, index);
+	write_bytes(w, &at, sizeof(at));
+	for (const std::vector<uint8_t> &level : levels) {
+		pad_to(w, ASSET_ARRAY_ALIGNMENT);
+		write_bytes(w, level.data(), level.size());
+	}
+	end_entry(w);
+}
+
+static uint32_t
+get_texture_index(const std::optional<std::string> &path, uint32_t *num_textures)
+{
+	if (!path)
+		return ASSET_NO_TEXTURE;
+	auto it = texture_map.find(*path);
+	if (it != texture_map.end())
+		return it->second;
+	texture_map[*path] = *num_textures;
+	return (*num_textures)++;
+}
+
+// Rewrites a version 1 asset file in the current format. Version 1 is a header of ftell() offsets, then for each model its vertex and
+// index counts, vertices, indices, mesh count, model bounds, and per mesh its index count, first index, specular and diffuse
+// texture indices and bounds. After the models is a table of 32 bit texture offsets, each pointing at a bytes per pixel byte,
+// int width, height and pitch, then the pixels. Everything is packed back to back.
+static bool
+convert_v1_asset_file(const char *src_path, const char *dst_path, bool compress, Lz_Level level)
+{
+	FILE *src = fopen(src_path, "rb");
+	if (!src) {
+		printf("Failed to open %s\n", src_path);
+		return false;
+	}
+	fseek(src, 0, SEEK_END);
+	long src_size = ftell(src);
+	fseek(src, 0, SEEK_SET);
+	std::vector<char> data(src_size);
+	bool read_ok = fread(data.data(), src_size, 1, src) == 1;
+	fclose(src);
+	if (!read_ok || (size_t)src_size < sizeof(Asset_File_Header_V1)) {
+		printf("Failed to read %s\n", src_path);
+		return false;
+	}
+	Asset_File_Header_V1 header;
+	memcpy(&header, data.data(), sizeof(header));
+
+	// Everything in a version 1 file is unaligned, so fields get copied out rather than read in place.
+	size_t at = 0;
+	bool truncated = false;
+	auto read = [&](void *dst, size_t n) {
+		if (at + n > data.size()) {
+			truncated = true;
+			memset(dst, 0, n);
+			return;
+		}
+		memcpy(dst, &data[at], n);
+		at += n;
+	};
+
+	Asset_Writer w;
+	if (!open_asset_writer(&w, dst_path, compress, level))
+		return false;
+	for (int id = 0; id < NUM_MODEL_IDS; ++id) {
+		if (header.named_asset_offsets[id] <= 0 || header.named_asset_offsets[id] >= src_size) {
+			printf("Model %d has no valid offset, skipping\n", id);
+			continue;
+		}
+		at = header.named_asset_offsets[id];
+		uint32_t num_verts, num_inds, num_meshes;
+		read(&num_verts, sizeof(num_verts));
+		read(&num_inds, sizeof(num_inds));
+		std::vector<Model_Vertex> verts(num_verts);
+		std::vector<uint32_t> inds(num_inds);
+		read(verts.data(), sizeof(Model_Vertex) * verts.size());
+		read(inds.data(), sizeof(uint32_t) * inds.size());
+		read(&num_meshes, sizeof(num_meshes));
+		Asset_Bounds bounds;
+		read(&bounds, sizeof(bounds));
+		std::vector<Asset_Mesh> meshes(num_meshes);
+		for (Asset_Mesh &m : meshes) {
+			read(&m.num_indices, sizeof(uint32_t));
+			read(&m.first_index, sizeof(uint32_t));
+			read(&m.specular_texture, sizeof(uint32_t));
+			read(&m.diffuse_texture, sizeof(uint32_t));
+			read(&m.bounds, sizeof(Asset_Bounds));
+		}
+		if (truncated) {
+			printf("Model %d runs past the end of %s\n", id, src_path);
+			fclose(w.file);
+			return false;
+		}
+		write_model(&w, id, verts.data(), num_verts, inds.data(), num_inds, meshes.data(), num_meshes, bounds);
+	}
+	for (uint32_t i = 0; i < header.num_mesh_textures; ++i) {
+		uint32_t tex_offset;
+		at = header.mesh_texture_table_offset + sizeof(uint32_t) * i;
+		read(&tex_offset, sizeof(tex_offset));
+		if (tex_offset == 0) // The packer writes zero for textures it failed to load.
+			continue;
+		at = tex_offset;
+		uint8_t bytes_per_pixel;
+		int width, height, pitch;
+		read(&bytes_per_pixel, sizeof(bytes_per_pixel));
+		read(&width, sizeof(width));
+		read(&height, sizeof(height));
+		read(&pitch, sizeof(pitch));
+		if (truncated || at + (size_t)pitch * height > data.size()) {
+			printf("Texture %u runs past the end of %s\n", i, src_path);
+			fclose(w.file);
+			return false;
+		}
+		write_texture(&w, i, width, height, pitch, bytes_per_pixel, &data[at]);
+	}
+	close_asset_writer(&w, header.num_mesh_textures);
+	printf("Converted %s to %s, %u entries\n", src_path, dst_path, (unsigned)w.toc.size());
+	return true;
+}
+
+// With no arguments, packs everything in model_map into assets.ahh.
+// --convert <old> <new> rewrites a version 1 asset file in the current format instead.
+// --compress fast|high compresses the payloads. Fast decodes as quickly but compresses worse than high.
 int
 main(int argc, char **argv)
 {
-	uint32_t num_textures_in_file = 0;
-	FILE *file = fopen("assets.ahh", "wb");
-	fseek(file, sizeof(Asset_File_Header), SEEK_CUR);
+	bool compress = false;
+	Lz_Level level = LZ_FAST;
+	const char *convert_src = NULL, *convert_dst = NULL;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc && (strcmp(argv[i + 1], "fast") == 0 || strcmp(argv[i + 1], "high") == 0)) {
+			compress = true;
+			level = strcmp(argv[++i], "high") == 0 ? LZ_HIGH : LZ_FAST;
+		} else if (strcmp(argv[i], "--convert") == 0 && i + 2 < argc) {
+			convert_src = argv[++i];
+			convert_dst = argv[++i];
+		} else {
+			printf("usage: %s [--compress fast|high] [--convert <old.ahh> <new.ahh>]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (convert_src)
+		return convert_v1_asset_file(convert_src, convert_dst, compress, level) ? 0 : 1;
 
-	struct Asset_File_Header header;
+	uint32_t num_textures_in_file = 0;
+	Asset_Writer w;
+	if (!open_asset_writer(&w, "assets.ahh", compress, level))
+		return 1;
 
 	// Write models.
 	int num_assets = sizeof(model_map)/sizeof(model_map[0]);
@@ -132,78 +612,41 @@ main(int argc, char **argv)
 			continue;
 		}
 		process_assimp_node(scene->mRootNode, scene, &rm);
-		header.named_asset_offsets[model_map[i].id] = ftell(file);
 
-		uint32_t num_verts = rm.vertices.size(), num_inds = rm.indices.size(), num_meshes = rm.raw_mesh_infos.size(), no_tex = (uint32_t) -1;
+		uint32_t num_verts = rm.vertices.size(), num_inds = rm.indices.size(), num_meshes = rm.raw_mesh_infos.size();
 		printf("%d %d %d\n", num_verts, num_inds, num_meshes);
-		fwrite(&num_verts, sizeof(uint32_t), 1, file);
-		fwrite(&num_inds, sizeof(uint32_t), 1, file);
-		fwrite(rm.vertices.data(), sizeof(Model_Vertex), rm.vertices.size(), file);
-		fwrite(rm.indices.data(), sizeof(unsigned), rm.indices.size(), file);
-		fwrite(&num_meshes, sizeof(uint32_t), 1, file);
+		std::vector<Asset_Mesh> meshes(num_meshes);
 		for (size_t j = 0; j < num_meshes; ++j) {
-			fwrite(&rm.raw_mesh_infos[j].num_indices, sizeof(uint32_t), 1, file);
-			fwrite(&rm.raw_mesh_infos[j].base_vertex, sizeof(uint32_t), 1, file);
-			printf("%d %d\n", rm.raw_mesh_infos[j].num_indices, rm.raw_mesh_infos[j].base_vertex);
+			const Raw_Mesh_Info &info = rm.raw_mesh_infos[j];
+			printf("%d %d\n", info.num_indices, info.base_vertex);
 			// TODO: Loop over all the textures we want to check for.
-			if (rm.raw_mesh_infos[j].specular_path) {
-				printf("Using specular texture %s\n", rm.raw_mesh_infos[j].specular_path->c_str());
-				auto it = texture_map.find(*rm.raw_mesh_infos[j].specular_path);
-				if (it == texture_map.end()) {
-					texture_map[*rm.raw_mesh_infos[j].specular_path] = num_textures_in_file;
-					fwrite(&num_textures_in_file, sizeof(uint32_t), 1, file);
-					++num_textures_in_file;
-				} else
-					fwrite(&it->second, sizeof(uint32_t), 1, file);
-			} else // No texture available.
-				fwrite(&no_tex, sizeof(uint32_t), 1, file);
-			if (rm.raw_mesh_infos[j].diffuse_path) {
-				printf("Using diffuse texture %s\n", rm.raw_mesh_infos[j].diffuse_path->c_str());
-				auto it = texture_map.find(*rm.raw_mesh_infos[j].diffuse_path);
-				if (it == texture_map.end()) {
-					texture_map[*rm.raw_mesh_infos[j].diffuse_path] = num_textures_in_file;
-					fwrite(&num_textures_in_file, sizeof(uint32_t), 1, file);
-					++num_textures_in_file;
-				} else
-					fwrite(&it->second, sizeof(uint32_t), 1, file);
-			} else // No texture available.
-				fwrite(&no_tex, sizeof(uint32_t), 1, file);
+			if (info.specular_path)
+				printf("Using specular texture %s\n", info.specular_path->c_str());
+			if (info.diffuse_path)
+				printf("Using diffuse texture %s\n", info.diffuse_path->c_str());
+			meshes[j].num_indices = info.num_indices;
+			meshes[j].first_index = info.base_vertex;
+			meshes[j].specular_texture = get_texture_index(info.specular_path, &num_textures_in_file);
+			meshes[j].diffuse_texture = get_texture_index(info.diffuse_path, &num_textures_in_file);
+			meshes[j].bounds = compute_bounds(rm.vertices, &rm.indices[info.base_vertex], info.num_indices);
 		}
+		Asset_Bounds model_bounds = compute_bounds(rm.vertices, rm.indices.data(), rm.indices.size());
+		write_model(&w, model_map[i].id, rm.vertices.data(), num_verts, rm.indices.data(), num_inds, meshes.data(), num_meshes, model_bounds);
 		rm.vertices.clear();
 		rm.indices.clear();
 		rm.raw_mesh_infos.clear();
 	}
 	printf("num tex in file %d %d\n", num_textures_in_file, texture_map.size());
-	header.num_mesh_textures = num_textures_in_file;
-
-	// Write textures.
-	header.mesh_texture_table_offset = ftell(file);
-	fpos_t tex_table_pos;
-	fgetpos(file, &tex_table_pos);
-	uint32_t *tex_table_header = (uint32_t *)malloc(num_textures_in_file * sizeof(uint32_t));
-	fseek(file, num_textures_in_file * sizeof(uint32_t), SEEK_CUR);
+
+	// Write textures. Ones that fail to load get no entry, and the engine treats them like a missing texture.
 	for (auto itr : texture_map) {
 		SDL_Surface *tex;
 		if (!(tex = IMG_Load(itr.first.c_str()))) {
 			printf("IMG_Load failed! IMG_GetError: %s\n", IMG_GetError());
-			tex_table_header[itr.second] = 0;
 			continue;
 		}
-		tex_table_header[itr.second] = ftell(file);
-		fwrite(&tex->format->BytesPerPixel, sizeof(tex->format->BytesPerPixel), 1, file);
-		fwrite(&tex->w, sizeof(tex->w), 1, file);
-		fwrite(&tex->h, sizeof(tex->h), 1, file);
-		fwrite(&tex->pitch, sizeof(tex->pitch), 1, file);
-		fwrite(tex->pixels, tex->pitch * tex->h, 1, file);
+		write_texture(&w, itr.second, tex->w, tex->h, tex->pitch, tex->format->BytesPerPixel, tex->pixels);
+		SDL_FreeSurface(tex);
 	}
-
-	// Write tex table header.
-	fsetpos(file, &tex_table_pos);
-	fwrite(tex_table_header, sizeof(uint32_t), num_textures_in_file, file);
-
-	// Write asset file header.
-	fseek(file, 0, SEEK_SET);
-	fwrite(&header, sizeof(Asset_File_Header), 1, file);
-
-	free(tex_table_header);
+	close_asset_writer(&w, num_textures_in_file);
 }
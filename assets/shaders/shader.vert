@@ -29,10 +29,17 @@ layout (std140) uniform Matrices
 	}
 
 #elif defined(TEXTURED_MESH) || defined(UNTEXTURED_MESH)
-	uniform mat4 u_model;
-
 	layout (location = 0) in vec3 l_pos;
 	layout (location = 1) in vec3 l_normal;
+  #ifdef INSTANCED
+	// Per-instance attribute, the rows of a 3x4 affine matrix in locations 3 through 5.
+	layout (location = 3) in vec4 l_model_row0;
+	layout (location = 4) in vec4 l_model_row1;
+	layout (location = 5) in vec4 l_model_row2;
+	#define u_model transpose(mat4(l_model_row0, l_model_row1, l_model_row2, vec4(0.0, 0.0, 0.0, 1.0)))
+  #else
+	uniform mat4 u_model;
+  #endif
 
 	out vec3 t_normal;
 	out vec3 t_frag_pos;
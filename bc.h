@@ -0,0 +1,259 @@
+#ifndef __BC_H__
+#define __BC_H__
+
+// BC1 and BC3 (a.k.a. DXT1 and DXT5) block compression, shared by the asset packer and the engine.
+// Both work on 4x4 blocks of RGBA8 pixels, stored row major. A BC1 block is 8 bytes: two RGB565 endpoints and 2 bit indices into
+// the palette they span. A BC3 block is 16 bytes: an alpha block (two 8 bit endpoints and 3 bit indices into an 8 entry ramp)
+// followed by a BC1 color block that always uses the 4 color palette.
+// The encoder fits the color endpoints along the principal axis of the block's colors, then refines them with a least squares
+// fit to the chosen indices. The packer encodes, the engine only decodes when the driver can't take S3TC textures directly.
+// Only needs stdint.h, so it can go in either build.
+
+#define BC1_BLOCK_SIZE 8
+#define BC3_BLOCK_SIZE 16
+#define BC_REFINE_PASSES 2
+
+inline uint16_t
+bc_pack565(const float c[3])
+{
+	auto quantize = [](float v, int max) -> int {
+		int q = (int)(v * max / 255.0f + 0.5f);
+		return q < 0 ? 0 : (q > max ? max : q);
+	};
+	return (uint16_t)((quantize(c[0], 31) << 11) | (quantize(c[1], 63) << 5) | quantize(c[2], 31));
+}
+
+inline void
+bc_unpack565(uint16_t c, int out[3])
+{
+	int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+	out[0] = (r << 3) | (r >> 2);
+	out[1] = (g << 2) | (g >> 4);
+	out[2] = (b << 3) | (b >> 2);
+}
+
+// The palette a pair of endpoints decodes to. c0 > c1 selects the 4 color palette, otherwise the last entry is transparent black.
+inline void
+bc1_palette(uint16_t c0, uint16_t c1, bool force_four_colors, int palette[4][4])
+{
+	bc_unpack565(c0, palette[0]);
+	bc_unpack565(c1, palette[1]);
+	palette[0][3] = palette[1][3] = 255;
+	if (c0 > c1 || force_four_colors) {
+		for (int i = 0; i < 4; ++i) {
+			palette[2][i] = (2*palette[0][i] + palette[1][i]) / 3;
+			palette[3][i] = (palette[0][i] + 2*palette[1][i]) / 3;
+		}
+	} else {
+		for (int i = 0; i < 4; ++i) {
+			palette[2][i] = (palette[0][i] + palette[1][i]) / 2;
+			palette[3][i] = 0;
+		}
+	}
+}
+
+// Picks the nearest palette entry for every pixel. Returns the packed indices and writes the total squared error.
+inline uint32_t
+bc1_choose_indices(const uint8_t *rgba, const int palette[4][4], int num_colors, int *out_error)
+{
+	uint32_t indices = 0;
+	int error = 0;
+	for (int p = 0; p < 16; ++p) {
+		int best = 0, best_dist = 0x7fffffff;
+		for (int i = 0; i < num_colors; ++i) {
+			int dr = rgba[p*4] - palette[i][0], dg = rgba[p*4 + 1] - palette[i][1], db = rgba[p*4 + 2] - palette[i][2];
+			int dist = dr*dr + dg*dg + db*db;
+			if (dist < best_dist) {
+				best = i;
+				best_dist = dist;
+			}
+		}
+		indices |= (uint32_t)best << (p * 2);
+		error += best_dist;
+	}
+	*out_error = error;
+	return indices;
+}
+
+// Endpoints are ordered so the block always decodes with the 4 color palette, unless both quantize to the same color, in which
+// case every pixel uses endpoint 0.
+inline void
+bc1_write_block(const uint8_t *rgba, uint16_t c0, uint16_t c1, uint8_t *out, int *out_error)
+{
+	if (c0 < c1) {
+		uint16_t tmp = c0;
+		c0 = c1;
+		c1 = tmp;
+	}
+	int palette[4][4];
+	bc1_palette(c0, c1, false, palette);
+	uint32_t indices = bc1_choose_indices(rgba, palette, c0 == c1 ? 1 : 4, out_error);
+	out[0] = (uint8_t)c0;
+	out[1] = (uint8_t)(c0 >> 8);
+	out[2] = (uint8_t)c1;
+	out[3] = (uint8_t)(c1 >> 8);
+	for (int i = 0; i < 4; ++i)
+		out[4 + i] = (uint8_t)(indices >> (i * 8));
+}
+
+inline void
+bc1_encode_block(const uint8_t *rgba, uint8_t *out)
+{
+	float mean[3] = {};
+	for (int p = 0; p < 16; ++p) {
+		for (int i = 0; i < 3; ++i)
+			mean[i] += rgba[p*4 + i] / 16.0f;
+	}
+	float cov[6] = {}; // xx, xy, xz, yy, yz, zz
+	for (int p = 0; p < 16; ++p) {
+		float d[3] = { rgba[p*4] - mean[0], rgba[p*4 + 1] - mean[1], rgba[p*4 + 2] - mean[2] };
+		cov[0] += d[0]*d[0]; cov[1] += d[0]*d[1]; cov[2] += d[0]*d[2];
+		cov[3] += d[1]*d[1]; cov[4] += d[1]*d[2]; cov[5] += d[2]*d[2];
+	}
+	// Principal axis by power iteration, which converges fast enough for 16 points.
+	float axis[3] = { 1.0f, 1.0f, 1.0f };
+	for (int iter = 0; iter < 8; ++iter) {
+		float next[3] = {
+			cov[0]*axis[0] + cov[1]*axis[1] + cov[2]*axis[2],
+			cov[1]*axis[0] + cov[3]*axis[1] + cov[4]*axis[2],
+			cov[2]*axis[0] + cov[4]*axis[1] + cov[5]*axis[2],
+		};
+		float len = 0.0f;
+		for (int i = 0; i < 3; ++i)
+			len = (next[i] > len) ? next[i] : ((-next[i] > len) ? -next[i] : len);
+		if (len < 1e-6f)
+			break;
+		for (int i = 0; i < 3; ++i)
+			axis[i] = next[i] / len;
+	}
+	float min_t = 0.0f, max_t = 0.0f;
+	for (int p = 0; p < 16; ++p) {
+		float t = (rgba[p*4] - mean[0])*axis[0] + (rgba[p*4 + 1] - mean[1])*axis[1] + (rgba[p*4 + 2] - mean[2])*axis[2];
+		min_t = t < min_t ? t : min_t;
+		max_t = t > max_t ? t : max_t;
+	}
+	float axis_len_sq = axis[0]*axis[0] + axis[1]*axis[1] + axis[2]*axis[2];
+	float e0[3], e1[3];
+	for (int i = 0; i < 3; ++i) {
+		// Pulled in slightly, since the extremes are better served by the interpolated entries than by the endpoints themselves.
+		float inset = (max_t - min_t) / 16.0f;
+		e0[i] = mean[i] + axis[i] * (max_t - inset) / axis_len_sq;
+		e1[i] = mean[i] + axis[i] * (min_t + inset) / axis_len_sq;
+	}
+	uint16_t c0 = bc_pack565(e0), c1 = bc_pack565(e1);
+	int best_error;
+	bc1_write_block(rgba, c0, c1, out, &best_error);
+
+	for (int pass = 0; pass < BC_REFINE_PASSES && best_error > 0; ++pass) {
+		// Least squares endpoints for the current indices. Pixel p is w*e0 + (1 - w)*e1 with w taken from its palette entry.
+		static const float weights[4] = { 1.0f, 0.0f, 2.0f/3.0f, 1.0f/3.0f };
+		uint32_t indices = out[4] | (out[5] << 8) | (out[6] << 16) | ((uint32_t)out[7] << 24);
+		float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[3] = {}, bx[3] = {};
+		for (int p = 0; p < 16; ++p) {
+			float a = weights[(indices >> (p * 2)) & 3], b = 1.0f - a;
+			aa += a*a;
+			ab += a*b;
+			bb += b*b;
+			for (int i = 0; i < 3; ++i) {
+				ax[i] += a * rgba[p*4 + i];
+				bx[i] += b * rgba[p*4 + i];
+			}
+		}
+		float det = aa*bb - ab*ab;
+		if (det < 1e-6f && det > -1e-6f)
+			break;
+		for (int i = 0; i < 3; ++i) {
+			e0[i] = (ax[i]*bb - bx[i]*ab) / det;
+			e1[i] = (bx[i]*aa - ax[i]*ab) / det;
+		}
+		uint8_t candidate[BC1_BLOCK_SIZE];
+		int error;
+		bc1_write_block(rgba, bc_pack565(e0), bc_pack565(e1), candidate, &error);
+		if (error >= best_error)
+			break;
+		best_error = error;
+		for (int i = 0; i < BC1_BLOCK_SIZE; ++i)
+			out[i] = candidate[i];
+	}
+}
+
+inline void
+bc3_encode_alpha_block(const uint8_t *rgba, uint8_t *out)
+{
+	int a0 = 0, a1 = 255;
+	for (int p = 0; p < 16; ++p) {
+		a0 = rgba[p*4 + 3] > a0 ? rgba[p*4 + 3] : a0;
+		a1 = rgba[p*4 + 3] < a1 ? rgba[p*4 + 3] : a1;
+	}
+	out[0] = (uint8_t)a0;
+	out[1] = (uint8_t)a1;
+	// a0 > a1 selects the 8 value ramp. If they're equal every index is 0 and the ramp doesn't matter.
+	int ramp[8] = { a0, a1 };
+	for (int i = 1; i < 7; ++i)
+		ramp[i + 1] = ((7 - i)*a0 + i*a1) / 7;
+	uint64_t indices = 0;
+	for (int p = 0; p < 16 && a0 != a1; ++p) {
+		int best = 0, best_dist = 256;
+		for (int i = 0; i < 8; ++i) {
+			int dist = rgba[p*4 + 3] - ramp[i];
+			dist = dist < 0 ? -dist : dist;
+			if (dist < best_dist) {
+				best = i;
+				best_dist = dist;
+			}
+		}
+		indices |= (uint64_t)best << (p * 3);
+	}
+	for (int i = 0; i < 6; ++i)
+		out[2 + i] = (uint8_t)(indices >> (i * 8));
+}
+
+inline void
+bc3_encode_block(const uint8_t *rgba, uint8_t *out)
+{
+	bc3_encode_alpha_block(rgba, out);
+	bc1_encode_block(rgba, out + 8);
+}
+
+inline void
+bc1_decode_color(const uint8_t *in, bool force_four_colors, uint8_t *rgba)
+{
+	int palette[4][4];
+	bc1_palette(in[0] | (in[1] << 8), in[2] | (in[3] << 8), force_four_colors, palette);
+	uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t)in[7] << 24);
+	for (int p = 0; p < 16; ++p) {
+		const int *c = palette[(indices >> (p * 2)) & 3];
+		for (int i = 0; i < 4; ++i)
+			rgba[p*4 + i] = (uint8_t)c[i];
+	}
+}
+
+inline void
+bc1_decode_block(const uint8_t *in, uint8_t *rgba)
+{
+	bc1_decode_color(in, false, rgba);
+}
+
+inline void
+bc3_decode_block(const uint8_t *in, uint8_t *rgba)
+{
+	bc1_decode_color(in + 8, true, rgba);
+	int a0 = in[0], a1 = in[1];
+	int ramp[8] = { a0, a1 };
+	if (a0 > a1) {
+		for (int i = 1; i < 7; ++i)
+			ramp[i + 1] = ((7 - i)*a0 + i*a1) / 7;
+	} else {
+		for (int i = 1; i < 5; ++i)
+			ramp[i + 1] = ((5 - i)*a0 + i*a1) / 5;
+		ramp[6] = 0;
+		ramp[7] = 255;
+	}
+	uint64_t indices = 0;
+	for (int i = 0; i < 6; ++i)
+		indices |= (uint64_t)in[2 + i] << (i * 8);
+	for (int p = 0; p < 16; ++p)
+		rgba[p*4 + 3] = (uint8_t)ramp[(indices >> (p * 3)) & 7];
+}
+
+#endif
@@ -0,0 +1,490 @@
+// Dynamic AABB tree over scene instances.
+// Leaves hold a "fat" box, the tight box grown by a margin, so an instance can move around a little without touching the tree.
+// Only when the tight box leaves the fat one is the leaf pulled out and reinserted. Inserts pick a sibling by the surface area
+// heuristic and the path back up to the root is refit and rebalanced with tree rotations, so the height stays logarithmic.
+// Nodes live in one array that grows in place in a virtual arena, so growing it never copies the tree or moves a node.
+
+constexpr float BVH_FAT_MARGIN = 0.5f;
+constexpr int BVH_NULL_NODE = -1;
+constexpr int BVH_MAX_STACK_DEPTH = 256;
+
+struct Aabb {
+	Vec3f min;
+	Vec3f max;
+};
+
+struct Bvh_Node {
+	Aabb box;
+	void *user_data;
+	union {
+		int parent;
+		int next_free;
+	};
+	int child1;
+	int child2; // BVH_NULL_NODE for leaves.
+	int height; // 0 for leaves, -1 for free nodes.
+};
+
+struct Bvh {
+	Bvh_Node *nodes; // The base of memory.
+	Virtual_Arena memory;
+	int capacity;
+	int num_nodes;
+	int root;
+	int free_head;
+};
+
+// Called for each leaf the ray reaches, nearest box first. Returns the distance to the hit along the ray, or a negative number
+// for a miss. max_t is the closest hit found so far, so the callback can early out.
+typedef float (*Bvh_Ray_Callback)(void *user_data, Vec3f origin, Vec3f dir, float max_t, void *ctx);
+
+inline Aabb
+aabb_union(const Aabb &a, const Aabb &b)
+{
+	return { { _min(a.min.x, b.min.x), _min(a.min.y, b.min.y), _min(a.min.z, b.min.z) },
+	         { _max(a.max.x, b.max.x), _max(a.max.y, b.max.y), _max(a.max.z, b.max.z) } };
+}
+
+inline bool
+aabb_contains(const Aabb &outer, const Aabb &inner)
+{
+	return outer.min.x <= inner.min.x && outer.min.y <= inner.min.y && outer.min.z <= inner.min.z
+	    && outer.max.x >= inner.max.x && outer.max.y >= inner.max.y && outer.max.z >= inner.max.z;
+}
+
+// Half of the surface area, which is all the cost heuristic needs.
+inline float
+aabb_cost(const Aabb &a)
+{
+	float dx = a.max.x - a.min.x, dy = a.max.y - a.min.y, dz = a.max.z - a.min.z;
+	return dx*dy + dy*dz + dz*dx;
+}
+
+// World space box of a local space center/extents box under an affine transform.
+Aabb
+transform_aabb(Vec3f center, Vec3f extents, const Mat3x4 &m)
+{
+	Vec3f c = { m.m[0]*center.x + m.m[1]*center.y + m.m[2]*center.z  + m.m[3],
+	            m.m[4]*center.x + m.m[5]*center.y + m.m[6]*center.z  + m.m[7],
+	            m.m[8]*center.x + m.m[9]*center.y + m.m[10]*center.z + m.m[11] };
+	Vec3f e = { _fabs(m.m[0])*extents.x + _fabs(m.m[1])*extents.y + _fabs(m.m[2])*extents.z,
+	            _fabs(m.m[4])*extents.x + _fabs(m.m[5])*extents.y + _fabs(m.m[6])*extents.z,
+	            _fabs(m.m[8])*extents.x + _fabs(m.m[9])*extents.y + _fabs(m.m[10])*extents.z };
+	return { c - e, c + e };
+}
+
+// Slab test. inv_dir is 1/dir per component; infinities for axis aligned rays work out. Returns the entry distance or -1.
+inline float
+ray_aabb(const Aabb &b, Vec3f origin, Vec3f inv_dir, float max_t)
+{
+	float tx1 = (b.min.x - origin.x) * inv_dir.x, tx2 = (b.max.x - origin.x) * inv_dir.x;
+	float ty1 = (b.min.y - origin.y) * inv_dir.y, ty2 = (b.max.y - origin.y) * inv_dir.y;
+	float tz1 = (b.min.z - origin.z) * inv_dir.z, tz2 = (b.max.z - origin.z) * inv_dir.z;
+	float tmin = _max(_max(_min(tx1, tx2), _min(ty1, ty2)), _max(_min(tz1, tz2), 0.0f));
+	float tmax = _min(_min(_max(tx1, tx2), _max(ty1, ty2)), _min(_max(tz1, tz2), max_t));
+	return tmin <= tmax ? tmin : -1.0f;
+}
+
+void
+bvh_init(Bvh *t, int initial_capacity = 1024)
+{
+	t->memory = mem_make_virtual_arena();
+	t->nodes = (Bvh_Node *)t->memory.base;
+	mem_commit_virtual(&t->memory, sizeof(Bvh_Node) * initial_capacity);
+	t->capacity = (t->memory.committed_end - t->memory.base) / sizeof(Bvh_Node);
+	t->num_nodes = 0;
+	t->root = BVH_NULL_NODE;
+	t->free_head = BVH_NULL_NODE;
+}
+
+void
+bvh_destroy(Bvh *t)
+{
+	mem_destroy_virtual_arena(&t->memory);
+	*t = {};
+}
+
+static int
+bvh_alloc_node(Bvh *t)
+{
+	if (t->free_head == BVH_NULL_NODE) {
+		if (t->num_nodes == t->capacity) {
+			mem_commit_virtual(&t->memory, sizeof(Bvh_Node) * (t->num_nodes + 1));
+			t->capacity = (t->memory.committed_end - t->memory.base) / sizeof(Bvh_Node);
+		}
+		t->nodes[t->num_nodes].height = -1;
+		t->nodes[t->num_nodes].next_free = BVH_NULL_NODE;
+		t->free_head = t->num_nodes++;
+	}
+	int id = t->free_head;
+	Bvh_Node *n = &t->nodes[id];
+	t->free_head = n->next_free;
+	n->parent = BVH_NULL_NODE;
+	n->child1 = n->child2 = BVH_NULL_NODE;
+	n->height = 0;
+	n->user_data = NULL;
+	return id;
+}
+
+static void
+bvh_free_node(Bvh *t, int id)
+{
+	t->nodes[id].next_free = t->free_head;
+	t->nodes[id].height = -1;
+	t->free_head = id;
+}
+
+// If node a is imbalanced, rotates its taller child up into its place. Returns the index of the subtree's new root.
+static int
+bvh_balance(Bvh *t, int ia)
+{
+	Bvh_Node *a = &t->nodes[ia];
+	if (a->child2 == BVH_NULL_NODE || a->height < 2)
+		return ia;
+	int ib = a->child1, ic = a->child2;
+	Bvh_Node *b = &t->nodes[ib], *c = &t->nodes[ic];
+	int balance = c->height - b->height;
+	if (balance > 1) {
+		// Rotate c up.
+		int i_f = c->child1, ig = c->child2;
+		Bvh_Node *f = &t->nodes[i_f], *g = &t->nodes[ig];
+		c->child1 = ia;
+		c->parent = a->parent;
+		a->parent = ic;
+		if (c->parent == BVH_NULL_NODE)
+			t->root = ic;
+		else if (t->nodes[c->parent].child1 == ia)
+			t->nodes[c->parent].child1 = ic;
+		else
+			t->nodes[c->parent].child2 = ic;
+		// Keep the taller of c's children on c, hand the other to a.
+		if (f->height > g->height) {
+			c->child2 = i_f;
+			a->child2 = ig;
+			g->parent = ia;
+			a->box = aabb_union(b->box, g->box);
+			c->box = aabb_union(a->box, f->box);
+			a->height = 1 + _max(b->height, g->height);
+			c->height = 1 + _max(a->height, f->height);
+		} else {
+			c->child2 = ig;
+			a->child2 = i_f;
+			f->parent = ia;
+			a->box = aabb_union(b->box, f->box);
+			c->box = aabb_union(a->box, g->box);
+			a->height = 1 + _max(b->height, f->height);
+			c->height = 1 + _max(a->height, g->height);
+		}
+		return ic;
+	}
+	if (balance < -1) {
+		// Rotate b up.
+		int id = b->child1, ie = b->child2;
+		Bvh_Node *d = &t->nodes[id], *e = &t->nodes[ie];
+		b->child1 = ia;
+		b->parent = a->parent;
+		a->parent = ib;
+		if (b->parent == BVH_NULL_NODE)
+			t->root = ib;
+		else if (t->nodes[b->parent].child1 == ia)
+			t->nodes[b->parent].child1 = ib;
+		else
+			t->nodes[b->parent].child2 = ib;
+		if (d->height > e->height) {
+			b->child2 = id;
+			a->child1 = ie;
+			e->parent = ia;
+			a->box = aabb_union(c->box, e->box);
+			b->box = aabb_union(a->box, d->box);
+			a->height = 1 + _max(c->height, e->height);
+			b->height = 1 + _max(a->height, d->height);
+		} else {
+			b->child2 = ie;
+			a->child1 = id;
+			d->parent = ia;
+			a->box = aabb_union(c->box, d->box);
+			b->box = aabb_union(a->box, e->box);
+			a->height = 1 + _max(c->height, d->height);
+			b->height = 1 + _max(a->height, e->height);
+		}
+		return ib;
+	}
+	return ia;
+}
+
+// Walks from node i up to the root, refitting boxes and rebalancing along the way.
+static void
+bvh_refit_up(Bvh *t, int i)
+{
+	while (i != BVH_NULL_NODE) {
+		i = bvh_balance(t, i);
+		Bvh_Node *n = &t->nodes[i];
+		const Bvh_Node *c1 = &t->nodes[n->child1], *c2 = &t->nodes[n->child2];
+		n->height = 1 + _max(c1->height, c2->height);
+		n->box = aabb_union(c1->box, c2->box);
+		i = n->parent;
+	}
+}
+
+static void
+bvh_insert_leaf(Bvh *t, int leaf)
+{
+	if (t->root == BVH_NULL_NODE) {
+		t->root = leaf;
+		t->nodes[leaf].parent = BVH_NULL_NODE;
+		return;
+	}
+	// Descend towards the sibling that adds the least surface area to the tree.
+	Aabb leaf_box = t->nodes[leaf].box;
+	int i = t->root;
+	while (t->nodes[i].child2 != BVH_NULL_NODE) {
+		const Bvh_Node *n = &t->nodes[i];
+		float area = aabb_cost(n->box);
+		float combined_area = aabb_cost(aabb_union(n->box, leaf_box));
+		// Cost of making a new parent for this node and the leaf, and the cost pushed down to the children if we descend instead.
+		float cost = 2.0f * combined_area;
+		float inheritance_cost = 2.0f * (combined_area - area);
+		float child_costs[2];
+		int children[2] = { n->child1, n->child2 };
+		for (int c = 0; c < 2; ++c) {
+			const Bvh_Node *child = &t->nodes[children[c]];
+			float new_area = aabb_cost(aabb_union(child->box, leaf_box));
+			if (child->child2 == BVH_NULL_NODE)
+				child_costs[c] = new_area + inheritance_cost;
+			else
+				child_costs[c] = (new_area - aabb_cost(child->box)) + inheritance_cost;
+		}
+		if (cost < child_costs[0] && cost < child_costs[1])
+			break;
+		i = child_costs[0] < child_costs[1] ? children[0] : children[1];
+	}
+	int sibling = i;
+	int old_parent = t->nodes[sibling].parent;
+	int new_parent = bvh_alloc_node(t);
+	Bvh_Node *p = &t->nodes[new_parent];
+	p->parent = old_parent;
+	p->box = aabb_union(leaf_box, t->nodes[sibling].box);
+	p->height = t->nodes[sibling].height + 1;
+	p->child1 = sibling;
+	p->child2 = leaf;
+	t->nodes[sibling].parent = new_parent;
+	t->nodes[leaf].parent = new_parent;
+	if (old_parent == BVH_NULL_NODE) {
+		t->root = new_parent;
+	} else {
+		if (t->nodes[old_parent].child1 == sibling)
+			t->nodes[old_parent].child1 = new_parent;
+		else
+			t->nodes[old_parent].child2 = new_parent;
+	}
+	bvh_refit_up(t, t->nodes[leaf].parent);
+}
+
+static void
+bvh_remove_leaf(Bvh *t, int leaf)
+{
+	if (leaf == t->root) {
+		t->root = BVH_NULL_NODE;
+		return;
+	}
+	int parent = t->nodes[leaf].parent;
+	int grandparent = t->nodes[parent].parent;
+	int sibling = t->nodes[parent].child1 == leaf ? t->nodes[parent].child2 : t->nodes[parent].child1;
+	// The sibling takes the parent's place.
+	if (grandparent == BVH_NULL_NODE) {
+		t->root = sibling;
+		t->nodes[sibling].parent = BVH_NULL_NODE;
+	} else {
+		if (t->nodes[grandparent].child1 == parent)
+			t->nodes[grandparent].child1 = sibling;
+		else
+			t->nodes[grandparent].child2 = sibling;
+		t->nodes[sibling].parent = grandparent;
+	}
+	bvh_free_node(t, parent);
+	bvh_refit_up(t, grandparent);
+}
+
+inline Aabb
+fatten(const Aabb &b)
+{
+	Vec3f margin = { BVH_FAT_MARGIN, BVH_FAT_MARGIN, BVH_FAT_MARGIN };
+	return { b.min - margin, b.max + margin };
+}
+
+// Returns the proxy id, which stays valid until the proxy is removed.
+int
+bvh_insert(Bvh *t, const Aabb &box, void *user_data)
+{
+	int leaf = bvh_alloc_node(t);
+	t->nodes[leaf].box = fatten(box);
+	t->nodes[leaf].user_data = user_data;
+	bvh_insert_leaf(t, leaf);
+	return leaf;
+}
+
+void
+bvh_remove(Bvh *t, int proxy)
+{
+	assert(t->nodes[proxy].height == 0);
+	bvh_remove_leaf(t, proxy);
+	bvh_free_node(t, proxy);
+}
+
+// Returns true if the proxy had to be reinserted, false if the new box still fit inside its fat box.
+bool
+bvh_move(Bvh *t, int proxy, const Aabb &box)
+{
+	assert(t->nodes[proxy].height == 0);
+	if (aabb_contains(t->nodes[proxy].box, box))
+		return false;
+	bvh_remove_leaf(t, proxy);
+	t->nodes[proxy].box = fatten(box);
+	bvh_insert_leaf(t, proxy);
+	return true;
+}
+
+static size_t
+bvh_collect_leaves(const Bvh *t, int root, void **out, size_t num_out, size_t max_out)
+{
+	int stack[BVH_MAX_STACK_DEPTH];
+	int top = 0;
+	stack[top++] = root;
+	while (top > 0) {
+		const Bvh_Node *n = &t->nodes[stack[--top]];
+		if (n->child2 == BVH_NULL_NODE) {
+			if (num_out < max_out)
+				out[num_out++] = n->user_data;
+			continue;
+		}
+		assert(top + 2 <= BVH_MAX_STACK_DEPTH);
+		stack[top++] = n->child1;
+		stack[top++] = n->child2;
+	}
+	return num_out;
+}
+
+// Writes the user data of every leaf whose box touches the frustum to out, up to max_out. Returns the number written.
+// Subtrees entirely inside the frustum are gathered without any more plane tests.
+size_t
+bvh_query_frustum(const Bvh *t, const Frustum &f, void **out, size_t max_out)
+{
+	if (t->root == BVH_NULL_NODE)
+		return 0;
+	size_t num_out = 0;
+	int stack[BVH_MAX_STACK_DEPTH];
+	int top = 0;
+	stack[top++] = t->root;
+	while (top > 0) {
+		int i = stack[--top];
+		const Bvh_Node *n = &t->nodes[i];
+		Vec3f c = 0.5f * (n->box.min + n->box.max);
+		Vec3f e = 0.5f * (n->box.max - n->box.min);
+		bool inside = true;
+		bool outside = false;
+		for (int p = 0; p < 6; ++p) {
+			float dist = f.nx[p]*c.x + f.ny[p]*c.y + f.nz[p]*c.z + f.d[p];
+			float radius = _fabs(f.nx[p])*e.x + _fabs(f.ny[p])*e.y + _fabs(f.nz[p])*e.z;
+			if (dist + radius < 0.0f) {
+				outside = true;
+				break;
+			}
+			if (dist - radius < 0.0f)
+				inside = false;
+		}
+		if (outside)
+			continue;
+		if (inside || n->child2 == BVH_NULL_NODE) {
+			num_out = bvh_collect_leaves(t, i, out, num_out, max_out);
+			continue;
+		}
+		assert(top + 2 <= BVH_MAX_STACK_DEPTH);
+		stack[top++] = n->child1;
+		stack[top++] = n->child2;
+	}
+	return num_out;
+}
+
+size_t
+bvh_query_sphere(const Bvh *t, Vec3f center, float radius, void **out, size_t max_out)
+{
+	if (t->root == BVH_NULL_NODE)
+		return 0;
+	size_t num_out = 0;
+	float radius2 = radius * radius;
+	int stack[BVH_MAX_STACK_DEPTH];
+	int top = 0;
+	stack[top++] = t->root;
+	while (top > 0) {
+		const Bvh_Node *n = &t->nodes[stack[--top]];
+		// Squared distance from the center to the closest point of the box.
+		Vec3f closest = { _max(n->box.min.x, _min(center.x, n->box.max.x)),
+		                  _max(n->box.min.y, _min(center.y, n->box.max.y)),
+		                  _max(n->box.min.z, _min(center.z, n->box.max.z)) };
+		if (length2(closest - center) > radius2)
+			continue;
+		if (n->child2 == BVH_NULL_NODE) {
+			if (num_out < max_out)
+				out[num_out++] = n->user_data;
+			continue;
+		}
+		assert(top + 2 <= BVH_MAX_STACK_DEPTH);
+		stack[top++] = n->child1;
+		stack[top++] = n->child2;
+	}
+	return num_out;
+}
+
+// Finds the closest leaf hit along the ray within max_t. Children are visited nearest first and anything further away than the
+// best hit so far is skipped. With no callback the leaf box itself counts as the hit. Returns the hit leaf's user data, or NULL.
+void *
+bvh_query_ray(const Bvh *t, Vec3f origin, Vec3f dir, float max_t, Bvh_Ray_Callback callback, void *ctx, float *out_t)
+{
+	if (t->root == BVH_NULL_NODE)
+		return NULL;
+	Vec3f inv_dir = { 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z };
+	void *hit = NULL;
+	float best_t = max_t;
+	int stack[BVH_MAX_STACK_DEPTH];
+	float stack_t[BVH_MAX_STACK_DEPTH];
+	int top = 0;
+	float root_t = ray_aabb(t->nodes[t->root].box, origin, inv_dir, best_t);
+	if (root_t < 0.0f)
+		return NULL;
+	stack[top] = t->root;
+	stack_t[top++] = root_t;
+	while (top > 0) {
+		--top;
+		if (stack_t[top] > best_t)
+			continue;
+		const Bvh_Node *n = &t->nodes[stack[top]];
+		if (n->child2 == BVH_NULL_NODE) {
+			float leaf_t = callback ? callback(n->user_data, origin, dir, best_t, ctx) : stack_t[top];
+			if (leaf_t >= 0.0f && leaf_t <= best_t) {
+				best_t = leaf_t;
+				hit = n->user_data;
+			}
+			continue;
+		}
+		float t1 = ray_aabb(t->nodes[n->child1].box, origin, inv_dir, best_t);
+		float t2 = ray_aabb(t->nodes[n->child2].box, origin, inv_dir, best_t);
+		int c1 = n->child1, c2 = n->child2;
+		// Push the further child first so the nearer one is popped next.
+		if (t1 >= 0.0f && t2 >= 0.0f && t1 < t2) {
+			swap(t1, t2);
+			swap(c1, c2);
+		}
+		assert(top + 2 <= BVH_MAX_STACK_DEPTH);
+		if (t1 >= 0.0f) {
+			stack[top] = c1;
+			stack_t[top++] = t1;
+		}
+		if (t2 >= 0.0f) {
+			stack[top] = c2;
+			stack_t[top++] = t2;
+		}
+	}
+	if (hit && out_t)
+		*out_t = best_t;
+	return hit;
+}
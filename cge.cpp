@@ -3,6 +3,8 @@
 #include <stdarg.h>
 
 #include "asset_ids.h"
+#include "lz.h"
+#include "bc.h"
 #include "math.h"
 #include "lib.h"
 #include "input.h"
@@ -10,6 +12,12 @@
 #include "platform.h"
 #include "memory.cpp"
 #include "lib.cpp"
+#include "job.cpp"
+#include "gl_state.cpp"
+#include "cull.cpp"
+#include "transform.cpp"
+#include "bvh.cpp"
+#include "mesh_bvh.cpp"
 #include "render.cpp"
 #include "input.cpp"
 
@@ -93,6 +101,265 @@ update_camera(const Mouse& m, Keyboard *kb, Camera *cam)
 	}
 }
 
+// Debug helper for comparing submission paths: fills out a grid of instances until the model has count instances.
+void
+spawn_instance_grid(Model_ID id, size_t count)
+{
+	constexpr size_t ROW_LEN = 100;
+	constexpr float SPACING = 10.0f;
+	for (size_t i = g_num_model_instances[id]; i < count; ++i)
+		render_add_instance(id, { (float)(i % ROW_LEN) * SPACING, 0.0f, (float)(i / ROW_LEN) * SPACING });
+}
+
+// Debug helper for the transform path: turns every instance of a model to the same angle about y, so all of them are updated
+// every frame.
+void
+spin_instances(Model_ID id, float angle)
+{
+	Quat rot = make_quat({ 0.0f, 1.0f, 0.0f }, angle);
+	for (Model_Instance *inst = g_model_instances[id]; inst; inst = inst->next)
+		transform_set_rotation(&g_instance_transforms, inst->transform, rot);
+}
+
+// Debug benchmark for the scene BVH: inserts, moves and queries 100k boxes in a tree of its own, so the scene isn't touched.
+void
+bench_scene_bvh(const Mat4 &proj_view)
+{
+	constexpr int NUM_BOXES = 100000;
+	constexpr int NUM_QUERIES = 1000;
+	uint32_t rng = DEFAULT_RAND_SEED;
+	auto rand_pos = [&rng]() -> Vec3f { return { rand01(&rng) * 1000.0f, rand01(&rng) * 20.0f, rand01(&rng) * 1000.0f }; };
+	Vec3f half = { 1.0f, 8.0f, 1.0f };
+
+	Bvh t;
+	bvh_init(&t, NUM_BOXES * 2);
+	Aabb *boxes = (Aabb *)malloc(sizeof(Aabb) * NUM_BOXES);
+	int *proxies = (int *)malloc(sizeof(int) * NUM_BOXES);
+	void **results = (void **)malloc(sizeof(void *) * NUM_BOXES);
+	DEFER(free(boxes); free(proxies); free(results));
+
+	Platform_Time start = platform_get_time();
+	for (int i = 0; i < NUM_BOXES; ++i) {
+		Vec3f p = rand_pos();
+		boxes[i] = { p - half, p + half };
+		proxies[i] = bvh_insert(&t, boxes[i], &boxes[i]);
+	}
+	debug_print("bvh: insert %d boxes %lus\n", NUM_BOXES, platform_time_diff(start, platform_get_time(), 1000));
+
+	// Small moves mostly stay inside the fat boxes, big ones force a reinsert.
+	int num_reinserted = 0;
+	start = platform_get_time();
+	for (int i = 0; i < NUM_BOXES; ++i) {
+		Vec3f d = (i % 10 == 0) ? Vec3f{ rand01(&rng) * 50.0f, 0.0f, rand01(&rng) * 50.0f } : Vec3f{ rand01(&rng) * 0.2f, 0.0f, rand01(&rng) * 0.2f };
+		boxes[i] = { boxes[i].min + d, boxes[i].max + d };
+		num_reinserted += bvh_move(&t, proxies[i], boxes[i]);
+	}
+	debug_print("bvh: move %d boxes (%d reinserted) %lus\n", NUM_BOXES, num_reinserted, platform_time_diff(start, platform_get_time(), 1000));
+
+	Frustum f = make_frustum(proj_view);
+	start = platform_get_time();
+	size_t num_in_frustum = bvh_query_frustum(&t, f, results, NUM_BOXES);
+	long tree_us = platform_time_diff(start, platform_get_time(), 1000);
+	size_t num_linear = 0;
+	start = platform_get_time();
+	for (int i = 0; i < NUM_BOXES; ++i)
+		num_linear += cull_box_scalar(f, 0.5f * (boxes[i].min.x + boxes[i].max.x), 0.5f * (boxes[i].min.y + boxes[i].max.y), 0.5f * (boxes[i].min.z + boxes[i].max.z), half.x, half.y, half.z);
+	long linear_us = platform_time_diff(start, platform_get_time(), 1000);
+	debug_print("bvh: frustum query %l hits %lus, linear scan %l hits %lus\n", (long)num_in_frustum, tree_us, (long)num_linear, linear_us);
+
+	size_t num_ray_hits = 0;
+	start = platform_get_time();
+	for (int i = 0; i < NUM_QUERIES; ++i) {
+		Vec3f o = rand_pos();
+		o.y = 100.0f;
+		float hit_t;
+		num_ray_hits += bvh_query_ray(&t, o, normalize(Vec3f{ rand01(&rng) - 0.5f, -1.0f, rand01(&rng) - 0.5f }), 1000.0f, NULL, NULL, &hit_t) != NULL;
+	}
+	debug_print("bvh: %d ray queries (%l hits) %lus\n", NUM_QUERIES, (long)num_ray_hits, platform_time_diff(start, platform_get_time(), 1000));
+
+	size_t num_sphere_hits = 0;
+	start = platform_get_time();
+	for (int i = 0; i < NUM_QUERIES; ++i)
+		num_sphere_hits += bvh_query_sphere(&t, rand_pos(), 10.0f, results, NUM_BOXES);
+	debug_print("bvh: %d sphere queries (%l hits) %lus\n", NUM_QUERIES, (long)num_sphere_hits, platform_time_diff(start, platform_get_time(), 1000));
+	bvh_destroy(&t);
+}
+
+// Debug benchmark for asset loading: decodes every entry of each pack, first with the pack evicted from the page cache and then
+// again with it warm, both through the mapping, then evicts it again and reads every entry through the async file API. Decoded
+// bytes are summed so raw packs pay for reading their pages too. Packs that don't exist are skipped.
+// Make the compressed packs with asset_packer --compress fast|high and rename them to match.
+void
+bench_asset_packs()
+{
+	const char *packs[] = { "assets.ahh", "assets_raw.ahh", "assets_fast.ahh", "assets_high.ahh" };
+	const char *mode_names[] = { "mapped cold", "mapped warm", "async cold" };
+	Platform_Async_Io io;
+	if (!platform_init_async_io(&io, ASSET_READ_BATCH_SIZE))
+		return;
+	for (const char *path : packs) {
+		for (int mode = 0; mode < 3; ++mode) {
+			if (mode != 1)
+				platform_evict_file_cache(path);
+			Platform_Time start = platform_get_time();
+			Mapped_File file = platform_map_file(path);
+			if (!file.data)
+				break;
+			const Asset_File_Header *header = (const Asset_File_Header *)file.data;
+			if (file.size < sizeof(Asset_File_Header) || header->magic != ASSET_FILE_MAGIC || header->version != ASSET_FILE_VERSION) {
+				zerror("%s is not a version %d asset file", path, ASSET_FILE_VERSION);
+				platform_unmap_file(&file);
+				break;
+			}
+			const Asset_Toc_Entry *toc = (const Asset_Toc_Entry *)(file.data + header->toc_offset);
+			Scratch_Arena arena = mem_make_scratch();
+			char **stored = NULL;
+			if (mode == 2) {
+				// All of the reads go out at once, the decode starts once they're all back.
+				const Asset_Toc_Entry **entries = mem_alloc_array(const Asset_Toc_Entry *, header->num_entries, &arena);
+				Scratch_Arena **arenas = mem_alloc_array(Scratch_Arena *, header->num_entries, &arena);
+				stored = mem_alloc_array(char *, header->num_entries, &arena);
+				for (uint32_t i = 0; i < header->num_entries; ++i) {
+					entries[i] = &toc[i];
+					arenas[i] = &arena;
+				}
+				File_Handle fh = platform_open_file(path, "r");
+				read_asset_entries(&io, fh, entries, arenas, stored, header->num_entries);
+				platform_close_file(fh);
+			}
+			uint64_t stored_bytes = 0, decoded_bytes = 0, sum = 0;
+			for (uint32_t i = 0; i < header->num_entries; ++i) {
+				Scratch_Mark mark = mem_mark(&arena);
+				const char *data;
+				if (mode == 2)
+					data = stored[i] ? decode_asset_entry(stored[i], &toc[i], &arena) : NULL;
+				else
+					data = get_asset_entry_data(file, &toc[i], &arena);
+				for (uint64_t j = 0; data && j < toc[i].uncompressed_size; j += 64)
+					sum += data[j];
+				stored_bytes += toc[i].size;
+				decoded_bytes += toc[i].uncompressed_size;
+				mem_rewind(&arena, mark);
+			}
+			mem_destroy_scratch(&arena);
+			platform_unmap_file(&file);
+			long us = platform_time_diff(start, platform_get_time(), 1000);
+			debug_print("%s %s: %l KiB stored, %l KiB decoded in %lus (checksum %d)\n", path, mode_names[mode], (long)(stored_bytes / 1024), (long)(decoded_bytes / 1024), us, (int)sum);
+		}
+	}
+	debug_print("async reads went through %s\n", platform_async_io_backend(&io));
+	platform_destroy_async_io(&io);
+}
+
+static void
+print_slab_stats(const char *name, const Slab_Allocator *sa)
+{
+	Slab_Stats stats[NUM_SLAB_CLASSES];
+	mem_slab_stats(sa, stats);
+	for (int c = 0; c < NUM_SLAB_CLASSES; ++c) {
+		if (stats[c].num_slabs == 0)
+			continue;
+		debug_print("%s: %l byte objects, %d slabs, %l of %l used\n", name, (long)stats[c].object_size, stats[c].num_slabs,
+		            (long)stats[c].num_used, (long)stats[c].capacity);
+	}
+	if (sa->num_large > 0)
+		debug_print("%s: %d large objects, %l bytes\n", name, sa->num_large, (long)sa->large_bytes);
+}
+
+// Debug benchmark for long lived objects that churn: keeps NUM_LIVE objects of random sizes alive and replaces a random one
+// at a time, first out of a slab allocator, then out of an arena with mem_free(). Prints the occupancy of the bench allocator
+// and the instance allocator afterwards.
+void
+bench_slab_allocator()
+{
+	constexpr uint32_t NUM_LIVE = 10000;
+	constexpr uint32_t NUM_OPS = 200000;
+	constexpr size_t MAX_SIZE = 512;
+	uint32_t rng = DEFAULT_RAND_SEED;
+	Scratch_Mark mark = mem_mark(mem_frame_arena());
+	DEFER(mem_rewind(mem_frame_arena(), mark));
+	void **live = mem_alloc_array(void *, NUM_LIVE, mem_frame_arena());
+
+	Slab_Allocator slab = mem_make_slab_allocator();
+	for (uint32_t i = 0; i < NUM_LIVE; ++i)
+		live[i] = mem_slab_alloc(&slab, 16 + xorshift32(&rng) % MAX_SIZE);
+	Platform_Time start = platform_get_time();
+	for (uint32_t i = 0; i < NUM_OPS; ++i) {
+		uint32_t j = xorshift32(&rng) % NUM_LIVE;
+		mem_slab_free(&slab, live[j]);
+		live[j] = mem_slab_alloc(&slab, 16 + xorshift32(&rng) % MAX_SIZE, (i & 1) ? 64 : 16);
+	}
+	long us = platform_time_diff(start, platform_get_time(), 1000);
+	debug_print("slab: %d frees and allocs with %d live in %lus, %lns per pair\n", NUM_OPS, NUM_LIVE, us, us * 1000 / NUM_OPS);
+	print_slab_stats("slab bench", &slab);
+	mem_destroy_slab_allocator(&slab);
+
+	Memory_Arena arena = mem_make_arena();
+	for (uint32_t i = 0; i < NUM_LIVE; ++i)
+		live[i] = mem_push(16 + xorshift32(&rng) % MAX_SIZE, &arena);
+	start = platform_get_time();
+	for (uint32_t i = 0; i < NUM_OPS; ++i) {
+		uint32_t j = xorshift32(&rng) % NUM_LIVE;
+		mem_free(&arena, live[j]);
+		live[j] = mem_push(16 + xorshift32(&rng) % MAX_SIZE, &arena);
+	}
+	us = platform_time_diff(start, platform_get_time(), 1000);
+	debug_print("arena: %d frees and pushes with %d live in %lus, %lns per pair\n", NUM_OPS, NUM_LIVE, us, us * 1000 / NUM_OPS);
+	mem_destroy_arena(&arena);
+
+	print_slab_stats("instances", &g_instance_slab);
+}
+
+#ifdef MEM_INSTRUMENT
+static void
+write_formatted(File_Handle fh, const char *fmt, ...)
+{
+	char buf[1024];
+	va_list args;
+	va_start(args, fmt);
+	size_t n = format_string(fmt, args, buf);
+	va_end(args);
+	platform_write(fh, n, buf);
+}
+#endif
+
+// Debug report for the allocator: block counts and each arena's usage. Fragmentation is the share of the blocks an arena holds
+// that is wasted or sitting in free entries. The allocation trace goes to alloc_trace.txt, one record per line, oldest first.
+void
+report_memory()
+{
+#ifdef MEM_INSTRUMENT
+	Block_Stats b = mem_get_block_stats();
+	uint32_t num_in_use = b.num_blocks_carved - b.num_free_list_blocks - b.num_cached_blocks;
+	debug_print("memory: %d chunks, %d blocks carved, %d in the free list, %d in thread caches, %d in use\n", b.num_chunks,
+	            b.num_blocks_carved, b.num_free_list_blocks, b.num_cached_blocks, num_in_use);
+
+	Scratch_Mark mark = mem_mark(mem_frame_arena());
+	DEFER(mem_rewind(mem_frame_arena(), mark));
+	Arena_Stats *stats = mem_alloc_array(Arena_Stats, MEM_MAX_TRACKED_ARENAS + 1, mem_frame_arena());
+	uint32_t num_arenas = mem_get_arena_stats(stats, MEM_MAX_TRACKED_ARENAS + 1);
+	for (uint32_t i = 0; i < num_arenas; ++i) {
+		const Arena_Stats &s = stats[i];
+		double held = (double)s.num_blocks * BLOCK_DATA_SIZE;
+		debug_print("  %s: %d blocks, %l live, %l peak, %l free, %l wasted, fragmentation %f\n", s.name, s.num_blocks, (long)s.live_bytes,
+		            (long)s.peak_bytes, (long)s.free_bytes, (long)s.wasted_bytes, held > 0.0 ? (s.wasted_bytes + s.free_bytes) / held : 0.0);
+	}
+
+	static const char *op_names[] = { "push", "push_contiguous", "free" };
+	Allocation_Record *records = mem_alloc_array(Allocation_Record, MEM_TRACE_SIZE, mem_frame_arena());
+	uint32_t num_records = mem_get_allocation_trace(records, MEM_TRACE_SIZE);
+	File_Handle fh = platform_open_file("alloc_trace.txt", "w");
+	for (uint32_t i = 0; i < num_records; ++i) {
+		const Allocation_Record &r = records[i];
+		write_formatted(fh, "%s %s %l %l %s:%d\n", r.arena, op_names[r.op], (long)r.size, (long)r.p, r.file ? r.file : "memory.cpp", r.line);
+	}
+	platform_close_file(fh);
+	debug_print("memory: wrote %d allocation records to alloc_trace.txt\n", num_records);
+#else
+	debug_print("memory: build with -DMEM_INSTRUMENT for allocator stats\n");
+#endif
+}
+
 void
 main_loop(Vec2u screen_dim)
 {
@@ -109,20 +376,43 @@ main_loop(Vec2u screen_dim)
 	constexpr unsigned MAX_FRAMESKIP = 5;
 	unsigned num_updates = 0;
 	//unsigned next_tick = SDL_GetTicks();
+	MEM_NAME_ARENA(&g_frame_arenas[0], "frame");
+	MEM_NAME_ARENA(&g_frame_arenas[1], "frame");
+	math_init();
+	job_init();
 	render_init(cam, screen_dim);
 	render_add_instance(NANOSUIT_MODEL, { 0.0f, 0.0f, 0.0f });
 	render_add_instance(NANOSUIT_MODEL, { 0.0f, 0.0f, 50.0f });
 
+	// Frame time stats. G toggles between instanced and per-instance submission, R steps the instance count through 1k, 10k and 100k.
+	// Z toggles spinning every instance, which updates all of their transforms each frame.
+	constexpr unsigned FRAMES_PER_REPORT = 64;
+	const size_t bench_instance_counts[] = { 1000, 10000, 100000 };
+	unsigned bench_step = 0, num_timed_frames = 0;
+	long frame_time_accum_us = 0;
+	bool spinning = false;
+	float spin_angle = 0.0f;
+	Platform_Memory_Counters report_start_counters = platform_get_memory_counters();
+	bool was_mouse_down = false;
+
 	while (state != Program_State::exit) {
 		switch (state) {
 		case Program_State::run: {
 			num_updates = 0;
 			//while (next_tick < SDL_GetTicks() && num_updates < MAX_FRAMESKIP) {
 			while (1) {
-				if (MBUTTON_IS_DOWN(input.mouse.buttons, MBUTTON_1)) {
-					Vec3f pt;
-					raycast_plane(input.mouse.pos, {0.0f, 1.0f, 0.0f}, cam.pos, 0.0f, screen_dim, &pt);
+				bool mouse_down = MBUTTON_IS_DOWN(input.mouse.buttons, MBUTTON_1);
+				if (mouse_down && !was_mouse_down) {
+					Pick_Result pick;
+					Platform_Time pick_start = platform_get_time();
+					bool hit = render_pick(input.mouse.pos, screen_dim, &pick);
+					long pick_us = platform_time_diff(pick_start, platform_get_time(), 1000);
+					if (hit)
+						debug_print("pick: model %d instance %l mesh %d triangle %d bary (%f, %f) dist %f, %lus\n", pick.instance->model, (long)pick.instance->bvh_proxy, pick.mesh, pick.triangle, pick.u, pick.v, pick.distance, pick_us);
+					else
+						debug_print("pick: nothing, %lus\n", pick_us);
 				}
+				was_mouse_down = mouse_down;
 				platform_handle_events(&input);
 				//state = handle_events(&kb, &mouse, screen_dim, cam);
 				//input_update_mouse(&mouse);
@@ -130,10 +420,60 @@ main_loop(Vec2u screen_dim)
 				//state = ui_update(mouse, screen_dim, state, &ui);
 				//next_tick += SKIP_TICKS;
 				++num_updates;
+				if (input_was_key_pressed(&input.keyboard, G_KEY)) {
+					g_instanced_rendering = !g_instanced_rendering;
+					num_timed_frames = frame_time_accum_us = 0;
+				}
+				if (input_was_key_pressed(&input.keyboard, R_KEY) && bench_step < ARR_LEN(bench_instance_counts)) {
+					spawn_instance_grid(NANOSUIT_MODEL, bench_instance_counts[bench_step++]);
+					num_timed_frames = frame_time_accum_us = 0;
+				}
+				if (input_was_key_pressed(&input.keyboard, B_KEY))
+					bench_scene_bvh(g_matrices.perspective_proj * g_matrices.view);
+				if (input_was_key_pressed(&input.keyboard, L_KEY))
+					bench_asset_packs();
+				if (input_was_key_pressed(&input.keyboard, K_KEY))
+					bench_slab_allocator();
+				if (input_was_key_pressed(&input.keyboard, T_KEY))
+					report_memory();
+				if (input_was_key_pressed(&input.keyboard, Z_KEY)) {
+					spinning = !spinning;
+					num_timed_frames = frame_time_accum_us = 0;
+				}
+				if (num_timed_frames == 0)
+					report_start_counters = platform_get_memory_counters();
+				Platform_Time frame_start = platform_get_time();
 				update_camera(input.mouse, &input.keyboard, &cam);
+				if (spinning) {
+					spin_angle = _fmod(spin_angle + 0.02f, M_PI_TIMES_2);
+					spin_instances(NANOSUIT_MODEL, spin_angle);
+				}
 				render_update_view(cam);
 				render_sim();
+				glFinish(); // Make sure GPU time is counted against the frame it belongs to.
+				frame_time_accum_us += platform_time_diff(frame_start, platform_get_time(), 1000);
+				if (++num_timed_frames == FRAMES_PER_REPORT) {
+					debug_print("%s: %l instances, avg frame %lus\n", g_instanced_rendering ? "instanced" : "per-instance", (long)g_num_model_instances[NANOSUIT_MODEL], frame_time_accum_us / FRAMES_PER_REPORT);
+					debug_print("  %l instances drawn, %l culled, %l meshes drawn, %l culled\n", (long)g_render_stats.num_instances_drawn, (long)g_render_stats.num_instances_culled, (long)g_render_stats.num_meshes_drawn, (long)g_render_stats.num_meshes_culled);
+					debug_print("  %l commands, %l draws, %l state changes, %l saved by sorting\n", (long)g_render_stats.num_commands, (long)g_render_stats.num_draw_calls, (long)g_render_stats.num_state_changes, (long)g_render_stats.num_state_changes_saved);
+					debug_print("  %l of %l GL binds skipped by the state cache\n", (long)g_gl_state.num_skipped, (long)g_gl_state.num_calls);
+					g_gl_state.num_calls = g_gl_state.num_skipped = 0;
+					if (g_streamer.num_made_resident > 0)
+						debug_print("  %d models made resident, slowest %lus after it was requested\n", g_streamer.num_made_resident, g_streamer.max_resident_us);
+					g_streamer.num_made_resident = 0;
+					g_streamer.max_resident_us = 0;
+					debug_print("  %l transforms updated\n", (long)g_render_stats.num_transforms_updated);
+					Platform_Memory_Counters counters = platform_get_memory_counters();
+					debug_print("  per frame: %l minor faults, %l major faults", (counters.minor_faults - report_start_counters.minor_faults) / FRAMES_PER_REPORT,
+					            (counters.major_faults - report_start_counters.major_faults) / FRAMES_PER_REPORT);
+					if (counters.dtlb_misses >= 0)
+						debug_print(", %l dTLB misses, %l iTLB misses", (counters.dtlb_misses - report_start_counters.dtlb_misses) / FRAMES_PER_REPORT,
+						            (counters.itlb_misses - report_start_counters.itlb_misses) / FRAMES_PER_REPORT);
+					debug_print("\n");
+					num_timed_frames = frame_time_accum_us = 0;
+				}
 				platform_swap_buffers();
+				mem_end_frame();
 			}
 			//render_sim();
 			//render_ui(ui);
@@ -0,0 +1,168 @@
+// Frustum culling.
+// Boxes are kept as center/half-extent pairs in structure-of-arrays form so that the plane tests run on 4 (SSE) or 8 (AVX) boxes
+// at once, whichever math_init() picked. A box is outside if it is entirely behind any one plane.
+
+struct Frustum {
+	// Plane i is nx[i]*x + ny[i]*y + nz[i]*z + d[i] = 0, with the normal pointing into the frustum.
+	float nx[6];
+	float ny[6];
+	float nz[6];
+	float d[6];
+};
+
+struct Cull_Boxes {
+	float *cx, *cy, *cz;
+	float *ex, *ey, *ez;
+	size_t capacity;
+};
+
+// Gribb/Hartmann plane extraction. Works on the combined projection * view matrix, so the planes come out in world space.
+Frustum
+make_frustum(Mat4 clip)
+{
+	// Row i of the (column major) clip matrix.
+	auto row = [&clip](int i) -> Vec4f { return { clip[i], clip[4 + i], clip[8 + i], clip[12 + i] }; };
+	Vec4f r0 = row(0), r1 = row(1), r2 = row(2), r3 = row(3);
+	Vec4f planes[6] = {
+		{ r3.x + r0.x, r3.y + r0.y, r3.z + r0.z, r3.w + r0.w }, // left
+		{ r3.x - r0.x, r3.y - r0.y, r3.z - r0.z, r3.w - r0.w }, // right
+		{ r3.x + r1.x, r3.y + r1.y, r3.z + r1.z, r3.w + r1.w }, // bottom
+		{ r3.x - r1.x, r3.y - r1.y, r3.z - r1.z, r3.w - r1.w }, // top
+		{ r3.x + r2.x, r3.y + r2.y, r3.z + r2.z, r3.w + r2.w }, // near
+		{ r3.x - r2.x, r3.y - r2.y, r3.z - r2.z, r3.w - r2.w }, // far
+	};
+	Frustum f;
+	for (int i = 0; i < 6; ++i) {
+		// Normalized so that plane distances are real distances, which the sphere tests rely on.
+		float inv_len = 1.0f / _sqrt(planes[i].x*planes[i].x + planes[i].y*planes[i].y + planes[i].z*planes[i].z);
+		f.nx[i] = planes[i].x * inv_len;
+		f.ny[i] = planes[i].y * inv_len;
+		f.nz[i] = planes[i].z * inv_len;
+		f.d[i] = planes[i].w * inv_len;
+	}
+	return f;
+}
+
+Cull_Boxes
+make_cull_boxes(size_t capacity, Memory_Arena *arena)
+{
+	// Rounded up to a whole number of SIMD lanes so the last group can be loaded without a special case.
+	capacity = (capacity + 7) & ~(size_t)7;
+	Cull_Boxes b;
+	b.cx = mem_alloc_array(float, capacity, arena);
+	b.cy = mem_alloc_array(float, capacity, arena);
+	b.cz = mem_alloc_array(float, capacity, arena);
+	b.ex = mem_alloc_array(float, capacity, arena);
+	b.ey = mem_alloc_array(float, capacity, arena);
+	b.ez = mem_alloc_array(float, capacity, arena);
+	b.capacity = capacity;
+	return b;
+}
+
+// Writes the world space bounds of a local space box transformed by an affine matrix into slot i.
+inline void
+set_cull_box(Cull_Boxes *b, size_t i, Vec3f center, Vec3f extents, const Mat3x4 &m)
+{
+	b->cx[i] = m.m[0]*center.x + m.m[1]*center.y + m.m[2]*center.z  + m.m[3];
+	b->cy[i] = m.m[4]*center.x + m.m[5]*center.y + m.m[6]*center.z  + m.m[7];
+	b->cz[i] = m.m[8]*center.x + m.m[9]*center.y + m.m[10]*center.z + m.m[11];
+	b->ex[i] = _fabs(m.m[0])*extents.x + _fabs(m.m[1])*extents.y + _fabs(m.m[2])*extents.z;
+	b->ey[i] = _fabs(m.m[4])*extents.x + _fabs(m.m[5])*extents.y + _fabs(m.m[6])*extents.z;
+	b->ez[i] = _fabs(m.m[8])*extents.x + _fabs(m.m[9])*extents.y + _fabs(m.m[10])*extents.z;
+}
+
+inline bool
+cull_box_scalar(const Frustum &f, float cx, float cy, float cz, float ex, float ey, float ez)
+{
+	for (int p = 0; p < 6; ++p) {
+		float dist = f.nx[p]*cx + f.ny[p]*cy + f.nz[p]*cz + f.d[p];
+		float radius = _fabs(f.nx[p])*ex + _fabs(f.ny[p])*ey + _fabs(f.nz[p])*ez;
+		if (dist + radius < 0.0f)
+			return false;
+	}
+	return true;
+}
+
+inline bool
+sphere_in_frustum(const Frustum &f, Vec3f center, float radius)
+{
+	for (int p = 0; p < 6; ++p) {
+		if (f.nx[p]*center.x + f.ny[p]*center.y + f.nz[p]*center.z + f.d[p] < -radius)
+			return false;
+	}
+	return true;
+}
+
+// Boxes begin to n, setting visible[i] for each. Returns the number of visible boxes.
+static size_t
+cull_boxes_scalar(const Frustum &f, const Cull_Boxes &b, size_t begin, size_t n, bool *visible)
+{
+	size_t num_visible = 0;
+	for (size_t i = begin; i < n; ++i) {
+		visible[i] = cull_box_scalar(f, b.cx[i], b.cy[i], b.cz[i], b.ex[i], b.ey[i], b.ez[i]);
+		num_visible += visible[i];
+	}
+	return num_visible;
+}
+
+static size_t
+cull_boxes_sse(const Frustum &f, const Cull_Boxes &b, size_t begin, size_t n, bool *visible)
+{
+	size_t num_visible = 0, i = begin;
+	for (; i + 4 <= n; i += 4) {
+		__m128 cx = _mm_loadu_ps(b.cx + i), cy = _mm_loadu_ps(b.cy + i), cz = _mm_loadu_ps(b.cz + i);
+		__m128 ex = _mm_loadu_ps(b.ex + i), ey = _mm_loadu_ps(b.ey + i), ez = _mm_loadu_ps(b.ez + i);
+		__m128 outside = _mm_setzero_ps();
+		for (int p = 0; p < 6; ++p) {
+			__m128 dist = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.nx[p]), cx), _mm_mul_ps(_mm_set1_ps(f.ny[p]), cy)),
+			                         _mm_add_ps(_mm_mul_ps(_mm_set1_ps(f.nz[p]), cz), _mm_set1_ps(f.d[p])));
+			__m128 radius = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(_fabs(f.nx[p])), ex), _mm_mul_ps(_mm_set1_ps(_fabs(f.ny[p])), ey)),
+			                           _mm_mul_ps(_mm_set1_ps(_fabs(f.nz[p])), ez));
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(_mm_add_ps(dist, radius), _mm_setzero_ps()));
+		}
+		int mask = _mm_movemask_ps(outside);
+		for (int j = 0; j < 4; ++j) {
+			visible[i + j] = !(mask & (1 << j));
+			num_visible += visible[i + j];
+		}
+	}
+	return num_visible + cull_boxes_scalar(f, b, i, n, visible);
+}
+
+__attribute__((target("avx"))) static size_t
+cull_boxes_avx(const Frustum &f, const Cull_Boxes &b, size_t begin, size_t n, bool *visible)
+{
+	size_t num_visible = 0, i = begin;
+	for (; i + 8 <= n; i += 8) {
+		__m256 cx = _mm256_loadu_ps(b.cx + i), cy = _mm256_loadu_ps(b.cy + i), cz = _mm256_loadu_ps(b.cz + i);
+		__m256 ex = _mm256_loadu_ps(b.ex + i), ey = _mm256_loadu_ps(b.ey + i), ez = _mm256_loadu_ps(b.ez + i);
+		__m256 outside = _mm256_setzero_ps();
+		for (int p = 0; p < 6; ++p) {
+			__m256 dist = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(f.nx[p]), cx), _mm256_mul_ps(_mm256_set1_ps(f.ny[p]), cy)),
+			                            _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(f.nz[p]), cz), _mm256_set1_ps(f.d[p])));
+			__m256 radius = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(_fabs(f.nx[p])), ex), _mm256_mul_ps(_mm256_set1_ps(_fabs(f.ny[p])), ey)),
+			                              _mm256_mul_ps(_mm256_set1_ps(_fabs(f.nz[p])), ez));
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(_mm256_add_ps(dist, radius), _mm256_setzero_ps(), _CMP_LT_OQ));
+		}
+		int mask = _mm256_movemask_ps(outside);
+		for (int j = 0; j < 8; ++j) {
+			visible[i + j] = !(mask & (1 << j));
+			num_visible += visible[i + j];
+		}
+	}
+	return num_visible + cull_boxes_sse(f, b, i, n, visible);
+}
+
+// Tests the first n boxes against the frustum, setting visible[i] for each. Returns the number of visible boxes. Picks the
+// kernel by the level math_init() settled on.
+size_t
+cull_boxes(const Frustum &f, const Cull_Boxes &b, size_t n, bool *visible)
+{
+	assert(n <= b.capacity);
+	switch (g_math_kernels.level) {
+	case SIMD_SCALAR: return cull_boxes_scalar(f, b, 0, n, visible);
+	case SIMD_SSE: return cull_boxes_sse(f, b, 0, n, visible);
+	case SIMD_AVX: return cull_boxes_avx(f, b, 0, n, visible);
+	}
+	return 0;
+}
@@ -0,0 +1,452 @@
+// Benchmarks for the parts of the engine that don't need a window or a scene: the block allocator, the job system, the matrix
+// and transform kernels, and Pool. make bench builds this next to math_bench with optimizations on and runs every one of them in
+// turn, printing the results. The benches that need the renderer's scene or asset packs stay behind hotkeys in cge.cpp.
+
+#include <stdint.h>
+#include <assert.h>
+#include <stdarg.h>
+
+#include "linux_platform.h"
+
+#include "math.h"
+#include "lib.h"
+#include "input.h"
+#include "memory.h"
+#include "platform.h"
+#include "memory.cpp"
+#include "lib.cpp"
+#include "job.cpp"
+#include "transform.cpp"
+
+struct Bench_Arena_Thread {
+	volatile uint32_t *start;
+	uint32_t iterations;
+};
+
+static void
+bench_arena_thread(void *data)
+{
+	Bench_Arena_Thread *t = (Bench_Arena_Thread *)data;
+	while (!atomic_load(t->start))
+		__builtin_ia32_pause();
+	for (uint32_t i = 0; i < t->iterations; ++i) {
+		Memory_Arena arena = mem_make_arena();
+		// With the allocation headers, the second half block doesn't fit after the first, so every arena takes two blocks.
+		for (int j = 0; j < 2; ++j)
+			mem_push(BLOCK_DATA_SIZE / 2, &arena);
+		mem_destroy_arena(&arena);
+	}
+	mem_flush_thread_cache();
+}
+
+// Debug benchmark for block allocation under contention: 1, 2, 4, ... 32 threads creating and destroying two block arenas as
+// fast as they can, all starting at once.
+void
+bench_block_allocator()
+{
+	constexpr unsigned MAX_THREADS = 32;
+	constexpr uint32_t ITERATIONS = 20000;
+	for (unsigned num_threads = 1; num_threads <= MAX_THREADS; num_threads *= 2) {
+		volatile uint32_t start = 0;
+		Bench_Arena_Thread args = { &start, ITERATIONS };
+		Platform_Thread threads[MAX_THREADS];
+		for (unsigned i = 0; i < num_threads; ++i)
+			threads[i] = platform_create_thread(bench_arena_thread, &args);
+		Platform_Time start_time = platform_get_time();
+		atomic_store(&start, 1);
+		for (unsigned i = 0; i < num_threads; ++i)
+			platform_join_thread(threads[i]);
+		long us = platform_time_diff(start_time, platform_get_time(), 1000);
+		debug_print("blocks: %d threads, %d arenas each in %lus, %lns per arena per thread\n", num_threads, ITERATIONS, us, us * 1000 / ITERATIONS);
+	}
+}
+
+struct Bench_Job_Work {
+	uint32_t steps_per_job;
+	volatile uint32_t sink;
+};
+
+static void
+bench_empty_job(void *, uint32_t, uint32_t)
+{
+}
+
+static void
+bench_busy_job(void *data, uint32_t begin, uint32_t end)
+{
+	Bench_Job_Work *w = (Bench_Job_Work *)data;
+	uint32_t x = begin + 1;
+	for (uint32_t i = begin; i < end; ++i) {
+		for (uint32_t j = 0; j < w->steps_per_job; ++j)
+			x = x*1664525u + 1013904223u;
+	}
+	atomic_fetch_add(&w->sink, x);
+}
+
+// Debug benchmark for the job system. Dispatch overhead is timed with empty jobs, both queued one at a time and as parallel_for
+// calls. Scaling is timed by splitting a fixed amount of busy work into 1, 2, 4, ... jobs, up to the number of job threads, so
+// each step can use at most that many cores.
+void
+bench_jobs()
+{
+	constexpr uint32_t NUM_EMPTY_JOBS = 1 << 17;
+	constexpr uint32_t EMPTY_JOBS_PER_BATCH = 256;
+	constexpr uint32_t NUM_PARALLEL_FORS = 10000;
+	constexpr uint32_t TOTAL_BUSY_STEPS = 1 << 28;
+	unsigned num_threads = job_thread_count();
+	debug_print("jobs: %d job threads\n", num_threads);
+
+	Job_Counter counter = {};
+	Platform_Time start = platform_get_time();
+	for (uint32_t i = 0; i < NUM_EMPTY_JOBS; i += EMPTY_JOBS_PER_BATCH) {
+		job_run(bench_empty_job, NULL, EMPTY_JOBS_PER_BATCH, &counter);
+		job_wait(&counter);
+	}
+	long us = platform_time_diff(start, platform_get_time(), 1000);
+	debug_print("jobs: %d empty jobs in batches of %d, %lus, %lns per job\n", NUM_EMPTY_JOBS, EMPTY_JOBS_PER_BATCH, us, us * 1000 / NUM_EMPTY_JOBS);
+
+	start = platform_get_time();
+	for (uint32_t i = 0; i < NUM_PARALLEL_FORS; ++i)
+		parallel_for(bench_empty_job, NULL, num_threads * JOBS_PER_THREAD, 1);
+	us = platform_time_diff(start, platform_get_time(), 1000);
+	debug_print("jobs: %d empty parallel_fors over %d jobs, %lns per call\n", NUM_PARALLEL_FORS, num_threads * JOBS_PER_THREAD, us * 1000 / NUM_PARALLEL_FORS);
+
+	long one_job_us = 0;
+	for (unsigned num_jobs = 1; num_jobs <= num_threads; num_jobs = (num_jobs == num_threads || num_jobs * 2 <= num_threads) ? num_jobs * 2 : num_threads) {
+		Bench_Job_Work work = { TOTAL_BUSY_STEPS / num_jobs, 0 };
+		start = platform_get_time();
+		job_run(bench_busy_job, &work, num_jobs, &counter);
+		job_wait(&counter);
+		us = platform_time_diff(start, platform_get_time(), 1000);
+		if (num_jobs == 1)
+			one_job_us = us;
+		debug_print("jobs: busy work over %d cores %lus, %f times one core (checksum %d)\n", num_jobs, us, (double)one_job_us / us, work.sink);
+	}
+}
+
+static float
+max_difference(const float *a, const float *b, size_t n)
+{
+	float max_diff = 0.0f;
+	for (size_t i = 0; i < n; ++i)
+		max_diff = _max(max_diff, _fabs(a[i] - b[i]));
+	return max_diff;
+}
+
+static const char *
+simd_level_name(Simd_Level level)
+{
+	switch (level) {
+	case SIMD_SCALAR: return "scalar";
+	case SIMD_SSE: return "sse";
+	case SIMD_AVX: return "avx";
+	}
+	return "?";
+}
+
+// Debug benchmark for the matrix math. Times the scalar Mat4 operations against the SSE ones, then the batched kernels at every
+// level the CPU can run. Differences from the scalar results are printed in millionths.
+void
+bench_math()
+{
+	constexpr uint32_t NUM_MATRICES = 4096;
+	constexpr uint32_t NUM_ROUNDS = 64;
+	constexpr long NUM_OPS = (long)NUM_MATRICES * NUM_ROUNDS;
+	uint32_t rng = DEFAULT_RAND_SEED;
+	Scratch_Arena *arena = mem_frame_arena();
+	Scratch_Mark mark = mem_mark(arena);
+	DEFER(mem_rewind(mem_frame_arena(), mark));
+	Mat4 *mats = mem_alloc_array(Mat4, NUM_MATRICES, arena);
+	Mat4 *mat_out = mem_alloc_array(Mat4, NUM_MATRICES, arena);
+	Mat4 *mat_expected = mem_alloc_array(Mat4, NUM_MATRICES, arena);
+	Vec4f *vecs = mem_alloc_array(Vec4f, NUM_MATRICES, arena);
+	Vec4f *vec_out = mem_alloc_array(Vec4f, NUM_MATRICES, arena);
+	Vec4f *vec_expected = mem_alloc_array(Vec4f, NUM_MATRICES, arena);
+	Vec3f *points = mem_alloc_array(Vec3f, NUM_MATRICES, arena);
+	Vec3f *point_out = mem_alloc_array(Vec3f, NUM_MATRICES, arena);
+	Vec3f *point_expected = mem_alloc_array(Vec3f, NUM_MATRICES, arena);
+	for (uint32_t i = 0; i < NUM_MATRICES; ++i) {
+		for (int j = 0; j < 16; ++j)
+			mats[i][j] = rand11(&rng) + (j % 5 == 0 ? 4.0f : 0.0f); // A heavy diagonal keeps them well away from singular.
+		vecs[i] = { rand11(&rng), rand11(&rng), rand11(&rng), rand11(&rng) };
+		points[i] = { rand11(&rng), rand11(&rng), rand11(&rng) };
+	}
+	const Mat4 &a = mats[0];
+	auto print_time = [](const char *what, const char *level, Platform_Time start, float max_diff) {
+		long us = platform_time_diff(start, platform_get_time(), 1000);
+		debug_print("math: %s %s %lns per op, max difference %fe-6\n", what, level, us * 1000 / NUM_OPS, max_diff * 1e6);
+	};
+
+	Platform_Time start = platform_get_time();
+	for (uint32_t r = 0; r < NUM_ROUNDS; ++r) {
+		for (uint32_t i = 0; i < NUM_MATRICES; ++i)
+			mat_expected[i] = mat4_mul_scalar(a, mats[i]);
+	}
+	print_time("mat4 * mat4", "scalar", start, 0.0f);
+	start = platform_get_time();
+	for (uint32_t r = 0; r < NUM_ROUNDS; ++r) {
+		for (uint32_t i = 0; i < NUM_MATRICES; ++i)
+			mat_out[i] = a * mats[i];
+	}
+	print_time("mat4 * mat4", "sse", start, max_difference(mat_out[0].m, mat_expected[0].m, NUM_MATRICES * 16));
+
+	start = platform_get_time();
+	for (uint32_t r = 0; r < NUM_ROUNDS; ++r) {
+		for (uint32_t i = 0; i < NUM_MATRICES; ++i)
+			inverse_scalar(mats[i], &mat_out[i]);
+	}
+	print_time("inverse", "scalar", start, 0.0f);
+	for (uint32_t i = 0; i < NUM_MATRICES; ++i)
+		mat_expected[i] = mat_out[i];
+	start = platform_get_time();
+	for (uint32_t r = 0; r < NUM_ROUNDS; ++r) {
+		for (uint32_t i = 0; i < NUM_MATRICES; ++i)
+			inverse(mats[i], &mat_out[i]);
+	}
+	print_time("inverse", "sse", start, max_difference(mat_out[0].m, mat_expected[0].m, NUM_MATRICES * 16));
+
+	start = platform_get_time();
+	for (uint32_t r = 0; r < NUM_ROUNDS; ++r) {
+		for (uint32_t i = 0; i < NUM_MATRICES; ++i)
+			vec_expected[i] = mat4_transform_scalar(a, vecs[i]);
+	}
+	print_time("mat4 * vec4", "scalar", start, 0.0f);
+	start = platform_get_time();
+	for (uint32_t r = 0; r < NUM_ROUNDS; ++r) {
+		for (uint32_t i = 0; i < NUM_MATRICES; ++i)
+			vec_out[i] = a * vecs[i];
+	}
+	print_time("mat4 * vec4", "sse", start, max_difference(&vec_out[0].x, &vec_expected[0].x, NUM_MATRICES * 4));
+
+	for (uint32_t i = 0; i < NUM_MATRICES; ++i)
+		mat_expected[i] = mat4_mul_scalar(a, mats[i]);
+	transform_points_scalar(a, points, point_expected, NUM_MATRICES);
+	for (int level = SIMD_SCALAR; level <= SIMD_AVX; ++level) {
+		if (math_init((Simd_Level)level) != level)
+			continue;
+		const char *name = simd_level_name((Simd_Level)level);
+		start = platform_get_time();
+		for (uint32_t r = 0; r < NUM_ROUNDS; ++r)
+			mul_mat4s(a, mats, mat_out, NUM_MATRICES);
+		print_time("mul_mat4s", name, start, max_difference(mat_out[0].m, mat_expected[0].m, NUM_MATRICES * 16));
+		start = platform_get_time();
+		for (uint32_t r = 0; r < NUM_ROUNDS; ++r)
+			transform_vec4s(a, vecs, vec_out, NUM_MATRICES);
+		print_time("transform_vec4s", name, start, max_difference(&vec_out[0].x, &vec_expected[0].x, NUM_MATRICES * 4));
+		start = platform_get_time();
+		for (uint32_t r = 0; r < NUM_ROUNDS; ++r)
+			transform_points(a, points, point_out, NUM_MATRICES);
+		print_time("transform_points", name, start, max_difference(&point_out[0].x, &point_expected[0].x, NUM_MATRICES * 3));
+	}
+	debug_print("math: using %s kernels\n", simd_level_name(math_init()));
+}
+
+// Debug benchmark for the transform path: composes NUM_TRANSFORMS dirty transforms with every kernel the CPU can run. The SIMD
+// kernels are checked against the scalar one, with differences printed in millionths.
+void
+bench_transforms()
+{
+	constexpr uint32_t NUM_TRANSFORMS = 1 << 17;
+	constexpr uint32_t NUM_ROUNDS = 16;
+	uint32_t rng = DEFAULT_RAND_SEED;
+	Scratch_Mark mark = mem_mark(mem_frame_arena());
+	DEFER(mem_rewind(mem_frame_arena(), mark));
+	Mat3x4 *expected = mem_alloc_array(Mat3x4, NUM_TRANSFORMS, mem_frame_arena());
+	Transforms t = {};
+	for (uint32_t i = 0; i < NUM_TRANSFORMS; ++i) {
+		uint32_t slot = transform_alloc(&t, &t);
+		Quat rot = normalize(Quat{ rand11(&rng), rand11(&rng), rand11(&rng), rand11(&rng) });
+		transform_set(&t, slot, { rand11(&rng) * 1000.0f, rand11(&rng) * 1000.0f, rand11(&rng) * 1000.0f }, rot, { 1.0f + rand11(&rng) * 0.5f, 1.0f, 1.0f });
+	}
+
+	for (int level = SIMD_SCALAR; level <= SIMD_AVX; ++level) {
+		if (math_init((Simd_Level)level) != level)
+			continue;
+		long us = 0;
+		for (uint32_t r = 0; r < NUM_ROUNDS; ++r) {
+			for (uint32_t i = 0; i < NUM_TRANSFORMS; ++i)
+				transform_set_position(&t, i, { t.px[i], t.py[i], t.pz[i] });
+			Platform_Time start = platform_get_time();
+			transforms_update(&t, NULL);
+			us += platform_time_diff(start, platform_get_time(), 1000);
+		}
+		float max_diff = 0.0f;
+		if (level == SIMD_SCALAR) {
+			for (uint32_t i = 0; i < NUM_TRANSFORMS; ++i)
+				expected[i] = t.world[i];
+		} else {
+			max_diff = max_difference(t.world[0].m, expected[0].m, NUM_TRANSFORMS * 12);
+		}
+		debug_print("transforms: %d composed with %s kernels in %lus, %lns per transform, max difference %fe-6\n", NUM_TRANSFORMS,
+		            simd_level_name((Simd_Level)level), us / NUM_ROUNDS, us * 1000 / ((long)NUM_TRANSFORMS * NUM_ROUNDS), max_diff * 1e6);
+	}
+	math_init();
+	transforms_destroy(&t);
+}
+
+struct Bench_Entity {
+	Vec3f pos;
+	Vec3f vel;
+	uint32_t flags;
+};
+
+// The pool as it was before handles, kept as the baseline for bench_pools(): a 16 bit index and a 16 bit key packed in each id,
+// freed elements chained through their ids, and iteration that scans past the dead ones. It never had a free, so this one does
+// what its comments described, and it skips key 0, which would have made a live element look freed once the keys wrapped.
+constexpr uint32_t SPARSE_POOL_MAX = 0xFFFF;
+
+struct Sparse_Pool_Element {
+	Bench_Entity data;
+	uint32_t id; // Live: key << 16 | index. Freed: index of the next freed, or SPARSE_POOL_MAX at the end.
+};
+
+struct Sparse_Pool {
+	uint32_t key;
+	uint32_t free_head;
+	Array<Sparse_Pool_Element> elems;
+};
+
+static uint32_t
+sparse_pool_alloc(Sparse_Pool *p)
+{
+	uint32_t index;
+	if (p->free_head != SPARSE_POOL_MAX) {
+		index = p->free_head;
+		p->free_head = p->elems[index].id;
+	} else {
+		assert(p->elems.size < SPARSE_POOL_MAX);
+		index = p->elems.size;
+		array_alloc(&p->elems);
+	}
+	p->key = (p->key + 1) & 0xFFFF;
+	if (p->key == 0)
+		p->key = 1;
+	p->elems[index].id = (p->key << 16) | index;
+	return p->elems[index].id;
+}
+
+static void
+sparse_pool_free(Sparse_Pool *p, uint32_t id)
+{
+	uint32_t index = id & 0xFFFF;
+	assert(p->elems[index].id == id);
+	p->elems[index].id = p->free_head;
+	p->free_head = index;
+}
+
+static Bench_Entity *
+sparse_pool_get(Sparse_Pool &p, uint32_t id)
+{
+	Sparse_Pool_Element &e = p.elems[id & 0xFFFF];
+	return e.id == id ? &e.data : NULL;
+}
+
+// Debug benchmark for Pool against the sparse pool it replaced, with the same churn on both. Keeps a number of entities live
+// while freeing and allocating random ones, looks up random live ones, then frees a random half and iterates over what's left.
+// The sparse pool tops out at 65535, so Pool is run again with a million live.
+static void
+bench_pools()
+{
+	constexpr uint32_t NUM_OPS = 1 << 20;
+	constexpr uint32_t NUM_ITERATIONS = 16;
+	constexpr uint32_t SPARSE_LIVE = 50000;
+	constexpr uint32_t MAX_LIVE = 1 << 20;
+	uint32_t rng = DEFAULT_RAND_SEED;
+	auto ns_per = [](Platform_Time start, float n) -> float { return platform_time_diff(start, platform_get_time(), 1) / n; };
+	auto print_results = [](const char *name, uint32_t num_live, float churn_ns, float lookup_ns, float iterate_ns, uint32_t sum) {
+		debug_print("pools: %s with %d live, %fns per free and alloc, %fns per lookup, %fns per entity iterated with half freed (checksum %d)\n",
+		            name, num_live, churn_ns, lookup_ns, iterate_ns, sum);
+	};
+	Scratch_Mark mark = mem_mark(mem_frame_arena());
+	DEFER(mem_rewind(mem_frame_arena(), mark));
+	uint32_t *ids = mem_alloc_array(uint32_t, SPARSE_LIVE, mem_frame_arena());
+	Pool_Handle *handles = mem_alloc_array(Pool_Handle, MAX_LIVE, mem_frame_arena());
+	uint32_t sum = 0;
+
+	Sparse_Pool sparse = { 0, SPARSE_POOL_MAX, {} };
+	for (uint32_t i = 0; i < SPARSE_LIVE; ++i) {
+		ids[i] = sparse_pool_alloc(&sparse);
+		*sparse_pool_get(sparse, ids[i]) = {};
+	}
+	Platform_Time start = platform_get_time();
+	for (uint32_t i = 0; i < NUM_OPS; ++i) {
+		uint32_t j = xorshift32(&rng) % SPARSE_LIVE;
+		sparse_pool_free(&sparse, ids[j]);
+		ids[j] = sparse_pool_alloc(&sparse);
+		sparse_pool_get(sparse, ids[j])->flags = i;
+	}
+	float churn_ns = ns_per(start, NUM_OPS);
+	start = platform_get_time();
+	for (uint32_t i = 0; i < NUM_OPS; ++i)
+		sum += sparse_pool_get(sparse, ids[xorshift32(&rng) % SPARSE_LIVE])->flags;
+	float lookup_ns = ns_per(start, NUM_OPS);
+	uint32_t num_left = 0;
+	for (uint32_t i = 0; i < SPARSE_LIVE; ++i) {
+		if (xorshift32(&rng) & 1)
+			sparse_pool_free(&sparse, ids[i]);
+		else
+			++num_left;
+	}
+	start = platform_get_time();
+	for (uint32_t r = 0; r < NUM_ITERATIONS; ++r) {
+		for (Sparse_Pool_Element &e : sparse.elems) {
+			if (e.id >> 16)
+				sum += e.data.flags;
+		}
+	}
+	print_results("sparse pool", SPARSE_LIVE, churn_ns, lookup_ns, ns_per(start, (float)num_left * NUM_ITERATIONS), sum);
+	array_destroy(&sparse.elems);
+
+	uint32_t pool_sizes[] = { SPARSE_LIVE, MAX_LIVE };
+	for (uint32_t num_live : pool_sizes) {
+		Pool<Bench_Entity> pool = {};
+		sum = 0;
+		for (uint32_t i = 0; i < num_live; ++i)
+			*pool_alloc(&pool, &handles[i]) = {};
+		start = platform_get_time();
+		for (uint32_t i = 0; i < NUM_OPS; ++i) {
+			uint32_t j = xorshift32(&rng) % num_live;
+			pool_free(&pool, handles[j]);
+			pool_alloc(&pool, &handles[j])->flags = i;
+		}
+		churn_ns = ns_per(start, NUM_OPS);
+		start = platform_get_time();
+		for (uint32_t i = 0; i < NUM_OPS; ++i)
+			sum += pool_get(pool, handles[xorshift32(&rng) % num_live])->flags;
+		lookup_ns = ns_per(start, NUM_OPS);
+		for (uint32_t i = 0; i < num_live; ++i) {
+			if (xorshift32(&rng) & 1)
+				pool_free(&pool, handles[i]);
+		}
+		start = platform_get_time();
+		for (uint32_t r = 0; r < NUM_ITERATIONS; ++r) {
+			for (Bench_Entity &e : pool)
+				sum += e.flags;
+		}
+		print_results("pool", num_live, churn_ns, lookup_ns, ns_per(start, (float)pool_size(pool) * NUM_ITERATIONS), sum);
+		Pool_Handle stale;
+		*pool_alloc(&pool, &stale) = {};
+		pool_free(&pool, stale);
+		bool freed_again = pool_free(&pool, stale);
+		assert(!pool_get(pool, stale) && !freed_again);
+		(void)freed_again; // Only read by the assert.
+		pool_destroy(&pool);
+	}
+}
+
+int
+main()
+{
+	MEM_NAME_ARENA(&g_frame_arenas[0], "frame");
+	MEM_NAME_ARENA(&g_frame_arenas[1], "frame");
+	math_init();
+	job_init();
+	bench_block_allocator();
+	bench_jobs();
+	bench_math();
+	bench_transforms();
+	bench_pools();
+	return 0;
+}
+
+#include "linux_platform.cpp"
@@ -0,0 +1,143 @@
+// Shadow copy of the GL binding state. All of the renderer's binds go through here so that binds of the object that is already
+// bound never reach the driver.
+// Anything that changes bindings behind our back (e.g. glBindBufferBase also binds the generic target) has to go through here too,
+// otherwise the shadow state goes stale.
+
+constexpr int MAX_SHADOWED_TEXTURE_UNITS = 8;
+
+struct GL_State {
+	GLuint program;
+	GLuint vertex_array;
+	GLuint array_buffer;
+	GLuint uniform_buffer;
+	GLuint draw_indirect_buffer;
+	GLenum active_texture;
+	GLuint texture_2d[MAX_SHADOWED_TEXTURE_UNITS];
+
+	// Since the last frame report, which resets them.
+	size_t num_calls;
+	size_t num_skipped;
+};
+
+// Optional features, queried once at init.
+struct GL_Caps {
+	int major_version;
+	int minor_version;
+	bool multi_draw_indirect;
+	bool texture_storage;
+	bool s3tc;
+};
+
+GL_State g_gl_state;
+GL_Caps g_gl_caps;
+
+bool
+gl_has_extension(const char *name)
+{
+	GLint num_exts;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &num_exts);
+	for (GLint i = 0; i < num_exts; ++i) {
+		if (strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), name) == 0)
+			return true;
+	}
+	return false;
+}
+
+inline bool
+gl_version_at_least(int major, int minor)
+{
+	return g_gl_caps.major_version > major || (g_gl_caps.major_version == major && g_gl_caps.minor_version >= minor);
+}
+
+// Call once the context is current. Assumes the context is still in its default state.
+void
+gl_state_init()
+{
+	g_gl_state = {};
+	g_gl_state.active_texture = GL_TEXTURE0;
+
+	glGetIntegerv(GL_MAJOR_VERSION, &g_gl_caps.major_version);
+	glGetIntegerv(GL_MINOR_VERSION, &g_gl_caps.minor_version);
+	// Instance attributes only honor baseInstance from 4.2 on, which the indirect path relies on.
+	g_gl_caps.multi_draw_indirect = glMultiDrawElementsIndirect && gl_version_at_least(4, 2)
+	                             && (gl_version_at_least(4, 3) || gl_has_extension("GL_ARB_multi_draw_indirect"));
+	g_gl_caps.texture_storage = glTexStorage2D && (gl_version_at_least(4, 2) || gl_has_extension("GL_ARB_texture_storage"));
+	// Mesa has exposed this everywhere since the S3TC patents ran out, but older drivers may still lack it.
+	g_gl_caps.s3tc = gl_has_extension("GL_EXT_texture_compression_s3tc");
+}
+
+inline bool
+gl_state_changed(GLuint *cur, GLuint want)
+{
+	++g_gl_state.num_calls;
+	if (*cur == want) {
+		++g_gl_state.num_skipped;
+		return false;
+	}
+	*cur = want;
+	return true;
+}
+
+inline void
+gl_use_program(GLuint program)
+{
+	if (gl_state_changed(&g_gl_state.program, program))
+		glUseProgram(program);
+}
+
+inline void
+gl_bind_vertex_array(GLuint vao)
+{
+	if (gl_state_changed(&g_gl_state.vertex_array, vao))
+		glBindVertexArray(vao);
+}
+
+// GL_ELEMENT_ARRAY_BUFFER is part of the VAO state, so it isn't shadowed and always goes through.
+inline void
+gl_bind_buffer(GLenum target, GLuint buffer)
+{
+	GLuint *cur = NULL;
+	if (target == GL_ARRAY_BUFFER)
+		cur = &g_gl_state.array_buffer;
+	else if (target == GL_UNIFORM_BUFFER)
+		cur = &g_gl_state.uniform_buffer;
+	else if (target == GL_DRAW_INDIRECT_BUFFER)
+		cur = &g_gl_state.draw_indirect_buffer;
+	if (!cur || gl_state_changed(cur, buffer))
+		glBindBuffer(target, buffer);
+}
+
+// Indexed binds aren't shadowed, but they do replace the generic binding point.
+inline void
+gl_bind_buffer_base(GLenum target, GLuint index, GLuint buffer)
+{
+	glBindBufferBase(target, index, buffer);
+	if (target == GL_UNIFORM_BUFFER)
+		g_gl_state.uniform_buffer = buffer;
+}
+
+inline void
+gl_active_texture(GLenum unit)
+{
+	if (gl_state_changed(&g_gl_state.active_texture, unit))
+		glActiveTexture(unit);
+}
+
+inline void
+gl_bind_texture(GLenum unit, GLuint texture)
+{
+	GLuint i = unit - GL_TEXTURE0;
+	assert(i < MAX_SHADOWED_TEXTURE_UNITS);
+	++g_gl_state.num_calls;
+	if (g_gl_state.texture_2d[i] == texture) {
+		++g_gl_state.num_skipped;
+		return;
+	}
+	// Switching units is part of this bind, so it isn't counted as a call of its own.
+	if (g_gl_state.active_texture != unit) {
+		glActiveTexture(unit);
+		g_gl_state.active_texture = unit;
+	}
+	glBindTexture(GL_TEXTURE_2D, texture);
+	g_gl_state.texture_2d[i] = texture;
+}
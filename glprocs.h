@@ -4,10 +4,14 @@
 #define GLPROC(name, ret, ...)\
 	typedef ret (*name##_GLPROC)(__VA_ARGS__);\
 	name##_GLPROC name = NULL
+#define GLPROC_OPTIONAL(name, ret, ...) GLPROC(name, ret, __VA_ARGS__)
 #elif defined(LOADPROC)
 #define GLPROC(name, ret, ...)\
 	name = (name##_GLPROC)glXGetProcAddress((const GLubyte *)#name);\
 	if (!name) zabort("failed to load OpenGL function %s" #name)
+// For functions newer than the context we ask for. Callers have to check the version or extension before using these.
+#define GLPROC_OPTIONAL(name, ret, ...)\
+	name = (name##_GLPROC)glXGetProcAddress((const GLubyte *)#name)
 #else 
 #error "Missing DEFINEPROC or LOADPROC."
 #endif
@@ -39,6 +43,9 @@ GLPROC(glBindBufferBase,    void,   GLenum, GLuint, GLuint);
 GLPROC(glBufferSubData, void,   GLenum, GLintptr, GLsizeiptr, const GLvoid *);
 GLPROC(glBufferData, void,   GLenum, GLsizeiptr, const GLvoid *, GLenum);
 GLPROC(glDeleteVertexArray,    void, GLsizei,   const GLuint *);
+GLPROC(glVertexAttribDivisor,    void,   GLuint, GLuint);
+GLPROC(glMapBufferRange, void *, GLenum, GLintptr, GLsizeiptr, GLbitfield);
+GLPROC(glUnmapBuffer, GLboolean, GLenum);
 
 GLPROC(glCreateShader,  GLuint, GLenum);
 GLPROC(glShaderSource, void, GLuint, GLsizei, const GLchar **, const GLint *);
@@ -54,14 +61,22 @@ GLPROC(glLinkProgram,    void,   GLuint);
 GLPROC(glGetProgramiv,   void,   GLuint, GLenum, GLint *);
 GLPROC(glGetProgramInfoLog, void, GLuint, GLsizei, GLsizei *, GLchar *);
 GLPROC(glUseProgram,    void,   GLuint);
+
+GLPROC(glGetStringi, const GLubyte *, GLenum, GLuint);
 //
 //GLPROC(glGetTextures, void, GLsizei, GLuint *);
 //GLPROC(glTexImage2d, void, GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const GLvoid *);
 //GLPROC(glBindTexture, void, GLuint);
 //GLPROC(glTexParameteri, void, GLenum, GLenum, GLint);
 GLPROC(glGenerateMipmap, void, GLenum);
+GLPROC_OPTIONAL(glTexStorage2D, void, GLenum, GLsizei, GLenum, GLsizei, GLsizei);
 
 //GLPROC(glDrawElements, void, GLenum, GLsizei, GLenum, const GLvoid *);
+GLPROC(glDrawElementsInstanced, void, GLenum, GLsizei, GLenum, const GLvoid *, GLsizei);
+GLPROC(glDrawElementsBaseVertex, void, GLenum, GLsizei, GLenum, const GLvoid *, GLint);
+GLPROC(glDrawElementsInstancedBaseVertex, void, GLenum, GLsizei, GLenum, const GLvoid *, GLsizei, GLint);
+GLPROC_OPTIONAL(glMultiDrawElementsIndirect, void, GLenum, GLenum, const GLvoid *, GLsizei, GLsizei);
 //GLPROC(glDrawArrays, void, GLenum, GLint, GLsizei);
 
 #undef GLPROC
+#undef GLPROC_OPTIONAL
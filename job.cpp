@@ -0,0 +1,337 @@
+// Job system.
+// One worker thread per core besides the main thread. Every thread that runs jobs owns a Chase-Lev work-stealing deque per
+// priority. The owner pushes and pops at the bottom, last in first out, so it keeps working on data that's still in its cache.
+// Idle threads steal from the top, which holds the oldest and usually biggest pieces of work. Dependencies are counters: a job
+// decrements its counter when it returns, and job_wait() runs other jobs until the counter reaches zero, so a thread that's
+// waiting is never idle while there is work. Idle workers sleep on a semaphore and get woken as jobs are pushed.
+// Threads other than the workers, like the main thread and the stream threads, call job_register_thread() once. After that they
+// can push jobs, and they help out while they wait on them.
+// Jobs pushed from a background thread, or from inside a background job, are background jobs and go on a deque of their own.
+// Workers take foreground jobs first. A foreground thread that's waiting only runs foreground jobs, so the render thread never
+// picks up a stream thread's decode in the middle of a frame.
+
+constexpr unsigned MAX_JOB_THREADS = 64;
+constexpr unsigned MAX_JOB_WORKERS = MAX_JOB_THREADS - 8; // Leaves room for the threads that register themselves.
+constexpr int64_t JOB_DEQUE_SIZE = 1024;                  // Power of two. A push onto a full deque runs the job on the spot.
+constexpr unsigned JOB_SPINS_BEFORE_SLEEP = 256;
+constexpr unsigned JOBS_PER_THREAD = 4;                   // How finely parallel_for splits work, for load balancing.
+
+// A job covers the items [begin, end) of whatever data points to.
+typedef void (*Job_Proc)(void *data, uint32_t begin, uint32_t end);
+
+struct Job_Counter {
+	volatile uint32_t count; // Jobs still to finish.
+};
+
+enum Job_Priority {
+	JOB_FOREGROUND,
+	JOB_BACKGROUND,
+	NUM_JOB_PRIORITIES
+};
+
+struct Job {
+	Job_Proc proc;
+	void *data;
+	Job_Counter *counter;
+	uint32_t begin;
+	uint32_t end;
+};
+
+struct Job_Deque {
+	// top and bottom are on lines of their own, since thieves hammer one and the owner the other.
+	alignas(64) volatile int64_t top;
+	alignas(64) volatile int64_t bottom;
+	alignas(64) Job jobs[JOB_DEQUE_SIZE];
+};
+
+struct Job_Thread {
+	Job_Deque deques[NUM_JOB_PRIORITIES];
+	Scratch_Arena scratch;
+	uint32_t depth;            // Jobs running on this thread, nested ones included.
+	uint32_t background_depth; // Background jobs among them.
+	Job_Priority priority;     // What the thread pushes outside of a job.
+	uint32_t steal_seed;
+};
+
+struct Job_System {
+	Job_Thread threads[MAX_JOB_THREADS];
+	volatile uint32_t num_threads;
+	unsigned num_workers;
+	Spin_Lock register_lock;
+	volatile uint32_t num_sleeping;
+	Platform_Semaphore wake_sem;
+};
+
+static Job_System g_jobs;
+static __thread Job_Thread *t_job_thread;
+
+// Slots are copied field by field with relaxed atomics. A thief can read a slot that's being rewritten, but only when the steal
+// is going to lose its race for top and throw away what it read.
+static inline void
+store_job(Job *slot, const Job &job)
+{
+	__atomic_store_n(&slot->proc, job.proc, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->data, job.data, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->counter, job.counter, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->begin, job.begin, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->end, job.end, __ATOMIC_RELAXED);
+}
+
+static inline Job
+load_job(const Job *slot)
+{
+	Job job;
+	job.proc = __atomic_load_n(&slot->proc, __ATOMIC_RELAXED);
+	job.data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+	job.counter = __atomic_load_n(&slot->counter, __ATOMIC_RELAXED);
+	job.begin = __atomic_load_n(&slot->begin, __ATOMIC_RELAXED);
+	job.end = __atomic_load_n(&slot->end, __ATOMIC_RELAXED);
+	return job;
+}
+
+// Owner only. Returns false if the deque is full.
+static bool
+deque_push(Job_Deque *d, const Job &job)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+	int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	if (b - top >= JOB_DEQUE_SIZE)
+		return false;
+	store_job(&d->jobs[b & (JOB_DEQUE_SIZE - 1)], job);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+// Owner only.
+static bool
+deque_pop(Job_Deque *d, Job *out)
+{
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+	__atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t top = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+	if (top > b) { // Empty.
+		__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	*out = load_job(&d->jobs[b & (JOB_DEQUE_SIZE - 1)]);
+	if (top < b)
+		return true;
+	// Last job, so race the thieves for it.
+	bool won = __atomic_compare_exchange_n(&d->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+	__atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+	return won;
+}
+
+// Any thread.
+static bool
+deque_steal(Job_Deque *d, Job *out)
+{
+	int64_t top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	int64_t b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+	if (top >= b)
+		return false;
+	*out = load_job(&d->jobs[top & (JOB_DEQUE_SIZE - 1)]);
+	return __atomic_compare_exchange_n(&d->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+// Foreground jobs before background ones, and for each, own deque first, then the others, starting from a random one so thieves
+// spread out. Background jobs are only looked at up to max_priority.
+static bool
+find_job(Job *out, Job_Priority *priority, Job_Priority max_priority)
+{
+	Job_Thread *self = t_job_thread;
+	uint32_t n = atomic_load(&g_jobs.num_threads);
+	self->steal_seed = self->steal_seed*1664525u + 1013904223u;
+	uint32_t start = (self->steal_seed >> 16) % n;
+	for (int p = JOB_FOREGROUND; p <= max_priority; ++p) {
+		*priority = (Job_Priority)p;
+		if (deque_pop(&self->deques[p], out))
+			return true;
+		for (uint32_t i = 0; i < n; ++i) {
+			Job_Thread *victim = &g_jobs.threads[(start + i) % n];
+			if (victim != self && deque_steal(&victim->deques[p], out))
+				return true;
+		}
+	}
+	return false;
+}
+
+// Jobs pushed now are background ones if this thread is a background thread or is running a background job.
+static inline Job_Priority
+current_job_priority()
+{
+	Job_Thread *self = t_job_thread;
+	return self->background_depth > 0 ? JOB_BACKGROUND : self->priority;
+}
+
+// A job's scratch memory is rewound when it returns. Nested jobs run inside the job that waits on them, so they rewind to above
+// whatever it has pushed.
+static void
+execute_job(const Job &job, Job_Priority priority)
+{
+	Job_Thread *self = t_job_thread;
+	Scratch_Mark mark = mem_mark(&self->scratch);
+	++self->depth;
+	self->background_depth += priority == JOB_BACKGROUND;
+	job.proc(job.data, job.begin, job.end);
+	self->background_depth -= priority == JOB_BACKGROUND;
+	--self->depth;
+	mem_rewind(&self->scratch, mark);
+	atomic_fetch_add(&job.counter->count, (uint32_t)-1);
+}
+
+// Takes one worker off the sleeping count. Returns false if there weren't any.
+static bool
+take_sleeper()
+{
+	uint32_t num_sleeping = atomic_load(&g_jobs.num_sleeping);
+	while (num_sleeping > 0 && !atomic_compare_exchange(&g_jobs.num_sleeping, num_sleeping, num_sleeping - 1))
+		num_sleeping = atomic_load(&g_jobs.num_sleeping);
+	return num_sleeping > 0;
+}
+
+static void
+wake_workers(uint32_t n)
+{
+	// Pairs with the announcement in job_worker(), so either the worker sees the pushed jobs or we see it asleep.
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (; n > 0 && take_sleeper(); --n)
+		platform_post_semaphore(&g_jobs.wake_sem);
+}
+
+static void
+push_job(const Job &job)
+{
+	Job_Priority priority = current_job_priority();
+	if (!deque_push(&t_job_thread->deques[priority], job))
+		execute_job(job, priority);
+}
+
+// Call once on any thread that wants to push jobs or wait on them, other than the workers, which register themselves. Threads
+// doing work that can take its time, like the stream threads, register as JOB_BACKGROUND.
+void
+job_register_thread(Job_Priority priority = JOB_FOREGROUND)
+{
+	assert(!t_job_thread);
+	spin_lock(&g_jobs.register_lock);
+	uint32_t i = g_jobs.num_threads;
+	if (i == MAX_JOB_THREADS)
+		zabort("too many threads registered with the job system");
+	Job_Thread *t = &g_jobs.threads[i];
+	for (Job_Deque &d : t->deques)
+		d.top = d.bottom = 0;
+	t->scratch = mem_make_scratch();
+	MEM_NAME_ARENA(&t->scratch, "job scratch");
+	t->depth = t->background_depth = 0;
+	t->priority = priority;
+	t->steal_seed = i*2654435761u + 1;
+	atomic_store(&g_jobs.num_threads, i + 1);
+	spin_unlock(&g_jobs.register_lock);
+	t_job_thread = t;
+}
+
+// Workers are pinned, one per core, so the scheduler doesn't stack them up and memory a worker keeps to itself can live on its
+// NUMA node (see mem_thread_local_policy()).
+static void
+job_worker(void *cpu_index)
+{
+	platform_pin_thread((unsigned)(uintptr_t)cpu_index);
+	job_register_thread();
+	for (;;) {
+		Job job;
+		Job_Priority priority;
+		unsigned spins = 0;
+		while (!find_job(&job, &priority, JOB_BACKGROUND)) {
+			if (++spins < JOB_SPINS_BEFORE_SLEEP) {
+				__builtin_ia32_pause();
+				continue;
+			}
+			// Say we're going to sleep before the last look, so a push we miss here still sees us and posts.
+			__atomic_fetch_add(&g_jobs.num_sleeping, 1, __ATOMIC_SEQ_CST);
+			if (find_job(&job, &priority, JOB_BACKGROUND)) {
+				// Take the announcement back. If a pusher already did, its post just costs a spurious wakeup later.
+				take_sleeper();
+				break;
+			}
+			platform_wait_semaphore(&g_jobs.wake_sem);
+			spins = 0;
+		}
+		execute_job(job, priority);
+	}
+}
+
+// Registers the calling thread and starts a worker for every other core.
+void
+job_init()
+{
+	platform_init_semaphore(&g_jobs.wake_sem, 0);
+	job_register_thread();
+	g_jobs.num_workers = _min(platform_get_processor_count() - 1, MAX_JOB_WORKERS);
+	for (unsigned i = 0; i < g_jobs.num_workers; ++i)
+		platform_create_thread(job_worker, (void *)(uintptr_t)(i + 1)); // The main thread is left to run where it likes.
+}
+
+// Threads that can run jobs, registered or about to be.
+inline unsigned
+job_thread_count()
+{
+	return g_jobs.num_workers + 1;
+}
+
+// Per thread memory for the job that's running, freed when the job returns.
+inline Scratch_Arena *
+job_scratch()
+{
+	assert(t_job_thread && t_job_thread->depth > 0);
+	return &t_job_thread->scratch;
+}
+
+// Queues count jobs, each getting one index in [0, count), and adds them to counter.
+void
+job_run(Job_Proc proc, void *data, uint32_t count, Job_Counter *counter)
+{
+	assert(t_job_thread);
+	atomic_fetch_add(&counter->count, count);
+	for (uint32_t i = 0; i < count; ++i)
+		push_job({ proc, data, counter, i, i + 1 });
+	wake_workers(count);
+}
+
+// Runs jobs until the counter reaches zero. Background jobs are only run if the waiting thread is doing background work itself.
+void
+job_wait(Job_Counter *counter)
+{
+	assert(t_job_thread);
+	Job_Priority max_priority = current_job_priority();
+	while (atomic_load(&counter->count) != 0) {
+		Job job;
+		Job_Priority priority;
+		if (find_job(&job, &priority, max_priority))
+			execute_job(job, priority);
+		else
+			__builtin_ia32_pause();
+	}
+}
+
+// Splits [0, count) into ranges of at least min_batch items, runs them across the job threads and waits for all of them. The
+// calling thread works on them too.
+void
+parallel_for(Job_Proc proc, void *data, uint32_t count, uint32_t min_batch)
+{
+	if (count == 0)
+		return;
+	uint32_t max_jobs = job_thread_count() * JOBS_PER_THREAD;
+	uint32_t batch = _max(min_batch, (count + max_jobs - 1) / max_jobs);
+	uint32_t num_jobs = (count + batch - 1) / batch;
+	Job_Counter counter = { num_jobs };
+	if (num_jobs == 1) {
+		execute_job({ proc, data, &counter, 0, count }, current_job_priority());
+		return;
+	}
+	for (uint32_t i = 0; i < num_jobs; ++i)
+		push_job({ proc, data, &counter, i*batch, _min(count, (i + 1)*batch) });
+	wake_workers(num_jobs - 1);
+	job_wait(&counter);
+}
@@ -1,9 +1,3 @@
-constexpr int
-round_nearest(float f)
-{
-	return (f > 0.0f) ? (int)(f + 0.5f) : (int)(f - 0.5f);
-}
-
 constexpr int
 round_up(float f)
 {
@@ -60,6 +54,70 @@ strstr(const char *s, const char *substring)
 	return NULL;
 }
 
+// Returns the value before the add.
+inline uint32_t
+atomic_fetch_add(volatile uint32_t *p, uint32_t v)
+{
+	return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL);
+}
+
+inline uint32_t
+atomic_load(const volatile uint32_t *p)
+{
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+inline void
+atomic_store(volatile uint32_t *p, uint32_t v)
+{
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+// Sets *p to desired if it holds expected. Returns whether it did.
+inline bool
+atomic_compare_exchange(volatile uint32_t *p, uint32_t expected, uint32_t desired)
+{
+	return __atomic_compare_exchange_n(p, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+template <typename T>
+inline void
+swap(T &a, T &b)
+{
+	T tmp = a;
+	a = b;
+	b = tmp;
+}
+
+// Xorshift32, for benchmarks and test data. Quick, but nowhere near good enough for anything that needs real randomness. The
+// state must never be 0.
+constexpr uint32_t DEFAULT_RAND_SEED = 0x9E3779B9;
+
+inline uint32_t
+xorshift32(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// Uniform in [0, 1).
+inline float
+rand01(uint32_t *state)
+{
+	return (xorshift32(state) >> 8) * (1.0f / (1 << 24));
+}
+
+// Uniform in [-1, 1).
+inline float
+rand11(uint32_t *state)
+{
+	return (xorshift32(state) >> 8) * (2.0f / (1 << 24)) - 1.0f;
+}
+
 size_t
 strlen(const char *s)
 {
@@ -69,6 +127,15 @@ strlen(const char *s)
 	return count;
 }
 
+int
+strcmp(const char *a, const char *b)
+{
+	while (*a && *a == *b) {
+		a++; b++;
+	}
+	return (unsigned char)*a - (unsigned char)*b;
+}
+
 void
 strcpy(char *dest, char *src)
 {
@@ -89,7 +156,7 @@ strrev(char *start, char *end)
 }
 
 size_t
-push_integer(int i, char *buf)
+push_integer(long i, char *buf)
 {
 	size_t nbytes_writ = 0;
 	if (i < 0) {
@@ -107,7 +174,25 @@ push_integer(int i, char *buf)
 	return nbytes_writ;
 }
 
-// TODO: Handle floating point!!!!!
+// Fixed three decimal places, which is plenty for debug output.
+size_t
+push_float(double f, char *buf)
+{
+	size_t nbytes_writ = 0;
+	if (f < 0.0) {
+		buf[nbytes_writ++] = '-';
+		f = -f;
+	}
+	long scaled = (long)(f * 1000.0 + 0.5);
+	nbytes_writ += push_integer(scaled / 1000, buf + nbytes_writ);
+	buf[nbytes_writ++] = '.';
+	int frac = scaled % 1000;
+	buf[nbytes_writ++] = '0' + frac / 100;
+	buf[nbytes_writ++] = '0' + (frac / 10) % 10;
+	buf[nbytes_writ++] = '0' + frac % 10;
+	return nbytes_writ;
+}
+
 size_t
 format_string(const char *fmt, va_list arg_list, char *buf)
 {
@@ -137,6 +222,10 @@ format_string(const char *fmt, va_list arg_list, char *buf)
 				nbytes_writ += push_integer(l, buf + nbytes_writ);
 				break;
 			}
+			case 'f': {
+				nbytes_writ += push_float(va_arg(arg_list, double), buf + nbytes_writ);
+				break;
+			}
 			}
 			++at;
 		}
@@ -217,47 +306,70 @@ get_base_name(const char *path, char *name_buf)
 */
 
 // Array
+// Grows in place in a virtual arena of its own, reserved on the first alloc, so elements never move and pointers to them stay
+// valid. The reservation is max_capacity elements, or ARRAY_DEFAULT_RESERVE bytes' worth if that's 0, and growing past it is an
+// error. A zeroed Array is an empty one.
+constexpr size_t ARRAY_DEFAULT_RESERVE = MEGABYTE(256);
+
 template <typename T>
 struct Array {
 	size_t size;
 	size_t capacity;
+	size_t max_capacity;
 	T *elems;
+	Virtual_Arena memory;
 	T &operator[](size_t i) { assert(i < size); return elems[i]; }
 };
 
 template <typename T>
-//Array<T>
 void
-make_array(size_t init_capacity = 0)
+array_clear(Array<T> *a)
 {
-	//a->size = 0;
-	//a->capacity = init_capacity;
-	//a->elems = (T *)malloc(sizeof(T)*init_capacity);
+	a->size = 0;
 }
 
 template <typename T>
 void
-array_clear(Array<T> *a)
+array_destroy(Array<T> *a)
 {
-	a->size = 0;
+	if (a->memory.base)
+		mem_destroy_virtual_arena(&a->memory);
+	*a = {};
 }
 
+// Commits room for at least capacity elements.
 template <typename T>
 void
-array_destroy(Array<T> *a)
+array_reserve(Array<T> *a, size_t capacity)
 {
+	if (capacity <= a->capacity)
+		return;
+	if (!a->memory.base) {
+		a->memory = mem_make_virtual_arena(a->max_capacity ? sizeof(T) * a->max_capacity : ARRAY_DEFAULT_RESERVE);
+		a->elems = (T *)a->memory.base;
+	}
+	mem_commit_virtual(&a->memory, sizeof(T) * capacity);
+	a->capacity = (a->memory.committed_end - a->memory.base) / sizeof(T);
+}
 
+// max_capacity is 0 for the default reservation.
+template <typename T>
+Array<T>
+make_array(size_t init_capacity = 0, size_t max_capacity = 0)
+{
+	Array<T> a = {};
+	a.max_capacity = max_capacity;
+	if (init_capacity > 0)
+		array_reserve(&a, init_capacity);
+	return a;
 }
 
 template <typename T>
 T *
 array_alloc(Array<T> *a, size_t count = 1)
 {
-	if (a->size + count > a->capacity) {
-		a->capacity = (a->capacity + count) * 2;
-		// TODO: Do realloc properly.
-		a->elems = (T *)realloc(a->elems, sizeof(T) * a->capacity);
-	}
+	if (a->size + count > a->capacity)
+		array_reserve(a, a->size + count);
 	T *start = &a->elems[a->size];
 	a->size += count;
 	return start;
@@ -277,107 +389,145 @@ end(Array<T> &a)
 	return &a.elems[a.size];
 }
 
-// pool -- array of objects that allows deleted objects to be reused rather than
-// shifting elements around. Each object has a unique ID.
-
-#define POOL_MAX 0xFFFF
-#define INDEX_MASK 0x0000FFFF
-#define KEY_MASK 0xFFFF0000
-#define NUM_INDEX_BITS 16
+// Pool
+// Objects addressed by handles and packed densely, so iterating them never steps over holes. A handle is a slot index plus the
+// generation the slot was at when the handle was given out. Freeing moves the slot on a generation, so stale handles are caught
+// rather than quietly getting whatever took their place. Alloc, free and lookup are O(1). Free fills the hole with the last
+// object, so pointers into a pool only last until the next free. Allocs never move anything, since the arrays grow in place.
+// A slot is retired once its generation wraps, after 2^31 lives, so an old handle can't match it again.
+// A zeroed Pool is an empty one, and a zeroed Pool_Handle is never valid.
+
+struct Pool_Handle {
+	uint32_t index;
+	uint32_t generation;
+};
 
-template <typename T>
-struct Element {
-	T data;
-	uint32_t id; // for allocd: upper 16 bits are unique key, lower 16 are its index
-	             // for freed:  upper 16 are 0, lower 16 are index of next freed
+struct Pool_Slot {
+	uint32_t generation; // Odd while the slot is live, so handles, which are only made for live slots, are always odd.
+	uint32_t next;       // Live: where the object is in the dense array. Free: the next free slot plus one, or 0 at the end.
 };
 
 template <typename T>
 struct Pool {
-	uint32_t key;
-	int free_head;
-	int last_allocd; // element closest to the end that was ever allocd
-	Array<Element<T>> elems;
+	Array<T> objects;
+	Array<uint32_t> object_slots; // Slot of each object, for fixing up the one that's moved by a free.
+	Array<Pool_Slot> slots;
+	uint32_t free_head;           // First free slot plus one, or 0 if there isn't one.
 };
 
 template <typename T>
-void
-pool_init(Pool<T> *p)
+inline bool
+pool_valid(const Pool<T> &p, Pool_Handle h)
+{
+	return (h.generation & 1) && h.index < p.slots.size && p.slots.elems[h.index].generation == h.generation;
+}
+
+// Returns NULL for a handle that's stale, or never came from this pool.
+template <typename T>
+inline T *
+pool_get(const Pool<T> &p, Pool_Handle h)
 {
-	p->key = 1;
-	p->free_head = -1;
-	//p->last_allocd = -1;
-	array_init(&p->elems);
+	if (!pool_valid(p, h))
+		return NULL;
+	return &p.objects.elems[p.slots.elems[h.index].next];
 }
 
+// The new object is left uninitialized.
 template <typename T>
 T *
-pool_alloc(Pool<T> *p)
+pool_alloc(Pool<T> *p, Pool_Handle *handle)
 {
-	int index;
-	if (p->free_head != -1) {
-		index = p->free_head;
-		//new_elem = &p->elems[p->free_head];
-		p->free_head = p->elems[p->free_head].id & INDEX_MASK;
+	uint32_t index;
+	if (p->free_head) {
+		index = p->free_head - 1;
+		p->free_head = p->slots[index].next;
 	} else {
-	/*
-		if (++p->last_allocd >= p->capacity) {
-			p->capacity *= 2;
-			assert(p->capacity <= POOL_MAX);
-			p->elems = (Element<T> *)realloc(p->elems, sizeof(Element<T>) * p->capacity);
-		}
-	*/
-		index = p->elems.size;
-		array_alloc(p->elems);
+		assert(p->slots.size < UINT32_MAX);
+		index = p->slots.size;
+		*array_alloc(&p->slots) = {};
 	}
-	//p->elems[index].id = (p->key++ << NUM_INDEX_BITS) | index;
-	p->elems[index].id = (p->key++ << NUM_INDEX_BITS) | index;
-	return &p->elems[index].data;
+	Pool_Slot *slot = &p->slots[index];
+	++slot->generation;
+	slot->next = p->objects.size;
+	*array_alloc(&p->object_slots) = index;
+	*handle = { index, slot->generation };
+	return array_alloc(&p->objects);
 }
 
+// Returns false, and does nothing, if the handle is stale.
 template <typename T>
-uint32_t
-pool_getid(T *data)
+bool
+pool_free(Pool<T> *p, Pool_Handle h)
 {
-	return *(uint32_t *)(((char *)data) + offsetof(Element<T>, id));
+	if (!pool_valid(*p, h))
+		return false;
+	Pool_Slot *slot = &p->slots[h.index];
+	uint32_t hole = slot->next;
+	uint32_t last = p->objects.size - 1;
+	if (hole != last) {
+		p->objects[hole] = p->objects[last];
+		p->object_slots[hole] = p->object_slots[last];
+		p->slots[p->object_slots[hole]].next = hole;
+	}
+	--p->objects.size;
+	--p->object_slots.size;
+	++slot->generation;
+	// Wrapped. Reusing the slot would bring back handles from its first lives, so it's retired instead, left dead for good.
+	if (slot->generation == 0)
+		return true;
+	slot->next = p->free_head;
+	p->free_head = h.index + 1;
+	return true;
 }
 
+// Handle of an object in the pool, from a pointer or a position in the dense array.
 template <typename T>
-T *
-pool_get(const Pool<T> &p, int id)
+inline Pool_Handle
+pool_handle(const Pool<T> &p, const T *object)
 {
-	assert(p.elems[id & INDEX_MASK].id == id);
-	return &p.elems[id & INDEX_MASK].data;
+	uint32_t index = p.object_slots.elems[object - p.objects.elems];
+	return { index, p.slots.elems[index].generation };
 }
 
 template <typename T>
-T *
-pool_first(const Pool<T> &p)
+inline size_t
+pool_size(const Pool<T> &p)
 {
-	for (const auto &e : p.elems) {
-		if ((e.id & KEY_MASK) >> NUM_INDEX_BITS)
-			return &e.data;
-	}
-	return NULL;
+	return p.objects.size;
+}
+
+// Frees everything. Every handle goes stale, and the slots are kept for reuse.
+template <typename T>
+void
+pool_clear(Pool<T> *p)
+{
+	while (p->objects.size > 0)
+		pool_free(p, pool_handle(*p, &p->objects.elems[p->objects.size - 1]));
 }
 
 template <typename T>
 void
 pool_destroy(Pool<T> *p)
 {
-	array_destroy(p->elems);
+	array_destroy(&p->objects);
+	array_destroy(&p->object_slots);
+	array_destroy(&p->slots);
+	p->free_head = 0;
 }
 
+// Iterates the live objects in dense order, which changes as objects are freed.
 template <typename T>
 T *
-pool_next(const Pool<T> &p, T *e)
+begin(Pool<T> &p)
 {
-	int e_ind = pool_getid(e) & INDEX_MASK;
-	for (int i = e_ind+1; i < p.elems.size; ++i) {
-		if ((p.elems[i].id & KEY_MASK) >> NUM_INDEX_BITS)
-			return &p.elems[i].data;
-	}
-	return NULL;
+	return begin(p.objects);
+}
+
+template <typename T>
+T *
+end(Pool<T> &p)
+{
+	return end(p.objects);
 }
 
 // Flat Map
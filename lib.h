@@ -10,4 +10,24 @@
 #define MEGABYTE(b) (KILOBYTE(b)*1024)
 #define GIGABYTE(b) (MEGABYTE(b)*1024)
 
+// Test and test-and-set lock. Only for critical sections a few instructions long, waiters never sleep.
+struct Spin_Lock {
+	volatile uint32_t locked;
+};
+
+inline void
+spin_lock(Spin_Lock *l)
+{
+	while (__atomic_exchange_n(&l->locked, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(&l->locked, __ATOMIC_RELAXED))
+			__builtin_ia32_pause();
+	}
+}
+
+inline void
+spin_unlock(Spin_Lock *l)
+{
+	__atomic_store_n(&l->locked, 0, __ATOMIC_RELEASE);
+}
+
 #endif
@@ -2,12 +2,6 @@
 #include <X11/Xlib.h>
 //#include <X11/extensions/Xrender.h>
 
-#include <sys/types.h>
-#include <unistd.h>
-#include <fcntl.h>
-#include <sys/mman.h>
-#include <time.h>
-
 #include <GL/gl.h>
 #include <GL/glx.h>
 #include <GL/glu.h>
@@ -20,31 +14,7 @@
 //#define stdin 0
 //#define stderr 2
 
-enum Linux_Key_Symbols {
-	PLATFORM_W_KEY = XK_w,
-	PLATFORM_A_KEY = XK_a,
-	PLATFORM_S_KEY = XK_s,
-	PLATFORM_D_KEY = XK_d,
-	PLATFORM_E_KEY = XK_e,
-	PLATFORM_G_KEY = XK_g,
-	PLATFORM_Q_KEY = XK_q,
-	PLATFORM_R_KEY = XK_r,
-	PLATFORM_F_KEY = XK_f,
-};
-
-enum Linux_Mouse_Buttons {
-	PLATFORM_MBUTTON_1 = Button1,
-	PLATFORM_MBUTTON_2 = Button2,
-	PLATFORM_MBUTTON_3 = Button3,
-};
-
-struct Platform_Time {
-	timespec time;
-};
-
-struct File_Handle {
-	int descriptor;
-};
+#include "linux_platform.h"
 
 #include "cge.cpp"
 
@@ -68,12 +38,6 @@ static int ctx_error_handler(Display *dpy, XErrorEvent *xev)
 	return 0;
 }
 
-const char *
-perrno()
-{
-	return "";
-}
-
 static bool
 is_ext_supported(const char *ext_list, const char *ext)
 {
@@ -103,6 +67,7 @@ is_ext_supported(const char *ext_list, const char *ext)
 int
 main()
 {
+	platform_init_memory_counters();
 	GLXFBConfig fbconfig;
 	Vec2u screen_dim { 1200, 900 };
 
@@ -312,139 +277,4 @@ platform_swap_buffers()
 	glXSwapBuffers(g_pctx.display, g_pctx.window);
 }
 
-void
-platform_debug_print(size_t nbytes, const char* buf)
-{
-	platform_write({1}, nbytes, buf);
-}
-
-// 
-// TODO: Signal IO errors.
-//
-
-// TODO: Handle modes.
-File_Handle
-platform_open_file(const char *path, const char *mode)
-{
-	File_Handle fh;
-	fh.descriptor = open(path, O_RDONLY);
-	if (fh.descriptor < 0) {
-		zerror("could not open file %s\n", path);
-		fh.descriptor = -1;
-		return fh;
-	}
-	return fh;
-}
-
-void
-platform_close_file(File_Handle fh)
-{
-	close(fh.descriptor);
-}
-
-void
-platform_read(File_Handle fh, size_t read_nbytes, void *buf)
-{
-	off_t tot_read = 0, cur_read = 0;
-	char *pos = (char *)buf;
-	do {
-		cur_read = read(fh.descriptor, pos, (read_nbytes - tot_read));
-		tot_read += cur_read;
-		pos += cur_read;
-	} while (tot_read < read_nbytes && cur_read != 0);
-	if (tot_read != read_nbytes)
-		zerror("could not read from file %s.", perrno());
-}
-
-void
-platform_write(File_Handle fh, size_t n, const void *buf)
-{
-	ssize_t tot_writ = 0, cur_writ = 0;
-	const char *pos = (char *)buf;
-	do {
-		cur_writ = write(fh.descriptor, pos, (n - tot_writ));
-		tot_writ += cur_writ;
-		pos += cur_writ;
-	} while (tot_writ < n && cur_writ != 0);
-	if (tot_writ != n) {
-		zerror("could not write to file. %s.", perrno());
-	}
-}
-
-// TODO: Use a custom offset type?
-void
-platform_file_seek(File_Handle fh, unsigned offset)
-{
-	assert(lseek(fh.descriptor, offset, SEEK_SET) != (off_t) -1);
-}
-
-char *
-platform_read_entire_file(const char *path, Memory_Arena *ma)
-{
-	int fd = open(path, O_RDONLY);
-	if (fd < 0) {
-		zerror("could not load file %s", path);
-		return NULL;
-	}
-	off_t len = lseek(fd, 0, SEEK_END);
-	if (len < 0) {
-		zerror("could not get %s file length. %s.\n", path, perrno());
-		return NULL;
-	}
-	lseek(fd, 0, SEEK_SET);
-	char *buf = mem_alloc_array(char, (len+1), ma);
-	// read may return less bytes than requested, so we have to loop.
-	off_t tot_read = 0, cur_read = 0;
-	char *pos = buf;
-	do {
-		cur_read = read(fd, pos, (len - tot_read));
-		tot_read += cur_read;
-		pos += cur_read;
-	} while (tot_read < len && cur_read != 0);
-	if (tot_read != len) {
-		zerror("could not read file %s.", path, perrno());
-		return NULL;
-	}
-	buf[len] = '\0';
-	close(fd);
-	return buf;
-}
-
-char *
-platform_get_memory(size_t len)
-{
-	void *m = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (m == (void *)-1)
-		zabort("failed to get memory from platform.");
-	return (char *)m;
-}
-
-void
-platform_free_memory(void *m, size_t len)
-{
-	int ret = munmap(m, len);
-	if (ret == -1)
-		zabort("failed to free memory.");
-}
-
-size_t
-platform_get_page_size()
-{
-	return sysconf(_SC_PAGESIZE);
-}
-
-inline Platform_Time
-platform_get_time()
-{
-	Platform_Time t;
-	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t.time);
-	return t;
-}
-
-// Time in milliseconds.
-inline long
-platform_time_diff(Platform_Time start, Platform_Time end, unsigned resolution)
-{
-	return (end.time.tv_nsec - start.time.tv_nsec) / resolution;
-}
-
+#include "linux_platform.cpp"
@@ -0,0 +1,706 @@
+// Everything in platform.h except the window, input and GL context, which live in linux_cge.cpp. Included last, after the
+// unity build's other sources.
+
+const char *
+perrno()
+{
+	return "";
+}
+
+void
+platform_debug_print(size_t nbytes, const char* buf)
+{
+	platform_write({1}, nbytes, buf);
+}
+
+// 
+// TODO: Signal IO errors.
+//
+
+// Only "r", and "w", which creates or truncates the file.
+File_Handle
+platform_open_file(const char *path, const char *mode)
+{
+	File_Handle fh;
+	if (mode[0] == 'w')
+		fh.descriptor = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	else
+		fh.descriptor = open(path, O_RDONLY);
+	if (fh.descriptor < 0) {
+		zerror("could not open file %s\n", path);
+		fh.descriptor = -1;
+		return fh;
+	}
+	return fh;
+}
+
+void
+platform_close_file(File_Handle fh)
+{
+	close(fh.descriptor);
+}
+
+void
+platform_read(File_Handle fh, size_t read_nbytes, void *buf)
+{
+	off_t tot_read = 0, cur_read = 0;
+	char *pos = (char *)buf;
+	do {
+		cur_read = read(fh.descriptor, pos, (read_nbytes - tot_read));
+		tot_read += cur_read;
+		pos += cur_read;
+	} while (tot_read < read_nbytes && cur_read != 0);
+	if (tot_read != read_nbytes)
+		zerror("could not read from file %s.", perrno());
+}
+
+void
+platform_write(File_Handle fh, size_t n, const void *buf)
+{
+	ssize_t tot_writ = 0, cur_writ = 0;
+	const char *pos = (char *)buf;
+	do {
+		cur_writ = write(fh.descriptor, pos, (n - tot_writ));
+		if (cur_writ <= 0)
+			break;
+		tot_writ += cur_writ;
+		pos += cur_writ;
+	} while (tot_writ < n);
+	if (tot_writ != n) {
+		zerror("could not write to file. %s.", perrno());
+	}
+}
+
+void
+platform_file_seek(File_Handle fh, uint64_t offset)
+{
+	if (lseek(fh.descriptor, offset, SEEK_SET) == (off_t)-1)
+		zerror("could not seek to %l. %s.", (long)offset, perrno());
+}
+
+char *
+platform_read_entire_file(const char *path, Scratch_Arena *ma)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		zerror("could not load file %s", path);
+		return NULL;
+	}
+	off_t len = lseek(fd, 0, SEEK_END);
+	if (len < 0) {
+		zerror("could not get %s file length. %s.\n", path, perrno());
+		return NULL;
+	}
+	lseek(fd, 0, SEEK_SET);
+	char *buf = mem_alloc_array(char, (len+1), ma);
+	// read may return less bytes than requested, so we have to loop.
+	off_t tot_read = 0, cur_read = 0;
+	char *pos = buf;
+	do {
+		cur_read = read(fd, pos, (len - tot_read));
+		tot_read += cur_read;
+		pos += cur_read;
+	} while (tot_read < len && cur_read != 0);
+	if (tot_read != len) {
+		zerror("could not read file %s.", path, perrno());
+		return NULL;
+	}
+	buf[len] = '\0';
+	close(fd);
+	return buf;
+}
+
+Mapped_File
+platform_map_file(const char *path)
+{
+	Mapped_File mf = {};
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		zerror("could not open file %s", path);
+		return mf;
+	}
+	DEFER(close(fd)); // The mapping keeps its own reference to the file.
+	off_t len = lseek(fd, 0, SEEK_END);
+	if (len <= 0) {
+		zerror("could not get %s file length. %s.", path, perrno());
+		return mf;
+	}
+	void *m = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (m == MAP_FAILED) {
+		zerror("could not map file %s. %s.", path, perrno());
+		return mf;
+	}
+	mf.data = (const char *)m;
+	mf.size = len;
+	return mf;
+}
+
+void
+platform_unmap_file(Mapped_File *mf)
+{
+	if (mf->data && munmap((void *)mf->data, mf->size) == -1)
+		zerror("could not unmap file. %s.", perrno());
+	*mf = {};
+}
+
+// Hint that a range of a mapped file is about to be read, so the kernel can start paging it in.
+void
+platform_prefetch(const void *addr, size_t len)
+{
+	size_t page_size = platform_get_page_size();
+	uintptr_t start = (uintptr_t)addr & ~(page_size - 1);
+	uintptr_t end = (uintptr_t)addr + len;
+	madvise((void *)start, end - start, MADV_WILLNEED);
+}
+
+// Drops the file's clean pages from the page cache so the next read has to go to disk. Pages that are still mapped stay put.
+void
+platform_evict_file_cache(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+char *
+platform_get_memory(size_t len)
+{
+	void *m = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (m == (void *)-1)
+		zabort("failed to get memory from platform.");
+	return (char *)m;
+}
+
+void
+platform_free_memory(void *m, size_t len)
+{
+	int ret = munmap(m, len);
+	if (ret == -1)
+		zabort("failed to free memory.");
+}
+
+// Address space only. Nothing is backed, or counted against overcommit, until it's committed. Give it back with
+// platform_free_memory(). alignment is a power of two, and the reservation is over-sized by it and then trimmed.
+char *
+platform_reserve_memory(size_t len, size_t alignment)
+{
+	char *m = (char *)mmap(0, len + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == (char *)-1)
+		zabort("failed to reserve %l bytes of address space.", (long)len);
+	char *aligned = (char *)(((uintptr_t)m + alignment - 1) & ~(alignment - 1));
+	if (aligned > m)
+		munmap(m, aligned - m);
+	if (m + alignment > aligned)
+		munmap(aligned + len, (m + alignment) - aligned);
+	return aligned;
+}
+
+// Hugetlb backing needs m and len to be huge page aligned and enough free pages in the pool. Without them it falls back to
+// transparent huge pages. Huge page advice and NUMA binding are hints, so failures there are ignored: the memory works either way.
+void
+platform_commit_memory(void *m, size_t len, Memory_Policy policy)
+{
+	if (policy.backing == MEM_BACKING_HUGETLB) {
+		if (mmap(m, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) == (void *)-1) {
+			// A failed fixed mapping can leave the range unmapped, so the fallback maps it again rather than changing its protection.
+			if (mmap(m, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == (void *)-1)
+				zabort("failed to commit memory.");
+			madvise(m, len, MADV_HUGEPAGE);
+		}
+	} else {
+		if (mprotect(m, len, PROT_READ | PROT_WRITE) == -1)
+			zabort("failed to commit memory.");
+		if (policy.backing == MEM_BACKING_HUGE_PAGES)
+			madvise(m, len, MADV_HUGEPAGE);
+	}
+	if (policy.numa_node >= 0) {
+		assert(policy.numa_node < 64);
+		unsigned long node_mask = 1ul << policy.numa_node;
+		syscall(SYS_mbind, m, len, MPOL_PREFERRED, &node_mask, 64, 0);
+	}
+}
+
+// The pages go back to the OS and the range is reserved only again. It reads as zeros once it's committed again.
+void
+platform_decommit_memory(void *m, size_t len, Memory_Policy policy)
+{
+	if (policy.backing == MEM_BACKING_HUGETLB) {
+		// Hugetlb pages only go back to the pool when they're unmapped, so map a plain reservation over them.
+		if (mmap(m, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == (void *)-1)
+			zabort("failed to decommit memory.");
+		return;
+	}
+	if (madvise(m, len, MADV_DONTNEED) == -1 || mprotect(m, len, PROT_NONE) == -1)
+		zabort("failed to decommit memory.");
+}
+
+// The node the calling thread is running on right now.
+unsigned
+platform_get_numa_node()
+{
+	unsigned cpu, node;
+	if (syscall(SYS_getcpu, &cpu, &node, NULL) == -1)
+		return 0;
+	return node;
+}
+
+static int g_dtlb_counter = -1;
+static int g_itlb_counter = -1;
+
+static int
+open_tlb_miss_counter(uint64_t cache)
+{
+	perf_event_attr attr = {};
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.inherit = 1; // Threads created later are counted too.
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Starts the TLB miss counters. They only follow threads created after this, so call it before starting any.
+void
+platform_init_memory_counters()
+{
+	g_dtlb_counter = open_tlb_miss_counter(PERF_COUNT_HW_CACHE_DTLB);
+	g_itlb_counter = open_tlb_miss_counter(PERF_COUNT_HW_CACHE_ITLB);
+	if (g_dtlb_counter < 0)
+		debug_print("TLB miss counters unavailable, errno %d\n", errno);
+}
+
+Platform_Memory_Counters
+platform_get_memory_counters()
+{
+	auto read_counter = [](int fd) -> long {
+		uint64_t v;
+		return (fd >= 0 && read(fd, &v, sizeof(v)) == sizeof(v)) ? (long)v : -1;
+	};
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	Platform_Memory_Counters c;
+	c.minor_faults = usage.ru_minflt;
+	c.major_faults = usage.ru_majflt;
+	c.dtlb_misses = read_counter(g_dtlb_counter);
+	c.itlb_misses = read_counter(g_itlb_counter);
+	return c;
+}
+
+size_t
+platform_get_page_size()
+{
+	return sysconf(_SC_PAGESIZE);
+}
+
+unsigned
+platform_get_processor_count()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
+
+struct Thread_Start {
+	void (*proc)(void *);
+	void *arg;
+};
+
+static void *
+thread_trampoline(void *p)
+{
+	Thread_Start start = *(Thread_Start *)p;
+	free(p);
+	start.proc(start.arg);
+	return NULL;
+}
+
+Platform_Thread
+platform_create_thread(void (*proc)(void *), void *arg)
+{
+	Platform_Thread t;
+	Thread_Start *start = (Thread_Start *)malloc(sizeof(Thread_Start));
+	*start = { proc, arg };
+	int err = pthread_create(&t.handle, NULL, thread_trampoline, start);
+	if (err != 0)
+		zabort("failed to create thread, error %d.", err);
+	return t;
+}
+
+void
+platform_join_thread(Platform_Thread t)
+{
+	pthread_join(t.handle, NULL);
+}
+
+// Pins the calling thread to the index'th CPU it's allowed to run on, wrapping around.
+void
+platform_pin_thread(unsigned index)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0)
+		return;
+	index %= CPU_COUNT(&allowed);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &allowed) && index-- == 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+			return;
+		}
+	}
+}
+
+void
+platform_init_semaphore(Platform_Semaphore *s, unsigned count)
+{
+	if (sem_init(&s->sem, 0, count) != 0)
+		zabort("failed to create semaphore, error %d.", errno);
+}
+
+void
+platform_post_semaphore(Platform_Semaphore *s)
+{
+	sem_post(&s->sem);
+}
+
+void
+platform_wait_semaphore(Platform_Semaphore *s)
+{
+	// Signals can interrupt the wait, in which case we just go back to waiting.
+	while (sem_wait(&s->sem) != 0 && errno == EINTR)
+		;
+}
+
+// Async file reads.
+
+constexpr unsigned IO_POOL_THREADS = 4;
+
+struct Io_Thread_Pool {
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	Platform_Async_Read *pending_head, *pending_tail;
+	Platform_Async_Read *done_head, *done_tail;
+	bool quit;
+	pthread_t threads[IO_POOL_THREADS];
+};
+
+static void
+push_async_read(Platform_Async_Read **head, Platform_Async_Read **tail, Platform_Async_Read *r)
+{
+	r->next = NULL;
+	if (*tail)
+		(*tail)->next = r;
+	else
+		*head = r;
+	*tail = r;
+}
+
+static Platform_Async_Read *
+pop_async_read(Platform_Async_Read **head, Platform_Async_Read **tail)
+{
+	Platform_Async_Read *r = *head;
+	*head = r->next;
+	if (!*head)
+		*tail = NULL;
+	return r;
+}
+
+static void *
+io_pool_thread(void *p)
+{
+	Io_Thread_Pool *pool = (Io_Thread_Pool *)p;
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (!pool->pending_head && !pool->quit)
+			pthread_cond_wait(&pool->work_ready, &pool->lock);
+		if (pool->quit)
+			break;
+		Platform_Async_Read *r = pop_async_read(&pool->pending_head, &pool->pending_tail);
+		pthread_mutex_unlock(&pool->lock);
+		// pread may come back short, so keep going until the whole read is in or we hit the end of the file.
+		while (r->num_done < r->size) {
+			ssize_t n = pread(r->file.descriptor, (char *)r->buffer + r->num_done, r->size - r->num_done, r->offset + r->num_done);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				r->result = n < 0 ? -errno : r->num_done;
+				break;
+			}
+			r->num_done += n;
+			r->result = r->num_done;
+		}
+		pthread_mutex_lock(&pool->lock);
+		push_async_read(&pool->done_head, &pool->done_tail, r);
+		pthread_cond_signal(&pool->work_done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static bool
+init_io_uring(Io_Uring *r, unsigned num_entries)
+{
+	io_uring_params params = {};
+	r->fd = syscall(__NR_io_uring_setup, num_entries, &params);
+	if (r->fd < 0)
+		return false;
+	r->num_entries = params.sq_entries;
+	r->num_unsubmitted = 0;
+	r->sq_ring_size = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+	r->cq_ring_size = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+	bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+	if (single_mmap)
+		r->sq_ring_size = r->cq_ring_size = _max(r->sq_ring_size, r->cq_ring_size);
+	r->sq_ring = mmap(0, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	r->cq_ring = single_mmap ? r->sq_ring : mmap(0, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	void *sqes = mmap(0, params.sq_entries*sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+	if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+		if (r->sq_ring != MAP_FAILED)
+			munmap(r->sq_ring, r->sq_ring_size);
+		if (!single_mmap && r->cq_ring != MAP_FAILED)
+			munmap(r->cq_ring, r->cq_ring_size);
+		if (sqes != MAP_FAILED)
+			munmap(sqes, params.sq_entries*sizeof(io_uring_sqe));
+		close(r->fd);
+		r->fd = -1;
+		return false;
+	}
+	char *sq = (char *)r->sq_ring, *cq = (char *)r->cq_ring;
+	r->sq_head = (unsigned *)(sq + params.sq_off.head);
+	r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+	r->sq_array = (unsigned *)(sq + params.sq_off.array);
+	r->sqes = (io_uring_sqe *)sqes;
+	r->cq_head = (unsigned *)(cq + params.cq_off.head);
+	r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+	r->cqes = (io_uring_cqe *)(cq + params.cq_off.cqes);
+	return true;
+}
+
+// Hands everything queued in the submission ring to the kernel and, if min_complete is nonzero, waits for that many completions.
+// Returns false if the ring is broken.
+static bool
+enter_io_uring(Io_Uring *r, unsigned min_complete)
+{
+	for (;;) {
+		int n = syscall(__NR_io_uring_enter, r->fd, r->num_unsubmitted, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (n >= 0) {
+			r->num_unsubmitted -= n;
+			return true;
+		}
+		if (errno == EAGAIN || errno == EBUSY)
+			return true; // Out of resources, the reads stay queued and go in with the next call.
+		if (errno != EINTR) {
+			zerror("io_uring_enter failed, error %d.", errno);
+			return false;
+		}
+	}
+}
+
+// The ring has room, since reads in flight never exceed its size.
+static void
+queue_io_uring_read(Io_Uring *r, Platform_Async_Read *read)
+{
+	unsigned tail = *r->sq_tail;
+	unsigned index = tail & *r->sq_mask;
+	io_uring_sqe *sqe = &r->sqes[index];
+	__builtin_memset(sqe, 0, sizeof(*sqe));
+	sqe->fd = read->file.descriptor;
+	sqe->off = read->offset + read->num_done;
+	sqe->user_data = (uint64_t)(uintptr_t)read;
+	if (read->registered_buffer >= 0) {
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->addr = (uint64_t)(uintptr_t)((char *)read->buffer + read->num_done);
+		sqe->len = read->size - read->num_done;
+		sqe->buf_index = read->registered_buffer;
+	} else {
+		sqe->opcode = IORING_OP_READV;
+		read->iov.iov_base = (char *)read->buffer + read->num_done;
+		read->iov.iov_len = read->size - read->num_done;
+		sqe->addr = (uint64_t)(uintptr_t)&read->iov;
+		sqe->len = 1;
+	}
+	r->sq_array[index] = index;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	++r->num_unsubmitted;
+}
+
+bool
+platform_init_async_io(Platform_Async_Io *io, unsigned queue_depth)
+{
+	io->pool = NULL;
+	io->num_in_flight = 0;
+	if (init_io_uring(&io->ring, queue_depth)) {
+		io->queue_depth = _min(queue_depth, io->ring.num_entries);
+		return true;
+	}
+	// Old kernels don't have io_uring and sandboxes often turn it off.
+	io->queue_depth = queue_depth;
+	Io_Thread_Pool *pool = (Io_Thread_Pool *)malloc(sizeof(Io_Thread_Pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_ready, NULL);
+	pthread_cond_init(&pool->work_done, NULL);
+	pool->pending_head = pool->pending_tail = pool->done_head = pool->done_tail = NULL;
+	pool->quit = false;
+	for (unsigned i = 0; i < IO_POOL_THREADS; ++i) {
+		int err = pthread_create(&pool->threads[i], NULL, io_pool_thread, pool);
+		if (err != 0) {
+			zerror("failed to create io thread, error %d.", err);
+			pool->quit = true;
+			pthread_cond_broadcast(&pool->work_ready);
+			for (unsigned j = 0; j < i; ++j)
+				pthread_join(pool->threads[j], NULL);
+			free(pool);
+			return false;
+		}
+	}
+	io->pool = pool;
+	return true;
+}
+
+// Reads still in flight are abandoned, so wait for them first.
+void
+platform_destroy_async_io(Platform_Async_Io *io)
+{
+	if (io->pool) {
+		Io_Thread_Pool *pool = io->pool;
+		pthread_mutex_lock(&pool->lock);
+		pool->quit = true;
+		pthread_cond_broadcast(&pool->work_ready);
+		pthread_mutex_unlock(&pool->lock);
+		for (unsigned i = 0; i < IO_POOL_THREADS; ++i)
+			pthread_join(pool->threads[i], NULL);
+		pthread_mutex_destroy(&pool->lock);
+		pthread_cond_destroy(&pool->work_ready);
+		pthread_cond_destroy(&pool->work_done);
+		free(pool);
+		io->pool = NULL;
+		return;
+	}
+	Io_Uring *r = &io->ring;
+	munmap(r->sqes, r->num_entries*sizeof(io_uring_sqe));
+	if (r->cq_ring != r->sq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	r->fd = -1;
+}
+
+const char *
+platform_async_io_backend(const Platform_Async_Io *io)
+{
+	return io->pool ? "thread pool" : "io_uring";
+}
+
+// Pins the buffers so reads into them skip the per-read page mapping. Reads into a registered buffer set registered_buffer to its
+// index. Can only be done once.
+bool
+platform_register_async_buffers(Platform_Async_Io *io, void **buffers, const size_t *sizes, unsigned count)
+{
+	if (io->pool)
+		return true;
+	iovec iovs[64];
+	if (count > ARR_LEN(iovs))
+		return false;
+	for (unsigned i = 0; i < count; ++i)
+		iovs[i] = { buffers[i], sizes[i] };
+	if (syscall(__NR_io_uring_register, io->ring.fd, IORING_REGISTER_BUFFERS, iovs, count) < 0) {
+		zerror("could not register io buffers, error %d.", errno);
+		return false;
+	}
+	return true;
+}
+
+// Returns how many of the reads were taken, which is fewer than count once queue_depth reads are in flight.
+unsigned
+platform_submit_async_reads(Platform_Async_Io *io, Platform_Async_Read **reads, unsigned count)
+{
+	count = _min(count, io->queue_depth - io->num_in_flight);
+	if (count == 0)
+		return 0;
+	for (unsigned i = 0; i < count; ++i) {
+		reads[i]->num_done = 0;
+		reads[i]->result = 0;
+	}
+	io->num_in_flight += count;
+	if (io->pool) {
+		pthread_mutex_lock(&io->pool->lock);
+		for (unsigned i = 0; i < count; ++i)
+			push_async_read(&io->pool->pending_head, &io->pool->pending_tail, reads[i]);
+		pthread_cond_broadcast(&io->pool->work_ready);
+		pthread_mutex_unlock(&io->pool->lock);
+		return count;
+	}
+	for (unsigned i = 0; i < count; ++i)
+		queue_io_uring_read(&io->ring, reads[i]);
+	enter_io_uring(&io->ring, 0);
+	return count;
+}
+
+// Fills out with up to max finished reads and returns how many. Blocks until at least wait_for are done, or returns right away if
+// wait_for is 0.
+unsigned
+platform_get_async_completions(Platform_Async_Io *io, Platform_Async_Read **out, unsigned max, unsigned wait_for)
+{
+	wait_for = _min(_min(wait_for, max), io->num_in_flight);
+	unsigned n = 0;
+	if (io->pool) {
+		Io_Thread_Pool *pool = io->pool;
+		pthread_mutex_lock(&pool->lock);
+		for (;;) {
+			while (n < max && pool->done_head)
+				out[n++] = pop_async_read(&pool->done_head, &pool->done_tail);
+			if (n >= wait_for)
+				break;
+			pthread_cond_wait(&pool->work_done, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+		io->num_in_flight -= n;
+		return n;
+	}
+	Io_Uring *r = &io->ring;
+	for (;;) {
+		unsigned head = *r->cq_head, tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail && n < max; ++head) {
+			io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+			Platform_Async_Read *read = (Platform_Async_Read *)(uintptr_t)cqe->user_data;
+			if (cqe->res > 0 && read->num_done + cqe->res < read->size) {
+				// Short read, go back for the rest. The completion just freed up a slot in the ring for it.
+				read->num_done += cqe->res;
+				queue_io_uring_read(r, read);
+				continue;
+			}
+			read->result = cqe->res < 0 ? cqe->res : read->num_done + cqe->res;
+			out[n++] = read;
+		}
+		__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+		if (n >= wait_for && r->num_unsubmitted == 0)
+			break;
+		if (!enter_io_uring(r, n >= wait_for ? 0 : 1) || n >= wait_for)
+			break;
+	}
+	io->num_in_flight -= n;
+	return n;
+}
+
+inline Platform_Time
+platform_get_time()
+{
+	Platform_Time t;
+	// Wall clock rather than process CPU time, so that time spent waiting on the GPU shows up in frame timings.
+	clock_gettime(CLOCK_MONOTONIC, &t.time);
+	return t;
+}
+
+// Resolution is in nanoseconds, i.e. pass 1000000 to get milliseconds.
+inline long
+platform_time_diff(Platform_Time start, Platform_Time end, unsigned resolution)
+{
+	return ((end.time.tv_sec - start.time.tv_sec) * 1000000000L + (end.time.tv_nsec - start.time.tv_nsec)) / resolution;
+}
+
@@ -0,0 +1,113 @@
+// The parts of the Linux platform layer that don't need a window, shared by the engine and the standalone benches. The
+// key and mouse button values still come from the X headers, but those two only define constants.
+
+#include <X11/X.h>
+#include <X11/keysym.h>
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <linux/io_uring.h>
+#include <linux/mempolicy.h>
+#include <linux/perf_event.h>
+
+enum Linux_Key_Symbols {
+	PLATFORM_W_KEY = XK_w,
+	PLATFORM_A_KEY = XK_a,
+	PLATFORM_B_KEY = XK_b,
+	PLATFORM_S_KEY = XK_s,
+	PLATFORM_D_KEY = XK_d,
+	PLATFORM_E_KEY = XK_e,
+	PLATFORM_G_KEY = XK_g,
+	PLATFORM_K_KEY = XK_k,
+	PLATFORM_L_KEY = XK_l,
+	PLATFORM_Q_KEY = XK_q,
+	PLATFORM_R_KEY = XK_r,
+	PLATFORM_F_KEY = XK_f,
+	PLATFORM_T_KEY = XK_t,
+	PLATFORM_Z_KEY = XK_z,
+};
+
+enum Linux_Mouse_Buttons {
+	PLATFORM_MBUTTON_1 = Button1,
+	PLATFORM_MBUTTON_2 = Button2,
+	PLATFORM_MBUTTON_3 = Button3,
+};
+
+struct Platform_Time {
+	timespec time;
+};
+
+// Counted since the process started, for the whole process.
+struct Platform_Memory_Counters {
+	long minor_faults;
+	long major_faults;
+	long dtlb_misses; // Loads that missed the data TLB, or -1 if perf events aren't available.
+	long itlb_misses;
+};
+
+struct File_Handle {
+	int descriptor;
+};
+
+struct Platform_Thread {
+	pthread_t handle;
+};
+
+struct Platform_Semaphore {
+	sem_t sem;
+};
+
+// One read for the async file API. The caller fills in the first five fields and leaves the read alone until it comes back
+// as a completion.
+struct Platform_Async_Read {
+	File_Handle file;
+	uint64_t offset;
+	size_t size;
+	void *buffer;
+	int registered_buffer; // Index of the registered buffer that buffer lies in, or -1.
+	int64_t result;        // Bytes read, or a negated errno.
+	void *user_data;
+
+	size_t num_done; // Bytes read so far, short reads get resubmitted for the rest.
+	iovec iov;
+	Platform_Async_Read *next; // Thread pool queue link.
+};
+
+struct Io_Uring {
+	int fd;
+	unsigned num_entries;
+	unsigned num_unsubmitted; // Queued in the submission ring but not yet handed to the kernel.
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	io_uring_sqe *sqes;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+};
+
+struct Io_Thread_Pool;
+
+// Batched, overlapped reads with 64 bit offsets. Backed by io_uring when the kernel allows it, otherwise by a few threads doing
+// pread(). Belongs to one thread, which does all of the submitting and reaping.
+struct Platform_Async_Io {
+	Io_Uring ring; // ring.fd is -1 on the thread pool.
+	Io_Thread_Pool *pool;
+	unsigned queue_depth;
+	unsigned num_in_flight;
+};
+
+// Read-only view of a whole file.
+struct Mapped_File {
+	const char *data;
+	size_t size;
+};
@@ -0,0 +1,243 @@
+#ifndef __LZ_H__
+#define __LZ_H__
+
+// LZ77 compression in the LZ4 block format, shared by the asset packer and the engine.
+// A block is a run of sequences. Each one is a token byte (literal count in the high nibble, match length - 4 in the low
+// nibble, 15 meaning more length bytes follow), the literals, then a 2 byte little endian match offset and the extra match
+// length bytes. The last sequence is literals only. Like LZ4, the last LZ_LAST_LITERALS bytes are always literals and no
+// match starts in the last LZ_MATCH_LIMIT bytes.
+// The fast compressor takes the first match it finds through a hash table. The high compression one walks hash chains and
+// looks one byte ahead before committing to a match. Both produce blocks the same decompressor reads.
+// Only needs stdint.h, so it can go in either build.
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 16
+#define LZ_HC_MAX_ATTEMPTS 256
+
+enum Lz_Level {
+	LZ_FAST,
+	LZ_HIGH,
+};
+
+// Worst case compressed size, for incompressible input.
+inline size_t
+lz_compress_bound(size_t n)
+{
+	return n + n/255 + 16;
+}
+
+inline uint32_t
+lz_read32(const uint8_t *p)
+{
+	uint32_t v;
+	__builtin_memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+inline uint32_t
+lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+inline size_t
+lz_match_length(const uint8_t *src, size_t ref, size_t ip, size_t match_end)
+{
+	size_t len = 0;
+	while (ip + len < match_end && src[ref + len] == src[ip + len])
+		++len;
+	return len;
+}
+
+inline uint8_t *
+lz_write_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+// Writes literals [anchor, ip) followed by a match, or just the literals if match_len is 0.
+inline uint8_t *
+lz_write_sequence(uint8_t *op, const uint8_t *src, size_t anchor, size_t ip, size_t offset, size_t match_len)
+{
+	size_t num_literals = ip - anchor;
+	uint8_t *token = op++;
+	*token = (uint8_t)((num_literals < 15 ? num_literals : 15) << 4);
+	if (num_literals >= 15)
+		op = lz_write_length(op, num_literals - 15);
+	__builtin_memcpy(op, src + anchor, num_literals);
+	op += num_literals;
+	if (match_len == 0)
+		return op;
+	*op++ = (uint8_t)offset;
+	*op++ = (uint8_t)(offset >> 8);
+	size_t ml = match_len - LZ_MIN_MATCH;
+	*token |= (uint8_t)(ml < 15 ? ml : 15);
+	if (ml >= 15)
+		op = lz_write_length(op, ml - 15);
+	return op;
+}
+
+// Positions are stored plus one so that zero means empty.
+struct Lz_Hash_Chains {
+	uint32_t head[1 << LZ_HASH_BITS];
+	uint32_t prev[LZ_MAX_OFFSET + 1]; // Indexed by position modulo the window.
+};
+
+// dst must hold lz_compress_bound(n) bytes. scratch must hold sizeof(Lz_Hash_Chains) bytes, the fast level only uses the head
+// table. Returns the compressed size.
+inline size_t
+lz_compress(const uint8_t *src, size_t n, uint8_t *dst, Lz_Level level, void *scratch)
+{
+	Lz_Hash_Chains *hc = (Lz_Hash_Chains *)scratch;
+	for (size_t i = 0; i < (1 << LZ_HASH_BITS); ++i)
+		hc->head[i] = 0;
+	uint8_t *op = dst;
+	size_t ip = 0, anchor = 0;
+	if (n < LZ_MATCH_LIMIT + 1)
+		return lz_write_sequence(op, src, 0, n, 0, 0) - dst;
+	size_t match_start_limit = n - LZ_MATCH_LIMIT;
+	size_t match_end = n - LZ_LAST_LITERALS;
+
+	// Returns the longest match for ip, inserting ip into the hash table or chains on the way.
+	auto find_match = [&](size_t pos, size_t *out_offset) -> size_t {
+		uint32_t h = lz_hash(lz_read32(src + pos));
+		size_t best_len = 0;
+		if (level == LZ_FAST) {
+			size_t ref = hc->head[h];
+			hc->head[h] = (uint32_t)pos + 1;
+			if (ref && pos - (ref - 1) <= LZ_MAX_OFFSET && lz_read32(src + ref - 1) == lz_read32(src + pos)) {
+				best_len = lz_match_length(src, ref - 1, pos, match_end);
+				*out_offset = pos - (ref - 1);
+			}
+			return best_len;
+		}
+		size_t ref = hc->head[h];
+		hc->prev[pos & LZ_MAX_OFFSET] = (uint32_t)(ref && pos - (ref - 1) <= LZ_MAX_OFFSET ? ref : 0);
+		hc->head[h] = (uint32_t)pos + 1;
+		for (int attempts = 0; ref && attempts < LZ_HC_MAX_ATTEMPTS; ++attempts) {
+			size_t r = ref - 1;
+			if (pos - r > LZ_MAX_OFFSET)
+				break;
+			if (src[r + best_len] == src[pos + best_len] && lz_read32(src + r) == lz_read32(src + pos)) {
+				size_t len = lz_match_length(src, r, pos, match_end);
+				if (len > best_len) {
+					best_len = len;
+					*out_offset = pos - r;
+				}
+			}
+			uint32_t next = hc->prev[r & LZ_MAX_OFFSET];
+			if (!next || next >= ref)
+				break;
+			ref = next;
+		}
+		return best_len;
+	};
+	auto insert = [&](size_t pos) {
+		uint32_t h = lz_hash(lz_read32(src + pos));
+		if (level == LZ_HIGH) {
+			size_t ref = hc->head[h];
+			hc->prev[pos & LZ_MAX_OFFSET] = (uint32_t)(ref && pos - (ref - 1) <= LZ_MAX_OFFSET ? ref : 0);
+		}
+		hc->head[h] = (uint32_t)pos + 1;
+	};
+
+	size_t pending_len = 0, pending_offset = 0;
+	while (ip < match_start_limit) {
+		size_t offset = 0;
+		size_t len = pending_len ? pending_len : find_match(ip, &offset);
+		if (pending_len)
+			offset = pending_offset;
+		pending_len = 0;
+		if (len < LZ_MIN_MATCH) {
+			// Skip ahead faster the longer we go without a match, like LZ4 does.
+			ip += (level == LZ_FAST) ? 1 + ((ip - anchor) >> 6) : 1;
+			continue;
+		}
+		// Lazy matching: if the next byte starts a longer match, emit this byte as a literal instead.
+		if (level == LZ_HIGH && ip + 1 < match_start_limit) {
+			size_t next_offset = 0;
+			size_t next_len = find_match(ip + 1, &next_offset);
+			if (next_len > len) {
+				pending_len = next_len;
+				pending_offset = next_offset;
+				++ip;
+				continue;
+			}
+		}
+		op = lz_write_sequence(op, src, anchor, ip, offset, len);
+		size_t end = ip + len;
+		for (size_t p = ip + (level == LZ_HIGH ? 2 : 1); p < end && p < match_start_limit; ++p)
+			insert(p);
+		ip = anchor = end;
+	}
+	return lz_write_sequence(op, src, anchor, n, 0, 0) - dst;
+}
+
+// Returns the decompressed size, or -1 if the block is malformed or doesn't fit in dst_capacity.
+inline int64_t
+lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t dst_capacity)
+{
+	size_t ip = 0, op = 0;
+	while (ip < n) {
+		uint8_t token = src[ip++];
+		size_t num_literals = token >> 4;
+		if (num_literals == 15) {
+			uint8_t b;
+			do {
+				if (ip >= n)
+					return -1;
+				b = src[ip++];
+				num_literals += b;
+			} while (b == 255);
+		}
+		if (num_literals > n - ip || num_literals > dst_capacity - op)
+			return -1;
+		__builtin_memcpy(dst + op, src + ip, num_literals);
+		ip += num_literals;
+		op += num_literals;
+		if (ip == n)
+			break;
+		if (n - ip < 2)
+			return -1;
+		size_t offset = src[ip] | (src[ip + 1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return -1;
+		size_t match_len = token & 15;
+		if (match_len == 15) {
+			uint8_t b;
+			do {
+				if (ip >= n)
+					return -1;
+				b = src[ip++];
+				match_len += b;
+			} while (b == 255);
+		}
+		match_len += LZ_MIN_MATCH;
+		if (match_len > dst_capacity - op)
+			return -1;
+		uint8_t *d = dst + op;
+		const uint8_t *s = d - offset;
+		if (offset >= 8) {
+			// Eight bytes at a time. The copy can run up to 7 bytes past the match, so the tail is done bytewise near the end.
+			size_t i = 0;
+			for (; i + 8 <= match_len; i += 8)
+				__builtin_memcpy(d + i, s + i, 8);
+			for (; i < match_len; ++i)
+				d[i] = s[i];
+		} else {
+			for (size_t i = 0; i < match_len; ++i)
+				d[i] = s[i];
+		}
+		op += match_len;
+	}
+	return op;
+}
+
+#endif
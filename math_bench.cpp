@@ -0,0 +1,232 @@
+// Accuracy and speed of the math.h functions. make bench builds this with optimizations on and writes one JSON object per line
+// to math_bench.jsonl, so runs from different builds can be diffed or loaded by a script. A summary goes to stderr.
+// Every function is swept evenly over the domain it's meant for and checked against libm in double precision. Errors are given
+// as the max absolute error, the max error in ULP of the float result, and a histogram of ULP errors in power of two buckets.
+// Speed is TSC ticks per element, the best of several runs over random inputs from the same domain, so branches on the input
+// aren't predicted any better than they would be in real use. Scalar forms are timed one call per element, batched forms as one
+// call over the whole array.
+// The system math.h can't be included next to ours, so libm is reached through the compiler's builtins.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <assert.h>
+#include <x86intrin.h>
+
+#include "math.h"
+
+constexpr size_t NUM_SWEEP_SAMPLES = 1 << 20;
+constexpr size_t NUM_TIMING_SAMPLES = 1 << 14; // Small enough to stay in cache.
+constexpr int NUM_TIMING_RUNS = 16;
+constexpr int NUM_ULP_BUCKETS = 27; // [0, 0.5], (0.5, 1], (1, 2] and so on up to (2^23, 2^24], then everything past it.
+
+enum Sweep {
+	SWEEP_LINEAR,
+	SWEEP_LOG, // For domains spanning orders of magnitude. Both ends must be positive.
+};
+
+struct Domain {
+	const char *name;
+	float lo, hi;
+	Sweep sweep;
+};
+
+struct Error_Stats {
+	double max_abs;
+	double max_ulp;
+	float worst_input; // Where max_ulp was found.
+	uint64_t histogram[NUM_ULP_BUCKETS];
+};
+
+static float *g_sweep_inputs;
+static float *g_timing_inputs;
+static float *g_outputs;
+
+static void
+make_inputs(const Domain &d)
+{
+	for (size_t i = 0; i < NUM_SWEEP_SAMPLES; ++i) {
+		double t = (double)i / (NUM_SWEEP_SAMPLES - 1);
+		if (d.sweep == SWEEP_LOG)
+			g_sweep_inputs[i] = (float)(d.lo * __builtin_exp(t * __builtin_log((double)d.hi / d.lo)));
+		else
+			g_sweep_inputs[i] = (float)(d.lo + t * ((double)d.hi - d.lo));
+	}
+	// Every element still comes from the sweep, just shuffled by a full period LCG over the sweep's indices.
+	uint64_t state = 0x2545F4914F6CDD1Dull;
+	for (size_t i = 0; i < NUM_TIMING_SAMPLES; ++i) {
+		state = state*6364136223846793005ull + 1442695040888963407ull;
+		g_timing_inputs[i] = g_sweep_inputs[(state >> 33) % NUM_SWEEP_SAMPLES];
+	}
+}
+
+template <typename R>
+static Error_Stats
+measure_errors(const float *in, const float *out, size_t n, R reference)
+{
+	Error_Stats s = {};
+	for (size_t i = 0; i < n; ++i) {
+		double expected = reference((double)in[i]);
+		double error = __builtin_fabs(out[i] - expected);
+		double ulp = error / ulp_size(expected);
+		if (__builtin_isnan(out[i]) != __builtin_isnan(expected))
+			ulp = error = __builtin_inf();
+		else if (__builtin_isnan(expected))
+			ulp = error = 0.0;
+		s.max_abs = _max(s.max_abs, error);
+		if (ulp > s.max_ulp || i == 0) {
+			s.max_ulp = ulp;
+			s.worst_input = in[i];
+		}
+		int bucket = 0;
+		for (double limit = 0.5; ulp > limit && bucket < NUM_ULP_BUCKETS - 1; limit *= 2.0)
+			++bucket;
+		++s.histogram[bucket];
+	}
+	return s;
+}
+
+// JSON has no infinities or NaNs.
+static void
+print_json_number(const char *key, double v)
+{
+	if (__builtin_isfinite(v))
+		printf("\"%s\":%.9g", key, v);
+	else
+		printf("\"%s\":null", key);
+}
+
+static void
+report(const char *function, const char *form, const char *level, const char *precision, const Domain &d, const Error_Stats &s,
+       double ticks_per_element)
+{
+	printf("{\"function\":\"%s\",\"form\":\"%s\",\"level\":\"%s\",\"precision\":\"%s\",\"domain\":\"%s\",\"lo\":%.9g,\"hi\":%.9g,"
+	       "\"samples\":%zu,", function, form, level, precision, d.name, d.lo, d.hi, NUM_SWEEP_SAMPLES);
+	print_json_number("max_abs_error", s.max_abs);
+	putchar(',');
+	print_json_number("max_ulp_error", s.max_ulp);
+	putchar(',');
+	print_json_number("worst_input", s.worst_input);
+	printf(",\"ticks_per_element\":%.3f,\"ulp_histogram\":[", ticks_per_element);
+	for (int i = 0; i < NUM_ULP_BUCKETS; ++i)
+		printf(i ? ",%llu" : "%llu", (unsigned long long)s.histogram[i]);
+	printf("]}\n");
+	fprintf(stderr, "%-16s %-8s %-6s %-8s %-14s max abs %-10.3g max ulp %-12.3g %8.2f ticks\n", function, form, level, precision,
+	        d.name, s.max_abs, s.max_ulp, ticks_per_element);
+}
+
+// Best of NUM_TIMING_RUNS, in ticks per element.
+template <typename F>
+static double
+time_ticks(F run)
+{
+	uint64_t best = UINT64_MAX;
+	for (int r = 0; r < NUM_TIMING_RUNS; ++r) {
+		uint64_t start = __rdtsc();
+		run();
+		best = _min<uint64_t>(best, __rdtsc() - start);
+	}
+	return (double)best / NUM_TIMING_SAMPLES;
+}
+
+template <typename F, typename R>
+static void
+bench_scalar(const char *function, const char *precision, const Domain &d, F f, R reference)
+{
+	make_inputs(d);
+	for (size_t i = 0; i < NUM_SWEEP_SAMPLES; ++i)
+		g_outputs[i] = f(g_sweep_inputs[i]);
+	Error_Stats s = measure_errors(g_sweep_inputs, g_outputs, NUM_SWEEP_SAMPLES, reference);
+	double ticks = time_ticks([f]() {
+		for (size_t i = 0; i < NUM_TIMING_SAMPLES; ++i)
+			g_outputs[i] = f(g_timing_inputs[i]);
+	});
+	report(function, "scalar", "scalar", precision, d, s, ticks);
+}
+
+// kernel(in, out, n, precision) at every SIMD level the CPU has.
+template <typename K, typename R>
+static void
+bench_batched(const char *function, Trig_Precision precision, const Domain &d, K kernel, R reference)
+{
+	const char *level_names[] = { "scalar", "sse", "avx" };
+	make_inputs(d);
+	for (int level = SIMD_SCALAR; level <= SIMD_AVX; ++level) {
+		if (math_init((Simd_Level)level) != level)
+			continue;
+		kernel(g_sweep_inputs, g_outputs, NUM_SWEEP_SAMPLES, precision);
+		Error_Stats s = measure_errors(g_sweep_inputs, g_outputs, NUM_SWEEP_SAMPLES, reference);
+		double ticks = time_ticks([kernel, precision]() { kernel(g_timing_inputs, g_outputs, NUM_TIMING_SAMPLES, precision); });
+		report(function, "batched", level_names[level], precision == TRIG_FAST ? "fast" : "precise", d, s, ticks);
+	}
+	math_init();
+}
+
+int
+main()
+{
+	g_sweep_inputs = (float *)malloc(sizeof(float) * NUM_SWEEP_SAMPLES);
+	g_timing_inputs = (float *)malloc(sizeof(float) * NUM_TIMING_SAMPLES);
+	g_outputs = (float *)malloc(sizeof(float) * NUM_SWEEP_SAMPLES);
+
+	printf("{\"bench\":\"math\",\"compiler\":\"%s\",\"simd_level\":%d,\"sweep_samples\":%zu,\"timing_samples\":%zu,"
+	       "\"timing_runs\":%d,\"ulp_bucket_limits\":[", __VERSION__, (int)math_init(), NUM_SWEEP_SAMPLES, NUM_TIMING_SAMPLES,
+	       NUM_TIMING_RUNS);
+	double limit = 0.5;
+	for (int i = 0; i < NUM_ULP_BUCKETS - 1; ++i, limit *= 2.0)
+		printf(i ? ",%.9g" : "%.9g", limit);
+	printf("]}\n");
+
+	auto sin_ref = [](double x) { return __builtin_sin(x); };
+	auto cos_ref = [](double x) { return __builtin_cos(x); };
+	auto tan_ref = [](double x) { return __builtin_tan(x); };
+	Domain small_angles = { "[-pi, pi]", -(float)M_PI, (float)M_PI, SWEEP_LINEAR };
+	Domain big_angles = { "[-1e4, 1e4]", -1e4f, 1e4f, SWEEP_LINEAR };
+	Domain huge_angles = { "[-1e6, 1e6]", -1e6f, 1e6f, SWEEP_LINEAR };
+
+	// _fmod() is x - round(x/y)*y, rounding halves away from zero. Right next to a half way point, float rounding can land it on
+	// the other end of the range, which shows up as errors of y.
+	bench_scalar("_fmod(x, 2pi)", "-", big_angles, [](float x) { return _fmod(x, M_PI_TIMES_2); },
+	             [](double x) { return x - __builtin_round(x / M_PI_TIMES_2) * M_PI_TIMES_2; });
+	bench_scalar("__cos", "-", { "[0, pi/2]", 0.0f, (float)M_PI_2, SWEEP_LINEAR }, __cos, cos_ref);
+	// __tan(x) approximates tan(x*pi/4).
+	bench_scalar("__tan", "-", { "[0, 1]", 0.0f, 1.0f, SWEEP_LINEAR }, __tan, [](double x) { return __builtin_tan(x * M_PI_4); });
+	// _tan() only takes [0, 2pi).
+	bench_scalar("_tan", "-", { "[0, 2pi)", 0.0f, 6.283185f, SWEEP_LINEAR }, _tan, tan_ref);
+	Domain roots = { "[1e-6, 1e6]", 1e-6f, 1e6f, SWEEP_LOG };
+	bench_scalar("inv_sqrt", "-", roots, inv_sqrt, [](double x) { return 1.0 / __builtin_sqrt(x); });
+	bench_scalar("1/_sqrt", "-", roots, [](float x) { return 1.0f / _sqrt(x); }, [](double x) { return 1.0 / __builtin_sqrt(x); });
+	bench_scalar("_sqrt", "-", roots, _sqrt, [](double x) { return __builtin_sqrt(x); });
+	bench_scalar("libm sqrtf", "-", roots, [](float x) { return __builtin_sqrtf(x); }, [](double x) { return __builtin_sqrt(x); });
+
+	Domain old_trig_domains[] = { small_angles, big_angles };
+	for (const Domain &d : old_trig_domains) {
+		bench_scalar("_sin", "-", d, _sin, sin_ref);
+		bench_scalar("_cos", "-", d, _cos, cos_ref);
+	}
+	Domain trig_domains[] = { small_angles, big_angles, huge_angles };
+	for (const Domain &d : trig_domains) {
+		bench_scalar("libm sinf", "-", d, [](float x) { return __builtin_sinf(x); }, sin_ref);
+		bench_scalar("libm cosf", "-", d, [](float x) { return __builtin_cosf(x); }, cos_ref);
+		bench_scalar("libm tanf", "-", d, [](float x) { return __builtin_tanf(x); }, tan_ref);
+		for (int p = TRIG_FAST; p <= TRIG_PRECISE; ++p) {
+			Trig_Precision precision = (Trig_Precision)p;
+			const char *precision_name = precision == TRIG_FAST ? "fast" : "precise";
+			bench_scalar("sincos_scalar sin", precision_name, d, [precision](float x) {
+				float s;
+				sincos_scalar(x, &s, NULL, precision);
+				return s;
+			}, sin_ref);
+			bench_scalar("tan_scalar", precision_name, d, [precision](float x) { return tan_scalar(x, precision); }, tan_ref);
+			bench_batched("sin_array", precision, d, sin_array, sin_ref);
+			bench_batched("cos_array", precision, d, cos_array, cos_ref);
+			bench_batched("tan_array", precision, d, tan_array, tan_ref);
+		}
+	}
+
+	free(g_sweep_inputs);
+	free(g_timing_inputs);
+	free(g_outputs);
+	return 0;
+}
@@ -5,20 +5,151 @@ size_t CHUNK_DATA_PLUS_FOOTER_SIZE = CHUNK_DATA_SIZE + sizeof(Chunk_Footer);
 
 constexpr int round_up(float f);
 
+constexpr size_t MEM_HUGE_PAGE_SIZE = MEGABYTE(2);
+constexpr Memory_Policy MEM_DEFAULT_POLICY = { MEM_BACKING_PAGES, MEM_ANY_NUMA_NODE };
+
+// Backing for chunks made from here on. Blocks go to every arena, so this is for all of them at once; an arena that needs a
+// policy of its own should be a Virtual_Arena. Transparent huge pages by default, since arenas of vertex data and transforms
+// take a TLB miss on every other 4k page otherwise.
+Memory_Policy g_chunk_policy = { MEM_BACKING_HUGE_PAGES, MEM_ANY_NUMA_NODE };
+
+#ifdef MEM_INSTRUMENT
+Block_Stats g_block_stats;
+
+inline void
+count_blocks(uint32_t *counter, int32_t n)
+{
+	__atomic_fetch_add(counter, (uint32_t)n, __ATOMIC_RELAXED);
+}
+#endif
+
 Chunk_Footer *
 mem_make_chunk()
 {
-	void *chunk = platform_get_memory(CHUNK_DATA_PLUS_FOOTER_SIZE);
-	Chunk_Footer *footer = (Chunk_Footer *)((char *)chunk + CHUNK_DATA_SIZE);
-	footer->base = (char *)chunk;
+	// Blocks are aligned to their own size, which slabs rely on, and chunks to huge pages, so none straddle a chunk boundary.
+	assert((BLOCK_DATA_PLUS_FOOTER_SIZE & (BLOCK_DATA_PLUS_FOOTER_SIZE - 1)) == 0);
+	size_t size = (CHUNK_DATA_PLUS_FOOTER_SIZE + MEM_HUGE_PAGE_SIZE - 1) & ~(MEM_HUGE_PAGE_SIZE - 1);
+	char *chunk = platform_reserve_memory(size, _max(BLOCK_DATA_PLUS_FOOTER_SIZE, MEM_HUGE_PAGE_SIZE));
+	platform_commit_memory(chunk, size, g_chunk_policy);
+	Chunk_Footer *footer = (Chunk_Footer *)(chunk + CHUNK_DATA_SIZE);
+	footer->base = chunk;
 	footer->block_frontier = footer->base;
 	footer->next = NULL;
+#ifdef MEM_INSTRUMENT
+	++g_block_stats.num_chunks;
+#endif
 	return footer;
 }
 
 Chunk_Footer *g_mem_chunks = mem_make_chunk();
 Chunk_Footer *g_active_chunk = g_mem_chunks;
-Block_Footer *g_block_free_head = NULL;
+// Arenas belong to one thread at a time, but blocks are shared by all of them. Every thread keeps a few free blocks of its own,
+// which it refills from and spills to a lock-free free list shared by all threads. Only carving new blocks out of the active
+// chunk, or making a new chunk, takes g_chunk_lock.
+Spin_Lock g_chunk_lock;
+
+constexpr uint32_t BLOCK_CACHE_REFILL = 8; // Blocks moved between a thread's cache and the shared free list at a time.
+constexpr uint32_t BLOCK_CACHE_MAX = 2*BLOCK_CACHE_REFILL;
+
+// Treiber stack of free blocks. The upper 16 bits of the head, which user space pointers don't use, count the updates, so a
+// block that gets popped and pushed back between another thread's load and its compare exchange doesn't fool it.
+volatile uint64_t g_block_free_list = 0;
+constexpr uint64_t FREE_LIST_POINTER_MASK = ((uint64_t)1 << 48) - 1;
+constexpr uint64_t FREE_LIST_TAG_ONE = (uint64_t)1 << 48;
+
+struct Block_Cache {
+	Block_Footer *head;
+	uint32_t count;
+};
+
+static __thread Block_Cache t_block_cache;
+
+#ifdef MEM_INSTRUMENT
+constexpr uint32_t MEM_MAX_TRACKED_ARENAS = 1024;
+constexpr uint64_t MEM_TRACE_SIZE = 1 << 16; // Power of two. The oldest records are overwritten.
+
+// Stats slots are handed out from the front, and ones that destroyed arenas gave back are reused first.
+Arena_Stats g_arena_stats[MEM_MAX_TRACKED_ARENAS];
+Arena_Stats g_untracked_arena_stats = { "untracked", 0, 0, 0, 0, 0, 0, false }; // Shared by arenas made while every slot is taken.
+uint32_t g_num_arena_stats_slots;
+uint32_t g_released_arena_stats[MEM_MAX_TRACKED_ARENAS];
+uint32_t g_num_released_arena_stats;
+Spin_Lock g_arena_stats_lock;
+
+struct Call_Site {
+	const char *file;
+	int line;
+};
+
+Allocation_Record g_allocation_trace[MEM_TRACE_SIZE];
+volatile uint64_t g_num_allocation_records;
+static __thread Call_Site t_call_site; // Set by the macros at the bottom of this file, for the next push or free.
+
+static Arena_Stats *
+track_arena(const char *name)
+{
+	spin_lock(&g_arena_stats_lock);
+	Arena_Stats *s = &g_untracked_arena_stats;
+	if (g_num_released_arena_stats > 0)
+		s = &g_arena_stats[g_released_arena_stats[--g_num_released_arena_stats]];
+	else if (g_num_arena_stats_slots < MEM_MAX_TRACKED_ARENAS)
+		s = &g_arena_stats[g_num_arena_stats_slots++];
+	if (s != &g_untracked_arena_stats) {
+		*s = {};
+		s->name = name;
+		s->in_use = true;
+	}
+	spin_unlock(&g_arena_stats_lock);
+	return s;
+}
+
+static void
+untrack_arena(Arena_Stats *s)
+{
+	if (s == &g_untracked_arena_stats)
+		return;
+	spin_lock(&g_arena_stats_lock);
+	s->in_use = false;
+	g_released_arena_stats[g_num_released_arena_stats++] = (uint32_t)(s - g_arena_stats);
+	spin_unlock(&g_arena_stats_lock);
+}
+
+inline void
+count_push(Arena_Stats *s, size_t live, size_t wasted)
+{
+	s->live_bytes += live;
+	s->wasted_bytes += wasted;
+	s->peak_bytes = _max(s->peak_bytes, s->live_bytes);
+	++s->num_pushes;
+}
+
+static void
+trace_allocation(const Arena_Stats *s, Allocation_Op op, size_t size, void *p)
+{
+	uint64_t i = __atomic_fetch_add(&g_num_allocation_records, 1, __ATOMIC_RELAXED);
+	g_allocation_trace[i & (MEM_TRACE_SIZE - 1)] = { s->name, t_call_site.file, t_call_site.line, op, size, p };
+	t_call_site = {};
+}
+
+// Taking the arena picks out the ones that are traced, so a site set for a push that isn't recorded can't be pinned on the next
+// one that is.
+inline void
+mem_set_call_site(const Memory_Arena *, const char *file, int line)
+{
+	t_call_site = { file, line };
+}
+
+inline void
+mem_set_call_site(const Scratch_Arena *, const char *file, int line)
+{
+	t_call_site = { file, line };
+}
+
+inline void
+mem_set_call_site(const Virtual_Arena *, const char *, int)
+{
+}
+#endif
 
 inline char *
 get_block_start(Block_Footer *f)
@@ -32,21 +163,87 @@ get_block_footer(char *start)
 	return (Block_Footer *)((char *)start + BLOCK_DATA_SIZE);
 }
 
-Block_Footer *
-mem_make_block()
+// Pushes the blocks first through last, already linked through next.
+static void
+free_list_push(Block_Footer *first, Block_Footer *last)
 {
-	Block_Footer *blk;
-	if (g_block_free_head) {
-		blk = g_block_free_head;
-		g_block_free_head = g_block_free_head->next;
-	} else {
+#ifdef MEM_INSTRUMENT
+	for (Block_Footer *f = first; f != last; f = f->next)
+		count_blocks(&g_block_stats.num_free_list_blocks, 1);
+	count_blocks(&g_block_stats.num_free_list_blocks, 1);
+#endif
+	uint64_t head = __atomic_load_n(&g_block_free_list, __ATOMIC_RELAXED);
+	uint64_t new_head;
+	do {
+		__atomic_store_n(&last->next, (Block_Footer *)(head & FREE_LIST_POINTER_MASK), __ATOMIC_RELAXED);
+		new_head = (uint64_t)first | ((head & ~FREE_LIST_POINTER_MASK) + FREE_LIST_TAG_ONE);
+	} while (!__atomic_compare_exchange_n(&g_block_free_list, &head, new_head, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static Block_Footer *
+free_list_pop()
+{
+	uint64_t head = __atomic_load_n(&g_block_free_list, __ATOMIC_ACQUIRE);
+	for (;;) {
+		Block_Footer *blk = (Block_Footer *)(head & FREE_LIST_POINTER_MASK);
+		if (!blk)
+			return NULL;
+		// If another thread pops blk first, next may be garbage by the time we read it, but then the tag has moved on and the
+		// exchange fails. Chunks are never unmapped, so the read itself is always safe.
+		uint64_t new_head = (uint64_t)__atomic_load_n(&blk->next, __ATOMIC_RELAXED) | ((head & ~FREE_LIST_POINTER_MASK) + FREE_LIST_TAG_ONE);
+		if (__atomic_compare_exchange_n(&g_block_free_list, &head, new_head, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+#ifdef MEM_INSTRUMENT
+			count_blocks(&g_block_stats.num_free_list_blocks, -1);
+#endif
+			return blk;
+		}
+	}
+}
+
+// Carves blocks off the active chunk into the thread's cache, making a new chunk when it runs out.
+static void
+carve_blocks(Block_Cache *c, uint32_t count)
+{
+	spin_lock(&g_chunk_lock);
+	for (uint32_t i = 0; i < count; ++i) {
 		if (((g_active_chunk->block_frontier + BLOCK_DATA_PLUS_FOOTER_SIZE) - g_active_chunk->base) > CHUNK_DATA_SIZE) {
 			g_active_chunk->next = mem_make_chunk();
 			g_active_chunk = g_active_chunk->next;
 		}
-		blk = get_block_footer(g_active_chunk->block_frontier);
-		g_active_chunk->block_frontier += (BLOCK_DATA_PLUS_FOOTER_SIZE);
+		Block_Footer *blk = get_block_footer(g_active_chunk->block_frontier);
+		g_active_chunk->block_frontier += BLOCK_DATA_PLUS_FOOTER_SIZE;
+		blk->next = c->head;
+		c->head = blk;
+		++c->count;
+	}
+#ifdef MEM_INSTRUMENT
+	g_block_stats.num_blocks_carved += count;
+	count_blocks(&g_block_stats.num_cached_blocks, count);
+#endif
+	spin_unlock(&g_chunk_lock);
+}
+
+Block_Footer *
+mem_make_block()
+{
+	Block_Cache *c = &t_block_cache;
+	if (!c->head) {
+		for (Block_Footer *blk; c->count < BLOCK_CACHE_REFILL && (blk = free_list_pop()); ++c->count) {
+			blk->next = c->head;
+			c->head = blk;
+#ifdef MEM_INSTRUMENT
+			count_blocks(&g_block_stats.num_cached_blocks, 1);
+#endif
+		}
+		if (!c->head)
+			carve_blocks(c, BLOCK_CACHE_REFILL);
 	}
+	Block_Footer *blk = c->head;
+	c->head = blk->next;
+	--c->count;
+#ifdef MEM_INSTRUMENT
+	count_blocks(&g_block_stats.num_cached_blocks, -1);
+#endif
 	blk->capacity = BLOCK_DATA_SIZE;
 	blk->nbytes_used = 0;
 	blk->next = NULL;
@@ -59,29 +256,88 @@ mem_make_arena()
 {
 	Memory_Arena m;
 	m.entry_free_head = NULL;
+	m.first_entry = NULL;
 	m.last_entry = NULL;
 	m.base = mem_make_block();
 	m.active_block = m.base;
+#ifdef MEM_INSTRUMENT
+	m.stats = track_arena("unnamed");
+	m.stats->num_blocks = 1;
+#endif
 	return m;
 }
 
-void
+// Back into the thread's cache. When that's full, all but the newest BLOCK_CACHE_REFILL blocks go to the shared free list.
+static void
 free_block(Block_Footer *f)
 {
-	f->next = g_block_free_head;
-	g_block_free_head = f;
+	Block_Cache *c = &t_block_cache;
+	f->next = c->head;
+	c->head = f;
+#ifdef MEM_INSTRUMENT
+	count_blocks(&g_block_stats.num_cached_blocks, 1);
+	if (c->count + 1 > BLOCK_CACHE_MAX)
+		count_blocks(&g_block_stats.num_cached_blocks, -(int32_t)(c->count + 1 - BLOCK_CACHE_REFILL));
+#endif
+	if (++c->count <= BLOCK_CACHE_MAX)
+		return;
+	Block_Footer *keep_last = c->head;
+	for (uint32_t i = 1; i < BLOCK_CACHE_REFILL; ++i)
+		keep_last = keep_last->next;
+	Block_Footer *first = keep_last->next, *last = first;
+	while (last->next)
+		last = last->next;
+	keep_last->next = NULL;
+	free_list_push(first, last);
+	c->count = BLOCK_CACHE_REFILL;
 }
 
-void
-mem_destroy_arena(const Memory_Arena *ma)
+// Frees a chain of blocks linked through next.
+static void
+free_blocks(Block_Footer *first)
 {
-	for (Block_Footer *f = ma->base, *next = NULL; f; f = next) {
+	for (Block_Footer *f = first, *next = NULL; f; f = next) {
 		next = f->next;
-		free_block(f);
+		if (f->capacity == BLOCK_DATA_SIZE) {
+			free_block(f);
+			continue;
+		}
+		// A group from mem_push_contiguous, which goes back as the blocks it was made of.
+		char *start = get_block_start(f);
+		size_t nblocks = (f->capacity + sizeof(Block_Footer)) / BLOCK_DATA_PLUS_FOOTER_SIZE;
+		for (size_t i = 0; i < nblocks; ++i)
+			free_block(get_block_footer(start + i*BLOCK_DATA_PLUS_FOOTER_SIZE));
 	}
+}
+
+void
+mem_destroy_arena(const Memory_Arena *ma)
+{
+#ifdef MEM_INSTRUMENT
+	untrack_arena(ma->stats);
+#endif
+	free_blocks(ma->base);
 	//ma->base = ma->active_block = NULL;
 }
 
+// Hands the calling thread's cached blocks back to the shared free list. Call before a thread that used arenas exits.
+void
+mem_flush_thread_cache()
+{
+	Block_Cache *c = &t_block_cache;
+	if (!c->head)
+		return;
+	Block_Footer *last = c->head;
+	while (last->next)
+		last = last->next;
+	free_list_push(c->head, last);
+#ifdef MEM_INSTRUMENT
+	count_blocks(&g_block_stats.num_cached_blocks, -(int32_t)c->count);
+#endif
+	c->head = NULL;
+	c->count = 0;
+}
+
 // Complicated, becuase we might have to swap bytes across blocks or chunks that are not adjacent.
 // Some edge cases: start and end the same
 //                  start pointer and end pointer both change blocks as the reverse ends
@@ -137,10 +393,7 @@ get_entry_header(void *p)
 void *
 mem_start(Memory_Arena *ma)
 {
-	// TODO: It's actually not. Need to make it so that we don't get a block on startup incase the first allocation is bigger than one block.
-	if (ma->last_entry) // Do we have any entries? If we do, it's guarenteed that the first one is right at the start of the base block.
-		return get_entry_data((Entry_Header *)get_block_start(ma->base));
-	return NULL;
+	return ma->first_entry;
 }
 
 void *
@@ -158,6 +411,10 @@ mem_has_elems(Memory_Arena *ma)
 void
 mem_arena_add_block(Memory_Arena *ma)
 {
+#ifdef MEM_INSTRUMENT
+	ma->stats->wasted_bytes += ma->active_block->capacity - ma->active_block->nbytes_used;
+	++ma->stats->num_blocks;
+#endif
 	Block_Footer *new_blk = mem_make_block();
 	new_blk->prev = ma->active_block;
 	ma->active_block->next = new_blk;
@@ -167,53 +424,117 @@ mem_arena_add_block(Memory_Arena *ma)
 #define mem_alloc(type, arena) (type *)mem_push(sizeof(type), arena)
 #define mem_alloc_array(type, count, arena) (type *)mem_push_contiguous(sizeof(type)*count, arena)
 
+// A run of adjacent blocks with one footer at the end, for allocations that don't fit in a block.
 // TODO: combine the block group logic here with mem_make_block and just call that.
-void *
-mem_push_contiguous(size_t size, Memory_Arena *ma)
+static Block_Footer *
+make_block_group(size_t size)
 {
 	assert(size <= CHUNK_DATA_SIZE);
 	size_t nblocks_needed = round_up((float)(size + sizeof(Block_Footer)) / BLOCK_DATA_PLUS_FOOTER_SIZE);
 
 	// We could try to find our needed blocks among the free blocks, but for now we just take what we need from the block frontier of the chunk.
+	spin_lock(&g_chunk_lock);
 	// Is there enough space in our current chunk for the contiguous memory requested?
 	if (g_active_chunk->block_frontier + (BLOCK_DATA_PLUS_FOOTER_SIZE*nblocks_needed) - g_active_chunk->base > CHUNK_DATA_SIZE) {
 		// Add all of the unused blocks in the current chunk to the free list.
-		while (g_active_chunk->block_frontier + BLOCK_DATA_PLUS_FOOTER_SIZE - g_active_chunk->base > CHUNK_DATA_SIZE) {
-			free_block(get_block_footer(g_active_chunk->block_frontier));
+		while (g_active_chunk->block_frontier + BLOCK_DATA_PLUS_FOOTER_SIZE - g_active_chunk->base <= CHUNK_DATA_SIZE) {
+			Block_Footer *f = get_block_footer(g_active_chunk->block_frontier);
+			free_list_push(f, f);
 			g_active_chunk->block_frontier += BLOCK_DATA_PLUS_FOOTER_SIZE;
+#ifdef MEM_INSTRUMENT
+			++g_block_stats.num_blocks_carved; // Counted as free by free_list_push(), so it has to count as carved too.
+#endif
 		}
 		g_active_chunk->next = mem_make_chunk();
 		g_active_chunk = g_active_chunk->next;
 	}
 	// Move us forward to the last block, where we will keep the footer for the enitre block group.
 	Block_Footer *blk = get_block_footer(g_active_chunk->block_frontier + ((nblocks_needed - 1) * BLOCK_DATA_PLUS_FOOTER_SIZE));
+	g_active_chunk->block_frontier += BLOCK_DATA_PLUS_FOOTER_SIZE*nblocks_needed;
+#ifdef MEM_INSTRUMENT
+	g_block_stats.num_blocks_carved += nblocks_needed;
+#endif
+	spin_unlock(&g_chunk_lock);
 	blk->capacity = nblocks_needed*BLOCK_DATA_PLUS_FOOTER_SIZE - sizeof(Block_Footer);
+	blk->nbytes_used = 0;
+	blk->prev = NULL;
+	blk->next = NULL;
+	return blk;
+}
+
+void *
+mem_push_contiguous(size_t size, Memory_Arena *ma)
+{
+	Block_Footer *blk = make_block_group(size);
+#ifdef MEM_INSTRUMENT
+	ma->stats->wasted_bytes += ma->active_block->capacity - ma->active_block->nbytes_used;
+	ma->stats->num_blocks += (blk->capacity + sizeof(Block_Footer)) / BLOCK_DATA_PLUS_FOOTER_SIZE;
+	count_push(ma->stats, size, 0);
+	trace_allocation(ma->stats, MEM_OP_PUSH_CONTIGUOUS, size, get_block_start(blk));
+#endif
 	blk->nbytes_used = size;
 	blk->prev = ma->active_block;
-	blk->next = NULL;
 	ma->active_block->next = blk;
 	ma->active_block = blk;
-	g_active_chunk->block_frontier += BLOCK_DATA_PLUS_FOOTER_SIZE*nblocks_needed;
 	return get_block_start(blk);
 }
 
-// TODO: Keep track of the largest free entry available to speed up allocation?
+// Appends an entry to the arena's list, which mem_start() and mem_next() walk.
+static char *
+link_entry(Memory_Arena *ma, Entry_Header *h)
+{
+	char *entry = get_entry_data(h);
+	h->next = NULL;
+	h->prev = ma->last_entry;
+	if (ma->last_entry)
+		get_entry_header(ma->last_entry)->next = entry;
+	else
+		ma->first_entry = entry;
+	ma->last_entry = entry;
+	return entry;
+}
+
+// Smallest payload worth splitting off a reused free entry.
+constexpr size_t MIN_SPLIT_PAYLOAD = 64;
+
+// Freed entries are reused first fit. What's left of a reused entry goes back on the free list as an entry of its own, if it's
+// big enough to be worth a header. Otherwise the entry keeps its size, and can take anything up to that size again.
+// Objects that churn a lot are better off in a Slab_Allocator.
+// TODO: Merge adjacent free entries.
 void *
 mem_push(size_t size, Memory_Arena *ma)
 {
 	size_t size_with_header = size + sizeof(Entry_Header);
 	assert(size_with_header <= BLOCK_DATA_SIZE);
-	/*
-	for (Free_Entry *f = ma->entry_free_head, *prev = NULL; f; prev = f, f = f->next) {
-		// TODO: Re-add the remaining free entry space to the free entry list.
+	for (Free_Entry **link = &ma->entry_free_head; *link; link = &(*link)->next) {
+		Free_Entry *f = *link;
 		if (size <= f->size) {
-			// THIS IS BUSTED.
-			if (prev)
-				prev->next = f->next;
-			return (char *)f + sizeof(Entry_Header);
+			*link = f->next;
+			// Entries are packed without padding, so the split is lined up by address for the new header.
+			char *data = get_entry_data((Entry_Header *)f);
+			size_t split = (((uintptr_t)data + size + alignof(Entry_Header) - 1) & ~(alignof(Entry_Header) - 1)) - (uintptr_t)data;
+#ifdef MEM_INSTRUMENT
+			ma->stats->free_bytes -= f->size;
+#endif
+			if (f->size >= split + sizeof(Entry_Header) + MIN_SPLIT_PAYLOAD) {
+				Free_Entry *rest = (Free_Entry *)(data + split);
+				rest->size = f->size - split - sizeof(Entry_Header);
+				rest->next = f->next;
+				*link = rest;
+				f->size = split;
+#ifdef MEM_INSTRUMENT
+				ma->stats->free_bytes += rest->size;
+				ma->stats->wasted_bytes += sizeof(Entry_Header);
+#endif
+			}
+#ifdef MEM_INSTRUMENT
+			count_push(ma->stats, f->size, 0);
+			trace_allocation(ma->stats, MEM_OP_PUSH, size, data);
+#endif
+			return link_entry(ma, (Entry_Header *)f);
 		}
 	}
-	*/
+
 	Entry_Header *new_entry_header;
 	if (size_with_header <= (ma->active_block->capacity - ma->active_block->nbytes_used))
 		new_entry_header = (Entry_Header *)(get_block_start(ma->active_block) + ma->active_block->nbytes_used);
@@ -221,30 +542,513 @@ mem_push(size_t size, Memory_Arena *ma)
 		mem_arena_add_block(ma);
 		new_entry_header = (Entry_Header *)get_block_start(ma->active_block);
 	}
-
-	char *new_entry = get_entry_data(new_entry_header);
 	new_entry_header->size = size;
-	new_entry_header->next = NULL;
-	new_entry_header->prev = ma->last_entry;
-	if (ma->last_entry) {
-		Entry_Header *last_entry_header = get_entry_header(ma->last_entry);
-		last_entry_header->next = new_entry;
-	}
-
-	ma->last_entry = new_entry;
+#ifdef MEM_INSTRUMENT
+	count_push(ma->stats, size, sizeof(Entry_Header));
+	trace_allocation(ma->stats, MEM_OP_PUSH, size, get_entry_data(new_entry_header));
+#endif
 	ma->active_block->nbytes_used += size_with_header;
 	// If we fill up the block exactly, we get a new one right away.
 	if (ma->active_block->nbytes_used == ma->active_block->capacity)
 		mem_arena_add_block(ma);
-	return new_entry;
+	return link_entry(ma, new_entry_header);
 }
 
+// Takes the entry out of the arena's list, so iteration skips it, and puts it on the free list for mem_push() to reuse.
 void
 mem_free(Memory_Arena *ma, void *p)
 {
-	assert(p >= g_active_chunk->base + sizeof(Entry_Header) && p < g_active_chunk);
-	// TODO: Merge adjacent free entries.
-	Free_Entry *f = (Free_Entry *)get_entry_header(p);
+	assert(p);
+	Entry_Header *h = get_entry_header(p);
+#ifdef MEM_INSTRUMENT
+	ma->stats->live_bytes -= h->size;
+	ma->stats->free_bytes += h->size;
+	trace_allocation(ma->stats, MEM_OP_FREE, h->size, p);
+#endif
+	if (h->prev)
+		get_entry_header(h->prev)->next = h->next;
+	else
+		ma->first_entry = h->next;
+	if (h->next)
+		get_entry_header(h->next)->prev = h->prev;
+	else
+		ma->last_entry = h->prev;
+	Free_Entry *f = (Free_Entry *)h; // Same layout up to next, so size carries over.
 	f->next = ma->entry_free_head;
 	ma->entry_free_head = f;
 }
+
+//
+// Scratch arenas.
+//
+
+constexpr uintptr_t SCRATCH_ALIGNMENT = 64; // A cache line, and what asset payload arrays are aligned to, so entries can be used in place.
+
+inline Scratch_Arena
+mem_make_scratch()
+{
+	Scratch_Arena s;
+	s.base = mem_make_block();
+	s.active_block = s.base;
+	s.cursor = get_block_start(s.base);
+#ifdef MEM_INSTRUMENT
+	s.stats = track_arena("unnamed scratch");
+	s.stats->num_blocks = 1;
+#endif
+	return s;
+}
+
+void
+mem_destroy_scratch(const Scratch_Arena *s)
+{
+#ifdef MEM_INSTRUMENT
+	untrack_arena(s->stats);
+#endif
+	free_blocks(s->base);
+}
+
+// Moves on to a block with room for size bytes, reusing the ones a rewind left behind where they're big enough.
+static void
+scratch_next_block(Scratch_Arena *s, size_t size)
+{
+#ifdef MEM_INSTRUMENT
+	s->stats->wasted_bytes += (char *)s->active_block - s->cursor;
+#endif
+	Block_Footer *next = s->active_block->next;
+	if (!next || next->capacity < size) {
+		Block_Footer *blk = (size <= BLOCK_DATA_SIZE) ? mem_make_block() : make_block_group(size);
+		blk->prev = s->active_block;
+		blk->next = next;
+		if (next)
+			next->prev = blk;
+		s->active_block->next = blk;
+		next = blk;
+	}
+#ifdef MEM_INSTRUMENT
+	s->stats->num_blocks += (next->capacity + sizeof(Block_Footer)) / BLOCK_DATA_PLUS_FOOTER_SIZE;
+#endif
+	s->active_block = next;
+	s->cursor = get_block_start(next);
+}
+
+// mem_alloc() and mem_alloc_array() work the same on scratch arenas.
+inline void *
+mem_push(size_t size, Scratch_Arena *s)
+{
+	char *p = (char *)(((uintptr_t)s->cursor + SCRATCH_ALIGNMENT - 1) & ~(SCRATCH_ALIGNMENT - 1));
+	if (p + size > (char *)s->active_block) { // The block's data ends where its footer starts.
+		scratch_next_block(s, size);
+		p = s->cursor;
+	}
+#ifdef MEM_INSTRUMENT
+	count_push(s->stats, size, p - s->cursor);
+	trace_allocation(s->stats, MEM_OP_PUSH, size, p);
+#endif
+	s->cursor = p + size;
+	return p;
+}
+
+inline void *
+mem_push_contiguous(size_t size, Scratch_Arena *s)
+{
+	return mem_push(size, s);
+}
+
+inline Scratch_Mark
+mem_mark(const Scratch_Arena *s)
+{
+#ifdef MEM_INSTRUMENT
+	return { s->active_block, s->cursor, s->stats->live_bytes, s->stats->wasted_bytes, s->stats->num_blocks };
+#else
+	return { s->active_block, s->cursor };
+#endif
+}
+
+// Frees everything pushed since the mark was taken.
+inline void
+mem_rewind(Scratch_Arena *s, Scratch_Mark m)
+{
+	s->active_block = m.block;
+	s->cursor = m.cursor;
+#ifdef MEM_INSTRUMENT
+	s->stats->live_bytes = m.live_bytes;
+	s->stats->wasted_bytes = m.wasted_bytes;
+	s->stats->num_blocks = m.num_blocks;
+#endif
+}
+
+inline void
+mem_reset_scratch(Scratch_Arena *s)
+{
+	Scratch_Mark start = {};
+	start.block = s->base;
+	start.cursor = get_block_start(s->base);
+#ifdef MEM_INSTRUMENT
+	start.num_blocks = 1;
+#endif
+	mem_rewind(s, start);
+}
+
+// Transient memory for the frame being built. Frames alternate between two arenas and each is reset as its frame starts, so
+// anything pushed stays valid through the following frame too. Main thread only.
+Scratch_Arena g_frame_arenas[2] = { mem_make_scratch(), mem_make_scratch() };
+uint32_t g_frame_index = 0;
+
+inline Scratch_Arena *
+mem_frame_arena()
+{
+	return &g_frame_arenas[g_frame_index & 1];
+}
+
+inline void
+mem_end_frame()
+{
+	++g_frame_index;
+	mem_reset_scratch(mem_frame_arena());
+}
+
+//
+// Virtual arenas.
+//
+
+constexpr size_t VIRTUAL_ARENA_RESERVE = GIGABYTE(64);
+constexpr size_t VIRTUAL_ARENA_COMMIT_SIZE = KILOBYTE(64); // Committed at a time, so small pushes don't make a syscall each.
+constexpr uintptr_t VIRTUAL_ARENA_ALIGNMENT = 16;
+
+// Huge page backed arenas commit a huge page at a time, since that's the granularity they're backed at anyway.
+inline size_t
+get_commit_size(const Virtual_Arena *va)
+{
+	return (va->policy.backing == MEM_BACKING_PAGES) ? VIRTUAL_ARENA_COMMIT_SIZE : MEM_HUGE_PAGE_SIZE;
+}
+
+inline Virtual_Arena
+mem_make_virtual_arena(size_t reserve = VIRTUAL_ARENA_RESERVE, Memory_Policy policy = MEM_DEFAULT_POLICY)
+{
+	reserve = (reserve + MEM_HUGE_PAGE_SIZE - 1) & ~(MEM_HUGE_PAGE_SIZE - 1);
+	Virtual_Arena va;
+	va.base = platform_reserve_memory(reserve, MEM_HUGE_PAGE_SIZE);
+	va.cursor = va.base;
+	va.committed_end = va.base;
+	va.reserved_end = va.base + reserve;
+	va.policy = policy;
+	return va;
+}
+
+// For an arena only the calling thread uses, backed on the thread's own NUMA node. Pin the thread first, or the scheduler can
+// move it to another node.
+inline Memory_Policy
+mem_thread_local_policy(Memory_Backing backing)
+{
+	return { backing, (int)platform_get_numa_node() };
+}
+
+void
+mem_destroy_virtual_arena(Virtual_Arena *va)
+{
+	platform_free_memory(va->base, va->reserved_end - va->base);
+	*va = {};
+}
+
+// Makes sure the first size bytes are committed. Arrays and the like use the arena's memory directly and grow with this.
+void
+mem_commit_virtual(Virtual_Arena *va, size_t size)
+{
+	if (size <= (size_t)(va->committed_end - va->base))
+		return;
+	assert(size <= (size_t)(va->reserved_end - va->base));
+	size_t commit_size = get_commit_size(va);
+	char *end = va->base + ((size + commit_size - 1) & ~(commit_size - 1));
+	platform_commit_memory(va->committed_end, end - va->committed_end, va->policy);
+	va->committed_end = end;
+}
+
+inline void *
+mem_push(size_t size, Virtual_Arena *va)
+{
+	char *p = (char *)(((uintptr_t)va->cursor + VIRTUAL_ARENA_ALIGNMENT - 1) & ~(VIRTUAL_ARENA_ALIGNMENT - 1));
+	mem_commit_virtual(va, (p + size) - va->base);
+	va->cursor = p + size;
+	return p;
+}
+
+// No limit on size, unlike mem_push_contiguous() on a Memory_Arena.
+inline void *
+mem_push_contiguous(size_t size, Virtual_Arena *va)
+{
+	return mem_push(size, va);
+}
+
+// Frees everything and gives the committed pages back. Rewinding the cursor by hand keeps them instead.
+void
+mem_reset_virtual_arena(Virtual_Arena *va)
+{
+	if (va->committed_end > va->base)
+		platform_decommit_memory(va->base, va->committed_end - va->base, va->policy);
+	va->cursor = va->committed_end = va->base;
+}
+
+//
+// Slab allocator.
+//
+
+constexpr size_t SLAB_CLASS_SIZES[NUM_SLAB_CLASSES] = {
+	16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096, 6144, 8192,
+};
+constexpr size_t SLAB_HEADER_SIZE = 64; // Keeps the first object on a cache line of its own.
+constexpr size_t SLAB_MAX_ALIGNMENT = 64;
+constexpr uint32_t SLAB_LARGE = NUM_SLAB_CLASSES;
+
+static_assert(sizeof(Slab) <= SLAB_HEADER_SIZE, "slab header doesn't fit in front of the first object");
+
+// Objects start on a 64 byte boundary and are packed back to back, so every object in a class is aligned to the largest power
+// of two, up to 64, that divides the class size. That's at least 16 for every class.
+inline size_t
+slab_class_alignment(int c)
+{
+	return _min(SLAB_CLASS_SIZES[c] & -SLAB_CLASS_SIZES[c], SLAB_MAX_ALIGNMENT);
+}
+
+// Classes go 16, 32, then a power of two and one and a half times it, so the class falls out of the top bit of size - 1.
+inline int
+slab_class_index(size_t size)
+{
+	if (size <= 32)
+		return size <= 16 ? 0 : 1;
+	int k = 63 - __builtin_clzll(size - 1); // 2^k < size <= 2^(k + 1)
+	return 2*(k - 5) + (size <= ((size_t)3 << (k - 1)) ? 2 : 3);
+}
+
+inline Slab *
+get_slab(void *p)
+{
+	return (Slab *)((uintptr_t)p & ~(BLOCK_DATA_PLUS_FOOTER_SIZE - 1));
+}
+
+inline void
+slab_link(Slab **list, Slab *s)
+{
+	s->prev = NULL;
+	s->next = *list;
+	if (*list)
+		(*list)->prev = s;
+	*list = s;
+}
+
+inline void
+slab_unlink(Slab **list, Slab *s)
+{
+	if (s->prev)
+		s->prev->next = s->next;
+	else
+		*list = s->next;
+	if (s->next)
+		s->next->prev = s->prev;
+}
+
+inline Slab_Allocator
+mem_make_slab_allocator()
+{
+	Slab_Allocator sa = {};
+	return sa;
+}
+
+static Slab *
+make_slab(Slab_Allocator *sa, Block_Footer *blk, uint32_t size_class)
+{
+	Slab *s = (Slab *)get_block_start(blk);
+	assert(get_slab(s) == s);
+	s->owner = sa;
+	s->block = blk;
+	s->next = s->prev = NULL;
+	s->free_list = NULL;
+	s->frontier = (char *)s + SLAB_HEADER_SIZE;
+	s->num_used = 0;
+	s->capacity = (size_class == SLAB_LARGE) ? 1 : (uint32_t)((BLOCK_DATA_SIZE - SLAB_HEADER_SIZE) / SLAB_CLASS_SIZES[size_class]);
+	s->size_class = size_class;
+	return s;
+}
+
+static void *
+slab_alloc_large(Slab_Allocator *sa, size_t size)
+{
+	size_t size_with_header = size + SLAB_HEADER_SIZE;
+	Slab *s = make_slab(sa, (size_with_header <= BLOCK_DATA_SIZE) ? mem_make_block() : make_block_group(size_with_header), SLAB_LARGE);
+	s->num_used = 1;
+	slab_link(&sa->large, s);
+	++sa->num_large;
+	sa->large_bytes += s->block->capacity;
+	return s->frontier;
+}
+
+// alignment is a power of two no bigger than 64. Anything over 16 may bump the object up a size class or two.
+void *
+mem_slab_alloc(Slab_Allocator *sa, size_t size, size_t alignment = 16)
+{
+	assert(alignment <= SLAB_MAX_ALIGNMENT && (alignment & (alignment - 1)) == 0);
+	if (size > SLAB_CLASS_SIZES[NUM_SLAB_CLASSES - 1])
+		return slab_alloc_large(sa, size);
+	int c = slab_class_index(size);
+	while (slab_class_alignment(c) < alignment)
+		++c;
+	Slab_Class *sc = &sa->classes[c];
+	Slab *s = sc->partial;
+	if (!s) {
+		if (sc->empty) {
+			s = sc->empty;
+			sc->empty = NULL;
+		} else {
+			s = make_slab(sa, mem_make_block(), c);
+			++sc->num_slabs;
+		}
+		slab_link(&sc->partial, s);
+	}
+	char *p = s->free_list;
+	if (p)
+		s->free_list = *(char **)p;
+	else {
+		p = s->frontier;
+		s->frontier += SLAB_CLASS_SIZES[c];
+	}
+	if (++s->num_used == s->capacity) {
+		slab_unlink(&sc->partial, s);
+		slab_link(&sc->full, s);
+	}
+	++sc->num_used;
+	return p;
+}
+
+#define mem_slab_new(type, sa) (type *)mem_slab_alloc(sa, sizeof(type), alignof(type))
+
+void
+mem_slab_free(Slab_Allocator *sa, void *p)
+{
+	if (!p)
+		return;
+	Slab *s = get_slab(p);
+	assert(s->owner == sa);
+	if (s->size_class == SLAB_LARGE) {
+		slab_unlink(&sa->large, s);
+		--sa->num_large;
+		sa->large_bytes -= s->block->capacity;
+		free_blocks(s->block);
+		return;
+	}
+	Slab_Class *sc = &sa->classes[s->size_class];
+	*(char **)p = s->free_list;
+	s->free_list = (char *)p;
+	--sc->num_used;
+	if (s->num_used-- == s->capacity) {
+		slab_unlink(&sc->full, s);
+		slab_link(&sc->partial, s);
+	}
+	if (s->num_used > 0)
+		return;
+	slab_unlink(&sc->partial, s);
+	if (!sc->empty) {
+		s->next = s->prev = NULL;
+		sc->empty = s;
+	} else {
+		free_block(s->block);
+		--sc->num_slabs;
+	}
+}
+
+void
+mem_destroy_slab_allocator(Slab_Allocator *sa)
+{
+	auto free_slabs = [](Slab *s) {
+		for (Slab *next; s; s = next) {
+			next = s->next;
+			free_blocks(s->block);
+		}
+	};
+	for (int c = 0; c < NUM_SLAB_CLASSES; ++c) {
+		free_slabs(sa->classes[c].partial);
+		free_slabs(sa->classes[c].full);
+		free_slabs(sa->classes[c].empty);
+	}
+	free_slabs(sa->large);
+	*sa = mem_make_slab_allocator();
+}
+
+// Occupancy of every size class, for finding classes that hold on to far more slabs than they use.
+void
+mem_slab_stats(const Slab_Allocator *sa, Slab_Stats out[NUM_SLAB_CLASSES])
+{
+	for (int c = 0; c < NUM_SLAB_CLASSES; ++c) {
+		const Slab_Class *sc = &sa->classes[c];
+		out[c].object_size = SLAB_CLASS_SIZES[c];
+		out[c].num_slabs = sc->num_slabs;
+		out[c].num_used = sc->num_used;
+		out[c].capacity = sc->num_slabs * ((BLOCK_DATA_SIZE - SLAB_HEADER_SIZE) / SLAB_CLASS_SIZES[c]);
+	}
+}
+
+#ifdef MEM_INSTRUMENT
+//
+// Instrumentation.
+//
+
+inline void
+mem_name_arena(Memory_Arena *ma, const char *name)
+{
+	if (ma->stats != &g_untracked_arena_stats)
+		ma->stats->name = name;
+}
+
+inline void
+mem_name_arena(Scratch_Arena *s, const char *name)
+{
+	if (s->stats != &g_untracked_arena_stats)
+		s->stats->name = name;
+}
+
+// Copies the stats of every live arena. They're read while their owners keep using them, so they're only roughly consistent.
+uint32_t
+mem_get_arena_stats(Arena_Stats *out, uint32_t max)
+{
+	uint32_t n = 0;
+	spin_lock(&g_arena_stats_lock);
+	for (uint32_t i = 0; i < g_num_arena_stats_slots && n < max; ++i) {
+		if (g_arena_stats[i].in_use)
+			out[n++] = g_arena_stats[i];
+	}
+	spin_unlock(&g_arena_stats_lock);
+	if (g_untracked_arena_stats.num_pushes > 0 && n < max)
+		out[n++] = g_untracked_arena_stats;
+	return n;
+}
+
+Block_Stats
+mem_get_block_stats()
+{
+	Block_Stats s;
+	s.num_chunks = __atomic_load_n(&g_block_stats.num_chunks, __ATOMIC_RELAXED);
+	s.num_blocks_carved = __atomic_load_n(&g_block_stats.num_blocks_carved, __ATOMIC_RELAXED);
+	s.num_free_list_blocks = __atomic_load_n(&g_block_stats.num_free_list_blocks, __ATOMIC_RELAXED);
+	s.num_cached_blocks = __atomic_load_n(&g_block_stats.num_cached_blocks, __ATOMIC_RELAXED);
+	return s;
+}
+
+// Copies up to the last max allocation records, oldest first.
+uint32_t
+mem_get_allocation_trace(Allocation_Record *out, uint32_t max)
+{
+	uint64_t end = __atomic_load_n(&g_num_allocation_records, __ATOMIC_RELAXED);
+	uint64_t n = _min(_min(end, MEM_TRACE_SIZE), (uint64_t)max);
+	for (uint64_t i = 0; i < n; ++i)
+		out[i] = g_allocation_trace[(end - n + i) & (MEM_TRACE_SIZE - 1)];
+	return (uint32_t)n;
+}
+
+#define MEM_NAME_ARENA(arena, name) mem_name_arena(arena, name)
+
+// Pushes and frees from here on record where they were made. A macro's own name isn't expanded again inside it, so these end
+// up calling the functions above.
+#define mem_push(size, arena) (mem_set_call_site(arena, __FILE__, __LINE__), mem_push(size, arena))
+#define mem_push_contiguous(size, arena) (mem_set_call_site(arena, __FILE__, __LINE__), mem_push_contiguous(size, arena))
+#define mem_free(arena, p) (mem_set_call_site(arena, __FILE__, __LINE__), mem_free(arena, p))
+#else
+#define MEM_NAME_ARENA(arena, name)
+#endif
@@ -1,6 +1,46 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#ifdef MEM_INSTRUMENT
+// Building with -DMEM_INSTRUMENT keeps statistics for every arena and a trace of recent allocations. Without it none of this
+// exists, so it costs nothing.
+
+// Bytes in entry headers, alignment padding and the unused ends of blocks an arena has moved past count as wasted.
+struct Arena_Stats {
+	const char *name;
+	size_t live_bytes;
+	size_t peak_bytes;
+	size_t free_bytes;   // Freed entries waiting to be reused.
+	size_t wasted_bytes;
+	size_t num_pushes;
+	uint32_t num_blocks;  // Scratch arenas count up to the one being pushed into, not the ones past it kept for reuse.
+	bool in_use;
+};
+
+// Block counts across every arena. Blocks in use are the ones carved that aren't in the free list or a thread's cache.
+struct Block_Stats {
+	uint32_t num_chunks;
+	uint32_t num_blocks_carved;
+	uint32_t num_free_list_blocks;
+	uint32_t num_cached_blocks;
+};
+
+enum Allocation_Op {
+	MEM_OP_PUSH,
+	MEM_OP_PUSH_CONTIGUOUS,
+	MEM_OP_FREE,
+};
+
+struct Allocation_Record {
+	const char *arena;
+	const char *file; // Where the push or free was made, NULL if it came from inside memory.cpp.
+	int line;
+	Allocation_Op op;
+	size_t size;
+	void *p;
+};
+#endif
+
 struct Chunk_Footer {
 	char *base;
 	char *block_frontier;
@@ -33,9 +73,100 @@ struct Entry_Header {
 
 struct Memory_Arena {
 	Free_Entry *entry_free_head;
+	char *first_entry;
 	char *last_entry;
 	Block_Footer *base;
 	Block_Footer *active_block;
+#ifdef MEM_INSTRUMENT
+	Arena_Stats *stats;
+#endif
+};
+
+// Bump allocator over the same blocks as Memory_Arena, but without entry headers, so a push is just a pointer bump. Nothing is
+// freed on its own, only by rewinding to a mark or destroying the arena. Blocks past the cursor stay attached to be reused.
+struct Scratch_Arena {
+	Block_Footer *base;
+	Block_Footer *active_block;
+	char *cursor; // Next free byte in active_block.
+#ifdef MEM_INSTRUMENT
+	Arena_Stats *stats;
+#endif
+};
+
+struct Scratch_Mark {
+	Block_Footer *block;
+	char *cursor;
+#ifdef MEM_INSTRUMENT
+	size_t live_bytes;
+	size_t wasted_bytes;
+	uint32_t num_blocks;
+#endif
+};
+
+enum Memory_Backing {
+	MEM_BACKING_PAGES,      // Plain pages.
+	MEM_BACKING_HUGE_PAGES, // Transparent huge pages, wherever the kernel can put them together.
+	MEM_BACKING_HUGETLB,    // Huge pages from the preallocated hugetlb pool, or transparent ones when the pool runs dry.
+};
+
+constexpr int MEM_ANY_NUMA_NODE = -1;
+
+// How memory is backed once it's committed. The NUMA node is preferred rather than required, so memory spills over to other
+// nodes instead of failing when the node is full.
+struct Memory_Policy {
+	Memory_Backing backing;
+	int numa_node;
+};
+
+// Reserves a big range of address space up front and commits pages as pushes reach them. It grows in place, so nothing ever
+// moves and there's no size limit short of the reservation. Resetting hands the committed pages back to the OS.
+struct Virtual_Arena {
+	char *base;
+	char *cursor;
+	char *committed_end;
+	char *reserved_end;
+	Memory_Policy policy;
+};
+
+// Size classes for Slab_Allocator, 16 bytes to 8k. Anything bigger gets blocks of its own.
+constexpr int NUM_SLAB_CLASSES = 18;
+
+// A block cut into equal sized objects. The header sits at the start of the block, and blocks are aligned to their size, so the
+// slab an object belongs to is found by masking its address.
+struct Slab {
+	struct Slab_Allocator *owner;
+	Block_Footer *block;
+	Slab *next;
+	Slab *prev;
+	char *free_list; // Freed objects, linked through their first bytes.
+	char *frontier;  // Objects from here on have never been handed out, so a new slab doesn't touch pages it doesn't use.
+	uint32_t num_used;
+	uint32_t capacity;
+	uint32_t size_class;
+};
+
+struct Slab_Class {
+	Slab *partial; // Slabs with free objects.
+	Slab *full;
+	Slab *empty;   // One empty slab is kept around, so an object going back and forth doesn't get a block each time.
+	uint32_t num_slabs;
+	size_t num_used;
+};
+
+// Long lived objects that come and go, like instances and assets. Alloc and free are O(1) and nothing has a header, so objects
+// keep the alignment of their size class. Belongs to one thread at a time, like the arenas.
+struct Slab_Allocator {
+	Slab_Class classes[NUM_SLAB_CLASSES];
+	Slab *large;
+	uint32_t num_large;
+	size_t large_bytes;
+};
+
+struct Slab_Stats {
+	size_t object_size;
+	uint32_t num_slabs;
+	size_t num_used;
+	size_t capacity;
 };
 
 #endif
@@ -0,0 +1,272 @@
+#include <float.h>
+
+// Per-model triangle BVH for picking.
+// Nodes are 4 wide with the child boxes stored as structure-of-arrays, so one SSE slab test covers all four children of a node.
+// Children are either another node or a leaf run of up to MESH_BVH_LEAF_SIZE triangles. Triangles are stored pre-transformed
+// for Moller-Trumbore (a vertex and two edges) in leaf order, along with the mesh and triangle they came from.
+
+constexpr int MESH_BVH_LEAF_SIZE = 4;
+constexpr int MESH_BVH_MAX_STACK_DEPTH = 256;
+
+struct Mesh_Bvh_Node {
+	float min_x[4], min_y[4], min_z[4];
+	float max_x[4], max_y[4], max_z[4];
+	// Inner children are node indices. Leaf children have num_tris[i] > 0 and child[i] is the index of their first triangle.
+	// Unused slots have a box that no ray can hit.
+	int32_t child[4];
+	uint8_t num_tris[4];
+};
+
+struct Mesh_Bvh_Triangle {
+	Vec3f v0;
+	Vec3f e1; // v1 - v0
+	Vec3f e2; // v2 - v0
+	uint32_t mesh;
+	uint32_t triangle; // Within the mesh.
+};
+
+struct Mesh_Bvh {
+	Mesh_Bvh_Node *nodes;
+	Mesh_Bvh_Triangle *triangles;
+	uint32_t num_nodes;
+	uint32_t num_triangles;
+};
+
+struct Mesh_Bvh_Hit {
+	uint32_t mesh;
+	uint32_t triangle;
+	float t;
+	float u, v; // Barycentrics of the triangle's second and third vertices. The first gets 1 - u - v.
+};
+
+struct Mesh_Bvh_Builder {
+	Mesh_Bvh_Node *nodes;
+	uint32_t num_nodes;
+	uint32_t *tri_order;
+	Vec3f *centroids;
+	Aabb *tri_boxes;
+};
+
+static Aabb
+mesh_bvh_range_bounds(const Mesh_Bvh_Builder *b, uint32_t begin, uint32_t end, bool centroids_only)
+{
+	Aabb box = { { FLT_MAX, FLT_MAX, FLT_MAX }, { -FLT_MAX, -FLT_MAX, -FLT_MAX } };
+	for (uint32_t i = begin; i < end; ++i) {
+		uint32_t t = b->tri_order[i];
+		box = aabb_union(box, centroids_only ? Aabb{ b->centroids[t], b->centroids[t] } : b->tri_boxes[t]);
+	}
+	return box;
+}
+
+// Partially sorts tri_order[begin, end) so that the element at nth has every element before it with a smaller centroid on axis.
+static void
+mesh_bvh_select(Mesh_Bvh_Builder *b, uint32_t begin, uint32_t end, uint32_t nth, int axis)
+{
+	auto key = [b, axis](uint32_t i) -> float { const float *c = &b->centroids[b->tri_order[i]].x; return c[axis]; };
+	while (end - begin > 1) {
+		float pivot = key(begin + (end - begin) / 2);
+		uint32_t lo = begin, hi = end - 1;
+		while (lo <= hi) {
+			while (key(lo) < pivot)
+				++lo;
+			while (key(hi) > pivot)
+				--hi;
+			if (lo <= hi) {
+				swap(b->tri_order[lo], b->tri_order[hi]);
+				++lo;
+				if (hi == 0)
+					break;
+				--hi;
+			}
+		}
+		if (nth <= hi)
+			end = hi + 1;
+		else if (nth >= lo)
+			begin = lo;
+		else
+			return;
+	}
+}
+
+static uint32_t
+mesh_bvh_build_node(Mesh_Bvh_Builder *b, uint32_t begin, uint32_t end)
+{
+	// Split the range at centroid medians along the longest axis until there are four children or nothing left to split.
+	uint32_t ranges[4][2] = { { begin, end } };
+	int num_ranges = 1;
+	while (num_ranges < 4) {
+		int widest = -1;
+		for (int i = 0; i < num_ranges; ++i) {
+			uint32_t count = ranges[i][1] - ranges[i][0];
+			if (count > MESH_BVH_LEAF_SIZE && (widest < 0 || count > ranges[widest][1] - ranges[widest][0]))
+				widest = i;
+		}
+		if (widest < 0)
+			break;
+		uint32_t r_begin = ranges[widest][0], r_end = ranges[widest][1];
+		Aabb cbox = mesh_bvh_range_bounds(b, r_begin, r_end, true);
+		Vec3f size = cbox.max - cbox.min;
+		int axis = (size.x > size.y && size.x > size.z) ? 0 : (size.y > size.z ? 1 : 2);
+		uint32_t mid = r_begin + (r_end - r_begin) / 2;
+		mesh_bvh_select(b, r_begin, r_end, mid, axis);
+		ranges[widest][1] = mid;
+		ranges[num_ranges][0] = mid;
+		ranges[num_ranges][1] = r_end;
+		++num_ranges;
+	}
+
+	uint32_t node_index = b->num_nodes++;
+	for (int i = 0; i < 4; ++i) {
+		Mesh_Bvh_Node *n = &b->nodes[node_index];
+		if (i >= num_ranges) {
+			// A point out at FLT_MAX fails the slab test on every axis. An inverted box wouldn't, the slab test swaps min and max.
+			n->min_x[i] = n->min_y[i] = n->min_z[i] = FLT_MAX;
+			n->max_x[i] = n->max_y[i] = n->max_z[i] = FLT_MAX;
+			n->child[i] = 0;
+			n->num_tris[i] = 0;
+			continue;
+		}
+		Aabb box = mesh_bvh_range_bounds(b, ranges[i][0], ranges[i][1], false);
+		n->min_x[i] = box.min.x; n->min_y[i] = box.min.y; n->min_z[i] = box.min.z;
+		n->max_x[i] = box.max.x; n->max_y[i] = box.max.y; n->max_z[i] = box.max.z;
+		uint32_t count = ranges[i][1] - ranges[i][0];
+		if (count <= MESH_BVH_LEAF_SIZE) {
+			n->child[i] = ranges[i][0];
+			n->num_tris[i] = count;
+		} else {
+			// The recursive call can't move the node array, it's sized for the worst case up front.
+			uint32_t child = mesh_bvh_build_node(b, ranges[i][0], ranges[i][1]);
+			n->child[i] = child;
+			n->num_tris[i] = 0;
+		}
+	}
+	return node_index;
+}
+
+// Vertex positions are three floats every vertex_stride bytes, and indices are relative to the first one. Mesh m is the
+// triangle list in indices[mesh_first_index[m], mesh_first_index[m] + mesh_num_indices[m]).
+// Temporary build data comes from scratch, the finished tree from arena.
+Mesh_Bvh
+make_mesh_bvh(const float *positions, size_t vertex_stride, const uint32_t *indices, const uint32_t *mesh_num_indices,
+              const uint32_t *mesh_first_index, uint32_t num_meshes, Memory_Arena *arena, Scratch_Arena *scratch)
+{
+	Mesh_Bvh bvh = {};
+	for (uint32_t m = 0; m < num_meshes; ++m)
+		bvh.num_triangles += mesh_num_indices[m] / 3;
+	if (bvh.num_triangles == 0)
+		return bvh;
+
+	Mesh_Bvh_Builder b;
+	b.tri_order = mem_alloc_array(uint32_t, bvh.num_triangles, scratch);
+	b.centroids = mem_alloc_array(Vec3f, bvh.num_triangles, scratch);
+	b.tri_boxes = mem_alloc_array(Aabb, bvh.num_triangles, scratch);
+	Mesh_Bvh_Triangle *tris = mem_alloc_array(Mesh_Bvh_Triangle, bvh.num_triangles, scratch);
+	auto position = [positions, vertex_stride](uint32_t i) -> Vec3f {
+		const float *p = (const float *)((const char *)positions + i*vertex_stride);
+		return { p[0], p[1], p[2] };
+	};
+	uint32_t t = 0;
+	for (uint32_t m = 0; m < num_meshes; ++m) {
+		for (uint32_t i = 0; i < mesh_num_indices[m] / 3; ++i, ++t) {
+			const uint32_t *tri_inds = &indices[mesh_first_index[m] + i*3];
+			Vec3f v0 = position(tri_inds[0]), v1 = position(tri_inds[1]), v2 = position(tri_inds[2]);
+			tris[t] = { v0, v1 - v0, v2 - v0, m, i };
+			b.tri_boxes[t] = aabb_union(aabb_union({ v0, v0 }, { v1, v1 }), { v2, v2 });
+			b.centroids[t] = (1.0f / 3.0f) * (v0 + v1 + v2);
+			b.tri_order[t] = t;
+		}
+	}
+	// Every inner node splits at least one range, so there are fewer inner nodes than triangles.
+	b.nodes = mem_alloc_array(Mesh_Bvh_Node, bvh.num_triangles, scratch);
+	b.num_nodes = 0;
+	mesh_bvh_build_node(&b, 0, bvh.num_triangles);
+
+	bvh.num_nodes = b.num_nodes;
+	bvh.nodes = mem_alloc_array(Mesh_Bvh_Node, bvh.num_nodes, arena);
+	for (uint32_t i = 0; i < bvh.num_nodes; ++i)
+		bvh.nodes[i] = b.nodes[i];
+	bvh.triangles = mem_alloc_array(Mesh_Bvh_Triangle, bvh.num_triangles, arena);
+	for (uint32_t i = 0; i < bvh.num_triangles; ++i)
+		bvh.triangles[i] = tris[b.tri_order[i]];
+	return bvh;
+}
+
+// Moller-Trumbore. Returns the hit distance, or -1 for a miss. Both faces count.
+inline float
+ray_triangle(const Mesh_Bvh_Triangle &tri, Vec3f origin, Vec3f dir, float *out_u, float *out_v)
+{
+	Vec3f p = cross_product(dir, tri.e2);
+	float det = dot_product(tri.e1, p);
+	if (_fabs(det) < 1e-12f)
+		return -1.0f;
+	float inv_det = 1.0f / det;
+	Vec3f s = origin - tri.v0;
+	float u = dot_product(s, p) * inv_det;
+	if (u < 0.0f || u > 1.0f)
+		return -1.0f;
+	Vec3f q = cross_product(s, tri.e1);
+	float v = dot_product(dir, q) * inv_det;
+	if (v < 0.0f || u + v > 1.0f)
+		return -1.0f;
+	*out_u = u;
+	*out_v = v;
+	return dot_product(tri.e2, q) * inv_det;
+}
+
+// Closest triangle hit along the ray closer than max_t. dir doesn't have to be normalized; t is in units of dir.
+bool
+mesh_bvh_raycast(const Mesh_Bvh &bvh, Vec3f origin, Vec3f dir, float max_t, Mesh_Bvh_Hit *hit)
+{
+	if (bvh.num_nodes == 0)
+		return false;
+	const __m128 ox = _mm_set1_ps(origin.x), oy = _mm_set1_ps(origin.y), oz = _mm_set1_ps(origin.z);
+	const __m128 idx = _mm_set1_ps(1.0f / dir.x), idy = _mm_set1_ps(1.0f / dir.y), idz = _mm_set1_ps(1.0f / dir.z);
+	float best_t = max_t;
+	bool found = false;
+	uint32_t stack[MESH_BVH_MAX_STACK_DEPTH];
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0) {
+		const Mesh_Bvh_Node *n = &bvh.nodes[stack[--top]];
+		__m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->min_x), ox), idx), tx2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->max_x), ox), idx);
+		__m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->min_y), oy), idy), ty2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->max_y), oy), idy);
+		__m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->min_z), oz), idz), tz2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(n->max_z), oz), idz);
+		__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_max_ps(_mm_min_ps(tz1, tz2), _mm_setzero_ps()));
+		__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_min_ps(_mm_max_ps(tz1, tz2), _mm_set1_ps(best_t)));
+		int mask = _mm_movemask_ps(_mm_cmple_ps(tmin, tmax));
+		if (!mask)
+			continue;
+		float entry_t[4];
+		_mm_storeu_ps(entry_t, tmin);
+		// Leaves are tested right away, which shrinks best_t for the inner children. Inner children are pushed furthest first.
+		int inner[4], num_inner = 0;
+		for (int i = 0; i < 4; ++i) {
+			if (!(mask & (1 << i)))
+				continue;
+			if (n->num_tris[i] == 0) {
+				inner[num_inner++] = i;
+				continue;
+			}
+			for (int j = 0; j < n->num_tris[i]; ++j) {
+				const Mesh_Bvh_Triangle &tri = bvh.triangles[n->child[i] + j];
+				float u, v;
+				float t = ray_triangle(tri, origin, dir, &u, &v);
+				if (t >= 0.0f && t < best_t) {
+					best_t = t;
+					found = true;
+					*hit = { tri.mesh, tri.triangle, t, u, v };
+				}
+			}
+		}
+		for (int i = 1; i < num_inner; ++i) {
+			for (int j = i; j > 0 && entry_t[inner[j]] > entry_t[inner[j - 1]]; --j)
+				swap(inner[j], inner[j - 1]);
+		}
+		assert(top + num_inner <= MESH_BVH_MAX_STACK_DEPTH);
+		for (int i = 0; i < num_inner; ++i) {
+			if (entry_t[inner[i]] <= best_t)
+				stack[top++] = n->child[inner[i]];
+		}
+	}
+	return found;
+}
@@ -3,14 +3,19 @@
 
 enum Key_Symbol {
 	A_KEY = PLATFORM_A_KEY,
+	B_KEY = PLATFORM_B_KEY,
 	D_KEY = PLATFORM_D_KEY,
 	E_KEY = PLATFORM_E_KEY,
 	F_KEY = PLATFORM_F_KEY,
 	G_KEY = PLATFORM_G_KEY,
+	K_KEY = PLATFORM_K_KEY,
+	L_KEY = PLATFORM_L_KEY,
 	Q_KEY = PLATFORM_Q_KEY,
 	R_KEY = PLATFORM_R_KEY,
 	S_KEY = PLATFORM_S_KEY,
+	T_KEY = PLATFORM_T_KEY,
 	W_KEY = PLATFORM_W_KEY,
+	Z_KEY = PLATFORM_Z_KEY,
 };
 
 enum Mouse_Button {
@@ -18,7 +23,13 @@ enum Mouse_Button {
 };
 
 struct File_Handle;
+struct Mapped_File;
+struct Platform_Thread;
+struct Platform_Semaphore;
+struct Platform_Async_Io;
+struct Platform_Async_Read;
 struct Platform_Time;
+struct Platform_Memory_Counters;
 
 void platform_update_mouse_pos(Mouse *);
 unsigned platform_keysym_to_scancode(Key_Symbol);
@@ -28,13 +39,36 @@ void platform_swap_buffers();
 void platform_debug_print(size_t, const char *);
 File_Handle platform_open_file(const char *path, const char *modes);
 void platform_close_file(File_Handle);
-void platform_file_seek(File_Handle, unsigned);
+void platform_file_seek(File_Handle, uint64_t);
 void platform_read(File_Handle, size_t, void *);
 void platform_write(File_Handle, size_t, const void *);
-char *platform_read_entire_file(const char *, Memory_Arena *);
+char *platform_read_entire_file(const char *, Scratch_Arena *);
+Mapped_File platform_map_file(const char *);
+void platform_unmap_file(Mapped_File *);
+void platform_prefetch(const void *, size_t);
+void platform_evict_file_cache(const char *);
 char *platform_get_memory(size_t);
 void platform_free_memory(void *, size_t);
+char *platform_reserve_memory(size_t, size_t alignment);
+void platform_commit_memory(void *, size_t, Memory_Policy);
+void platform_decommit_memory(void *, size_t, Memory_Policy);
+unsigned platform_get_numa_node();
+void platform_init_memory_counters();
+Platform_Memory_Counters platform_get_memory_counters();
 size_t platform_get_page_size();
+unsigned platform_get_processor_count();
+Platform_Thread platform_create_thread(void (*)(void *), void *);
+void platform_join_thread(Platform_Thread);
+void platform_pin_thread(unsigned);
+void platform_init_semaphore(Platform_Semaphore *, unsigned);
+void platform_post_semaphore(Platform_Semaphore *);
+void platform_wait_semaphore(Platform_Semaphore *);
+bool platform_init_async_io(Platform_Async_Io *, unsigned queue_depth);
+void platform_destroy_async_io(Platform_Async_Io *);
+const char *platform_async_io_backend(const Platform_Async_Io *);
+bool platform_register_async_buffers(Platform_Async_Io *, void **buffers, const size_t *sizes, unsigned count);
+unsigned platform_submit_async_reads(Platform_Async_Io *, Platform_Async_Read **, unsigned count);
+unsigned platform_get_async_completions(Platform_Async_Io *, Platform_Async_Read **, unsigned max, unsigned wait_for);
 Platform_Time platform_get_time();
 long platform_time_diff(Platform_Time, Platform_Time, unsigned);
 
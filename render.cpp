@@ -1,7 +1,6 @@
 constexpr int MAX_PT_LIGHTS = 4;
 constexpr int MAX_UI_VERTICES = 100;
 constexpr int MAX_GLYPH_VERTICES = 1000;
-constexpr int MESH_TEX_NONEXIST = (uint32_t)-1;
 
 struct Render_Id {
 	size_t model_ind;
@@ -26,11 +25,20 @@ struct Untextured_Mesh {
 	GLuint base_vertex;
 };
 
+// Model space bounds from the asset file, with the box kept as center/half extents since that's what the culling wants.
+struct Bounds {
+	Vec3f center;
+	Vec3f extents;
+	Vec3f sphere_center;
+	float sphere_radius;
+};
+
 struct Textured_Mesh {
 	GLuint num_indices;
-	GLuint base_vertex;
+	GLuint first_index; // Into the geometry pool's index buffer.
 	GLuint diffuse_id;
 	GLuint specular_id;
+	Bounds bounds;
 };
 
 struct Model_Vertex {
@@ -123,27 +131,55 @@ struct Ubo_Ids {
 
 struct Shader_Ids {
 	GLuint textured_mesh;
+	GLuint textured_mesh_instanced;
 	GLuint untextured_mesh;
 	GLuint ui;
 	GLuint text;
 };
 
+// Uniform locations are looked up once at init. Locations the program doesn't use are -1, which glUniform* ignores.
+struct Mesh_Uniform_Locs {
+	GLint model;
+	GLint view_pos;
+	GLint mat_ambient;
+	GLint mat_diffuse;
+	GLint mat_specular;
+	GLint mat_shininess;
+};
+
+struct Uniform_Locs {
+	Mesh_Uniform_Locs textured_mesh;
+	Mesh_Uniform_Locs textured_mesh_instanced;
+	Mesh_Uniform_Locs untextured_mesh;
+};
+
 struct Model_Asset {
-	GLuint vao;
-	GLuint vbo;
+	GLuint id;
+	GLint base_vertex; // Model indices are relative to the model's first vertex in the geometry pool.
+	Bounds bounds;
+	Mesh_Bvh bvh; // For picking.
 	GLuint num_meshes;
 	Textured_Mesh meshes[0]; // Struct hack -- is "meshes[1]" better?
 };
 
 struct Model_Instance {
-	//glm::mat4 pos;
-	Mat4 pos;
+	uint32_t transform; // Slot in g_instance_transforms.
+	Model_ID model;
+	int bvh_proxy;
+	Model_Instance *next; // Other instances of the same model.
+	Model_Instance *prev;
 };
 
+// The asset file stays mapped for the life of the program, for the table of contents and for anything loaded on the main
+// thread. The streaming workers read entries through the async file API instead, so each model's reads overlap.
 struct Loaded_Assets {
-	void **lookup_table;
-	GLuint *mesh_textures;
-	Memory_Arena models;
+	Mapped_File file;
+	File_Handle file_handle;
+	const Asset_File_Header *header;
+	// Table of contents entries by id, NULL for assets that aren't in the file.
+	const Asset_Toc_Entry *model_entries[NUM_MODEL_IDS];
+	const Asset_Toc_Entry *mesh_entries[NUM_MODEL_IDS];
+	const Asset_Toc_Entry **texture_entries;
 };
 
 Memory_Arena g_static_render_memory = mem_make_arena();
@@ -151,51 +187,206 @@ Memory_Arena g_static_render_memory = mem_make_arena();
 Loaded_Assets
 init_assets()
 {
-	Asset_File_Header af_header;
-	File_Handle af_handle = platform_open_file("assets.ahh", "");
-	DEFER(platform_close_file(af_handle));
-	platform_read(af_handle, sizeof(Asset_File_Header), &af_header);
-
-	Loaded_Assets la;
+	Loaded_Assets la = {};
+	la.file = platform_map_file("assets.ahh");
+	if (la.file.size < sizeof(Asset_File_Header))
+		zabort("assets.ahh is missing or truncated");
+	la.header = (const Asset_File_Header *)la.file.data;
+	if (la.header->magic != ASSET_FILE_MAGIC || la.header->version != ASSET_FILE_VERSION)
+		zabort("assets.ahh is not a version %d asset file, repack it or run asset_packer --convert", ASSET_FILE_VERSION);
+	if (la.header->toc_offset + sizeof(Asset_Toc_Entry)*la.header->num_entries > la.file.size)
+		zabort("assets.ahh table of contents is truncated");
+	la.file_handle = platform_open_file("assets.ahh", "r");
 	//la.num_assets = NUM_NAMED_ASSET_IDS + af_header.num_mesh_textures;
-	la.models = mem_make_arena();
-	// TODO: Need to zero out the mesh texture memory.
-	la.lookup_table = mem_alloc_array(void *, NUM_NAMED_ASSET_IDS + af_header.num_mesh_textures, &g_static_render_memory);
-	la.mesh_textures = mem_alloc_array(GLuint, af_header.num_mesh_textures, &g_static_render_memory);
+	la.texture_entries = mem_alloc_array(const Asset_Toc_Entry *, la.header->num_mesh_textures, &g_static_render_memory);
+	for (uint32_t i = 0; i < la.header->num_mesh_textures; ++i)
+		la.texture_entries[i] = NULL;
+
+	const Asset_Toc_Entry *toc = (const Asset_Toc_Entry *)(la.file.data + la.header->toc_offset);
+	for (uint32_t i = 0; i < la.header->num_entries; ++i) {
+		const Asset_Toc_Entry *e = &toc[i];
+		if (e->offset + e->size > la.file.size || e->offset % ASSET_ENTRY_ALIGNMENT != 0) {
+			zerror("assets.ahh entry %d is out of bounds or misaligned, skipping it", i);
+			continue;
+		}
+		if (e->type == ASSET_TYPE_MODEL && e->id < NUM_MODEL_IDS)
+			la.model_entries[e->id] = e;
+		else if (e->type == ASSET_TYPE_MESH && e->id < NUM_MODEL_IDS)
+			la.mesh_entries[e->id] = e;
+		else if (e->type == ASSET_TYPE_TEXTURE && e->id < la.header->num_mesh_textures)
+			la.texture_entries[e->id] = e;
+	}
 	return la;
 }
 
 Loaded_Assets g_assets = init_assets();
 
+struct Chunk_Decode {
+	const Asset_Chunk_Table *table;
+	const char *src; // Start of the stored entry, chunk offsets are relative to this.
+	char *dst;
+	uint64_t uncompressed_size;
+	volatile uint32_t num_failed;
+};
+
+// Job over a range of chunks.
+static void
+decode_chunks(void *p, uint32_t first_chunk, uint32_t end_chunk)
+{
+	Chunk_Decode *d = (Chunk_Decode *)p;
+	for (uint32_t i = first_chunk; i < end_chunk; ++i) {
+		uint64_t begin = d->table->chunk_offsets[i], end = d->table->chunk_offsets[i + 1];
+		uint64_t dst_begin = (uint64_t)i * ASSET_CHUNK_SIZE;
+		uint64_t dst_size = _min<uint64_t>(ASSET_CHUNK_SIZE, d->uncompressed_size - dst_begin);
+		const uint8_t *src = (const uint8_t *)d->src + begin;
+		uint8_t *dst = (uint8_t *)d->dst + dst_begin;
+		if (end - begin == dst_size) { // Stored as is.
+			__builtin_memcpy(dst, src, dst_size);
+			continue;
+		}
+		if (lz_decompress(src, end - begin, dst, dst_size) != (int64_t)dst_size)
+			atomic_fetch_add(&d->num_failed, 1);
+	}
+}
+
+// Takes the entry as stored, either in the mapping or read into memory. Uncompressed entries are used in place, compressed ones
+// are decoded into memory from arena, the chunks spread across the job threads. Returns NULL if the entry won't decode.
+const char *
+decode_asset_entry(const char *data, const Asset_Toc_Entry *e, Scratch_Arena *arena)
+{
+	if (e->compression == ASSET_COMPRESSION_NONE)
+		return data;
+	assert(e->compression == ASSET_COMPRESSION_LZ);
+	// The table is checked before anything in it is used, the sizes in 64 bits so a huge num_chunks can't wrap past the checks.
+	const Asset_Chunk_Table *table = (const Asset_Chunk_Table *)data;
+	if (e->size < sizeof(Asset_Chunk_Table)) {
+		zerror("asset entry %d of type %d has a bad chunk table", e->id, e->type);
+		return NULL;
+	}
+	uint64_t num_chunks = table->num_chunks;
+	uint64_t expected_chunks = e->uncompressed_size / ASSET_CHUNK_SIZE + (e->uncompressed_size % ASSET_CHUNK_SIZE != 0);
+	if (num_chunks != expected_chunks
+	 || sizeof(Asset_Chunk_Table) + sizeof(uint64_t)*(num_chunks + 1) > e->size
+	 || table->chunk_offsets[num_chunks] > e->size) {
+		zerror("asset entry %d of type %d has a bad chunk table", e->id, e->type);
+		return NULL;
+	}
+	for (uint64_t i = 0; i < num_chunks; ++i) {
+		if (table->chunk_offsets[i] > table->chunk_offsets[i + 1]) {
+			zerror("asset entry %d of type %d has a bad chunk table", e->id, e->type);
+			return NULL;
+		}
+	}
+	Chunk_Decode d;
+	d.table = table;
+	d.src = data;
+	d.dst = mem_alloc_array(char, e->uncompressed_size, arena);
+	d.uncompressed_size = e->uncompressed_size;
+	d.num_failed = 0;
+	parallel_for(decode_chunks, &d, d.table->num_chunks, 1);
+	if (d.num_failed) {
+		zerror("%d chunks of asset entry %d of type %d failed to decompress", d.num_failed, e->id, e->type);
+		return NULL;
+	}
+	return d.dst;
+}
+
+// Each entry is one contiguous range of the file, so the whole asset gets paged in with one hint.
+inline const char *
+get_asset_entry_data(const Mapped_File &file, const Asset_Toc_Entry *e, Scratch_Arena *arena)
+{
+	const char *data = file.data + e->offset;
+	platform_prefetch(data, e->size);
+	return decode_asset_entry(data, e, arena);
+}
+
+constexpr unsigned ASSET_READ_BATCH_SIZE = 32;
+
+// Reads the stored bytes of every entry into memory from the matching arena, overlapping the reads in batches. out[i] is NULL for
+// entries that failed to read.
+void
+read_asset_entries(Platform_Async_Io *io, File_Handle file, const Asset_Toc_Entry **entries, Scratch_Arena **arenas, char **out, unsigned n)
+{
+	Platform_Async_Read reads[ASSET_READ_BATCH_SIZE];
+	Platform_Async_Read *pending[ASSET_READ_BATCH_SIZE];
+	Platform_Async_Read *done[ASSET_READ_BATCH_SIZE];
+	for (unsigned first = 0; first < n; first += ASSET_READ_BATCH_SIZE) {
+		unsigned batch = _min(n - first, ASSET_READ_BATCH_SIZE);
+		for (unsigned i = 0; i < batch; ++i) {
+			const Asset_Toc_Entry *e = entries[first + i];
+			out[first + i] = mem_alloc_array(char, e->size, arenas[first + i]);
+			reads[i] = {};
+			reads[i].file = file;
+			reads[i].offset = e->offset;
+			reads[i].size = e->size;
+			reads[i].buffer = out[first + i];
+			reads[i].registered_buffer = -1;
+			reads[i].user_data = &out[first + i];
+			pending[i] = &reads[i];
+		}
+		for (unsigned submitted = 0, completed = 0; completed < batch;) {
+			submitted += platform_submit_async_reads(io, &pending[submitted], batch - submitted);
+			unsigned num_done = platform_get_async_completions(io, done, ASSET_READ_BATCH_SIZE, 1);
+			for (unsigned i = 0; i < num_done; ++i) {
+				if (done[i]->result != (int64_t)done[i]->size) {
+					zerror("could not read asset entry at %l, error %l", (long)done[i]->offset, (long)done[i]->result);
+					*(char **)done[i]->user_data = NULL;
+				}
+			}
+			completed += num_done;
+		}
+	}
+}
+
 // TODO: Probably better to create one list of model instances. Each instance keeps its Model_ID and we just sort the list once when we start rendering.
-Memory_Arena g_model_instances[NUM_MODEL_IDS];
+Model_Instance *g_model_instances[NUM_MODEL_IDS];
+// Instances come and go, so they live in a slab allocator, where a removed instance's memory goes to the next one added.
+Slab_Allocator g_instance_slab = mem_make_slab_allocator();
+// Positions, rotations and scales of every instance. Slot user data is the Model_Instance.
+Transforms g_instance_transforms;
+// Every instance of every model, keyed on its world space bounds. Leaf user data is the Model_Instance.
+Bvh g_scene_bvh;
+size_t g_num_model_instances[NUM_MODEL_IDS];
+
+// Draw every instance of a model with one glDrawElementsInstanced per mesh instead of one draw per instance per mesh.
+bool g_instanced_rendering = true;
 
 static Shader_Ids g_shaders;
+static Uniform_Locs g_uniform_locs;
 static Lights g_lights;
 static Matrices g_matrices;
 static Ubo_Ids g_ubos;
 static UI_Render_Info g_ui_render_info;
 
-size_t
-get_mesh_tex_asset_id(size_t mtex_table_ind)
-{
-	return NUM_NAMED_ASSET_IDS + mtex_table_ind;
-}
-
-#include <stdio.h>
+// Ray through the given window position, starting on the near plane. Returns false if the matrices can't be inverted.
 bool
-raycast_plane(Vec2i screen_ray, Vec3f plane_normal, Vec3f origin, const float origin_ofs, const Vec2u &screen_dim, Vec3f *out_pt)
+screen_to_world_ray(Vec2i screen_pos, const Vec2u &screen_dim, Vec3f *out_origin, Vec3f *out_dir)
 {
 	// XCoordinates from -1 to 1
-	float x = (2.0f * screen_ray.x) / screen_dim.x - 1.0f;
+	float x = (2.0f * screen_pos.x) / screen_dim.x - 1.0f;
 	// YCoordinates from -1 to 1, flipped because y increases upwards in GL but decreases upwards in window coordinates.
-	float y = 1.0f - (2.0f * screen_ray.y) / screen_dim.y;
+	float y = 1.0f - (2.0f * screen_pos.y) / screen_dim.y;
 
 	// Reverse pipeline.
-	Mat4 inv_pv = inverse(g_matrices.perspective_proj * g_matrices.view);
+	Mat4 inv_pv;
+	if (!inverse(g_matrices.perspective_proj * g_matrices.view, &inv_pv)) {
+		zerror("projection * view is singular, so there's no ray through the screen");
+		return false;
+	}
 	Vec3f near = unproject({x,y,-1.0f}, inv_pv);
 	Vec3f far = unproject({x,y,1.0f}, inv_pv);
-	Vec3f world_ray = normalize(far - near);
+	*out_origin = near;
+	*out_dir = normalize(far - near);
+	return true;
+}
+
+#include <stdio.h>
+bool
+raycast_plane(Vec2i screen_ray, Vec3f plane_normal, Vec3f origin, const float origin_ofs, const Vec2u &screen_dim, Vec3f *out_pt)
+{
+	Vec3f near, world_ray;
+	if (!screen_to_world_ray(screen_ray, screen_dim, &near, &world_ray))
+		return false;
 
 	float l = dot_product(world_ray, plane_normal);
 	if (l >= 0.0f && l <= 0.001f) // perpendicular
@@ -291,123 +482,531 @@ make_gpu_program(const char *vert_src, const char *frag_src, const char *defines
 	return program;
 }
 
-static GLuint
-get_mesh_texture(uint32_t mtex_table_ind, GLuint gl_tex_unit, Memory_Arena *arena)
+static Mesh_Uniform_Locs
+get_mesh_uniform_locs(GLuint program)
 {
-	if (mtex_table_ind == MESH_TEX_NONEXIST)
-		return 0;
+	Mesh_Uniform_Locs l;
+	l.model = glGetUniformLocation(program, "u_model");
+	l.view_pos = glGetUniformLocation(program, "u_view_pos");
+	l.mat_ambient = glGetUniformLocation(program, "mat.ambient");
+	l.mat_diffuse = glGetUniformLocation(program, "mat.diffuse");
+	l.mat_specular = glGetUniformLocation(program, "mat.specular");
+	l.mat_shininess = glGetUniformLocation(program, "mat.shininess");
+	return l;
+}
+
+// Vertex and index data for every model lives in one buffer pair, so drawing never has to switch VAOs.
+// Models are never unloaded, so ranges are handed out with a bump allocator.
+constexpr size_t GEOMETRY_POOL_MAX_VERTICES = 1 << 21;
+constexpr size_t GEOMETRY_POOL_MAX_INDICES = 1 << 23;
+
+struct Geometry_Pool {
+	GLuint vao;
+	GLuint vbo;
+	GLuint ebo;
+	size_t num_vertices;
+	size_t num_indices;
+};
+
+static Geometry_Pool g_geometry_pool;
+
+void
+geometry_pool_init()
+{
+	glGenVertexArrays(1, &g_geometry_pool.vao);
+	glGenBuffers(1, &g_geometry_pool.vbo);
+	glGenBuffers(1, &g_geometry_pool.ebo);
+	g_geometry_pool.num_vertices = 0;
+	g_geometry_pool.num_indices = 0;
+
+	gl_bind_vertex_array(g_geometry_pool.vao);
+	gl_bind_buffer(GL_ARRAY_BUFFER, g_geometry_pool.vbo);
+	glBufferData(GL_ARRAY_BUFFER, GEOMETRY_POOL_MAX_VERTICES*sizeof(Model_Vertex), NULL, GL_STATIC_DRAW);
+
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Model_Vertex), (GLvoid *)offsetof(Model_Vertex, position));
+	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Model_Vertex), (GLvoid *)offsetof(Model_Vertex, normal));
+	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Model_Vertex), (GLvoid *)offsetof(Model_Vertex, uv));
+
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+	glEnableVertexAttribArray(2);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, g_geometry_pool.ebo);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, GEOMETRY_POOL_MAX_INDICES*sizeof(GLuint), NULL, GL_STATIC_DRAW);
+	gl_bind_vertex_array(0);
+}
+
+// Copies the model's geometry into the pool and returns where it went.
+static void
+geometry_pool_add(const Model_Vertex *verts, size_t num_verts, const GLuint *inds, size_t num_inds, GLint *base_vertex, GLuint *first_index)
+{
+	Geometry_Pool *p = &g_geometry_pool;
+	if (p->num_vertices + num_verts > GEOMETRY_POOL_MAX_VERTICES || p->num_indices + num_inds > GEOMETRY_POOL_MAX_INDICES)
+		zabort("geometry pool is out of space");
+	*base_vertex = p->num_vertices;
+	*first_index = p->num_indices;
+
+	gl_bind_buffer(GL_ARRAY_BUFFER, p->vbo);
+	glBufferSubData(GL_ARRAY_BUFFER, p->num_vertices*sizeof(Model_Vertex), num_verts*sizeof(Model_Vertex), verts);
+	// The element buffer binding is VAO state, so bind the pool VAO rather than clobbering whatever else is bound.
+	gl_bind_vertex_array(p->vao);
+	glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, p->num_indices*sizeof(GLuint), num_inds*sizeof(GLuint), inds);
+
+	p->num_vertices += num_verts;
+	p->num_indices += num_inds;
+}
+
+static Bounds
+to_bounds(const Asset_Bounds &ab)
+{
+	Bounds b;
+	b.center = { (ab.aabb_min[0] + ab.aabb_max[0]) * 0.5f, (ab.aabb_min[1] + ab.aabb_max[1]) * 0.5f, (ab.aabb_min[2] + ab.aabb_max[2]) * 0.5f };
+	b.extents = { (ab.aabb_max[0] - ab.aabb_min[0]) * 0.5f, (ab.aabb_max[1] - ab.aabb_min[1]) * 0.5f, (ab.aabb_max[2] - ab.aabb_min[2]) * 0.5f };
+	b.sphere_center = { ab.sphere_center[0], ab.sphere_center[1], ab.sphere_center[2] };
+	b.sphere_radius = ab.sphere_radius;
+	return b;
+}
+
+// Asset streaming.
+// Models load in the background. A stream thread reads the model, its mesh table and its textures and builds everything the CPU
+// needs (bounds, mesh BVH, texture levels). Stream threads spend most of their time waiting on reads, so decompression and texture
+// decoding go out to the job system. stream_update() then hands the results to GL on the render thread,
+// a bounded number of bytes per frame, with texture levels going through a pixel unpack buffer. Nothing of a model is drawn or
+// picked until all of it is resident, so a model that enters the scene never stalls the frame.
+// Each slot's state is only written with a release store after the fields it covers, and is read with an acquire load.
+
+enum Stream_State : uint32_t {
+	STREAM_NOT_LOADED,
+	STREAM_LOADING,
+	STREAM_DECODED, // CPU side is done, waiting on uploads.
+	STREAM_RESIDENT,
+	STREAM_FAILED,
+};
+
+constexpr unsigned MAX_STREAM_WORKERS = 2;
+constexpr size_t STREAM_UPLOAD_BUDGET = MEGABYTE(4); // Per frame, also the size of the pixel unpack buffer.
+constexpr unsigned MAX_STREAM_LEVELS_PER_FRAME = 64;
+
+struct Stream_Texture_Level {
+	uint32_t width;
+	uint32_t height;
+	uint32_t row_pixels; // Only for levels decoded on the CPU, which are padded out to whole blocks.
+	const char *data;
+	size_t size;
+};
+
+struct Stream_Texture {
+	volatile uint32_t state;
+	Scratch_Arena arena; // Decoded levels, freed once uploaded or when the texture fails.
+	GLenum format;      // A compressed format, or GL_RGBA8 if the driver can't take S3TC and the levels were decoded.
+	uint32_t width;
+	uint32_t height;
+	uint32_t num_levels;
+	uint32_t next_level; // Next level to upload.
+	Stream_Texture_Level levels[ASSET_MAX_TEXTURE_LEVELS];
+	GLuint id;
+};
+
+struct Stream_Model {
+	volatile uint32_t state;
+	Platform_Time requested;
+	Memory_Arena arena;   // The Model_Asset and its mesh BVH, kept for good unless the model fails.
+	Scratch_Arena scratch; // Decoded payloads, freed once uploaded or when the model fails.
+	Model_Asset *model;   // Mesh first indices are model relative and texture ids unset until the upload.
+	const Model_Vertex *vertices;
+	const GLuint *indices;
+	uint32_t num_vertices;
+	uint32_t num_indices;
+	uint32_t *diffuse_textures; // Mesh texture indices, by mesh.
+	uint32_t *specular_textures;
+	bool geometry_uploaded;
+};
+
+struct Streamer {
+	Stream_Model models[NUM_MODEL_IDS];
+	Stream_Texture *textures;
+	// Every model is queued at most once, so the queue never wraps.
+	Model_ID queue[NUM_MODEL_IDS];
+	uint32_t num_queued;
+	uint32_t next_queued;
+	Spin_Lock queue_lock;
+	Platform_Semaphore queue_sem;
+	GLuint pbo;
+	// Since the last frame report, which resets them.
+	uint32_t num_made_resident;
+	long max_resident_us; // Longest wait from request to resident.
+};
+
+static Streamer g_streamer;
+
+// Worker side. Returns true if this worker got the texture to load, false if somebody else has it or it isn't in the file.
+static bool
+stream_claim_texture(uint32_t index)
+{
+	Stream_Texture *t = &g_streamer.textures[index];
+	if (!atomic_compare_exchange(&t->state, STREAM_NOT_LOADED, STREAM_LOADING))
+		return false;
+	if (!g_assets.texture_entries[index]) {
+		zerror("mesh texture %d is not in the asset file", index);
+		atomic_store(&t->state, STREAM_FAILED);
+		return false;
+	}
+	t->arena = mem_make_scratch();
+	MEM_NAME_ARENA(&t->arena, "stream texture");
+	return true;
+}
+
+// Worker side. Decodes a claimed texture from its stored bytes, which were read into its arena.
+static void
+stream_decode_texture(uint32_t index, const char *stored)
+{
+	Stream_Texture *t = &g_streamer.textures[index];
+	const Asset_Toc_Entry *entry = g_assets.texture_entries[index];
+	const char *data = stored ? decode_asset_entry(stored, entry, &t->arena) : NULL;
+	if (!data) {
+		mem_destroy_scratch(&t->arena);
+		atomic_store(&t->state, STREAM_FAILED);
+		return;
+	}
+	const Asset_Texture *at = (const Asset_Texture *)data;
+	assert(at->num_levels > 0 && at->num_levels <= ASSET_MAX_TEXTURE_LEVELS);
+	bool bc3 = at->format == ASSET_TEXTURE_BC3;
+	t->format = bc3 ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+	t->width = at->width;
+	t->height = at->height;
+	t->num_levels = at->num_levels;
+	t->next_level = 0;
+	for (uint32_t i = 0; i < at->num_levels; ++i) {
+		const Asset_Texture_Level *level = &at->levels[i];
+		assert(level->offset + level->size <= entry->uncompressed_size);
+		t->levels[i] = { level->width, level->height, 0, data + level->offset, level->size };
+	}
+	if (g_gl_caps.s3tc) {
+		atomic_store(&t->state, STREAM_DECODED);
+		return;
+	}
+	// No S3TC in the driver, so decode here rather than on the render thread. Blocks are written out whole, so each level is
+	// rounded up to whole blocks.
+	t->format = GL_RGBA8;
+	size_t block_size = bc3 ? BC3_BLOCK_SIZE : BC1_BLOCK_SIZE;
+	for (uint32_t i = 0; i < t->num_levels; ++i) {
+		Stream_Texture_Level *level = &t->levels[i];
+		uint32_t blocks_x = (level->width + 3) / 4, blocks_y = (level->height + 3) / 4;
+		level->row_pixels = blocks_x * 4;
+		uint8_t *rgba = mem_alloc_array(uint8_t, (size_t)level->row_pixels * blocks_y * 4 * 4, &t->arena);
+		uint8_t block[16 * 4];
+		for (uint32_t by = 0; by < blocks_y; ++by) {
+			for (uint32_t bx = 0; bx < blocks_x; ++bx) {
+				const uint8_t *in = (const uint8_t *)level->data + ((size_t)by * blocks_x + bx) * block_size;
+				if (bc3)
+					bc3_decode_block(in, block);
+				else
+					bc1_decode_block(in, block);
+				for (uint32_t row = 0; row < 4; ++row)
+					__builtin_memcpy(&rgba[(((size_t)by*4 + row) * level->row_pixels + bx*4) * 4], &block[row * 16], 16);
+			}
+		}
+		level->data = (const char *)rgba;
+		level->size = (size_t)level->row_pixels * level->height * 4;
+	}
+	atomic_store(&t->state, STREAM_DECODED);
+}
+
+struct Stream_Texture_Decode {
+	const uint32_t *indices;
+	char **stored;
+};
 
-	size_t asset_id = get_mesh_tex_asset_id(mtex_table_ind);
-	if (g_assets.lookup_table[asset_id])
-		return *(GLuint *)g_assets.lookup_table[asset_id];
-
-	GLuint tex_id;
-	glGenTextures(1, &tex_id);
-	glActiveTexture(gl_tex_unit);
-	Asset_File_Header af_header;
-	File_Handle af_handle = platform_open_file("assets.ahh", "");
-	DEFER(platform_close_file(af_handle));
-	platform_read(af_handle, sizeof(Asset_File_Header), &af_header);
-	uint32_t af_tex_offset;
-	platform_file_seek(af_handle, af_header.mesh_texture_table_offset + sizeof(uint32_t)*mtex_table_ind);
-	platform_read(af_handle, sizeof(uint32_t), &af_tex_offset);
-	platform_file_seek(af_handle, af_tex_offset);
-	uint8_t bytes_per_pixel;
-	int w, h, pitch;
-	platform_read(af_handle, sizeof(bytes_per_pixel), &bytes_per_pixel);
-	platform_read(af_handle, sizeof(w), &w);
-	platform_read(af_handle, sizeof(h), &h);
-	platform_read(af_handle, sizeof(pitch), &pitch);
-	size_t nbytes = h * pitch;
-	char *pixels = mem_alloc_array(char, nbytes, arena);
-	DEFER(mem_free(arena, pixels));
-	platform_read(af_handle, nbytes, pixels);
-	GLint format = bytes_per_pixel == 4 ? GL_RGBA : GL_RGB;
-	glBindTexture(GL_TEXTURE_2D, tex_id);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format, GL_UNSIGNED_BYTE, pixels);
-	glGenerateMipmap(GL_TEXTURE_2D);
-	glBindTexture(GL_TEXTURE_2D, 0);
-
-	g_assets.mesh_textures[mtex_table_ind] = tex_id;
-	g_assets.lookup_table[asset_id] = &g_assets.mesh_textures[mtex_table_ind];
-	return tex_id;
+// Job over a range of a model's claimed textures.
+static void
+stream_decode_textures(void *data, uint32_t begin, uint32_t end)
+{
+	Stream_Texture_Decode *d = (Stream_Texture_Decode *)data;
+	for (uint32_t i = begin; i < end; ++i)
+		stream_decode_texture(d->indices[i], d->stored[i]);
 }
 
+constexpr unsigned STREAM_IO_QUEUE_DEPTH = ASSET_READ_BATCH_SIZE;
+
+// Worker side. The model and its mesh table are read in one batch, then every texture this worker claims in a second one.
+static void
+stream_decode_model(Platform_Async_Io *io, Model_ID id)
+{
+	Stream_Model *s = &g_streamer.models[id];
+	const Asset_Toc_Entry *model_entry = g_assets.model_entries[id], *mesh_entry = g_assets.mesh_entries[id];
+	if (!model_entry || !mesh_entry) {
+		zerror("model %d is not in the asset file", id);
+		atomic_store(&s->state, STREAM_FAILED);
+		return;
+	}
+	s->arena = mem_make_arena();
+	s->scratch = mem_make_scratch();
+	MEM_NAME_ARENA(&s->arena, "stream model");
+	MEM_NAME_ARENA(&s->scratch, "stream model scratch");
+	const Asset_Toc_Entry *entries[] = { model_entry, mesh_entry };
+	Scratch_Arena *arenas[] = { &s->scratch, &s->scratch };
+	char *stored[2];
+	read_asset_entries(io, g_assets.file_handle, entries, arenas, stored, 2);
+	const char *model_data = stored[0] ? decode_asset_entry(stored[0], model_entry, &s->scratch) : NULL;
+	const Asset_Mesh_Table *mesh_table = stored[1] ? (const Asset_Mesh_Table *)decode_asset_entry(stored[1], mesh_entry, &s->scratch) : NULL;
+	if (!model_data || !mesh_table) {
+		zerror("could not load model %d", id);
+		mem_destroy_arena(&s->arena);
+		mem_destroy_scratch(&s->scratch);
+		atomic_store(&s->state, STREAM_FAILED);
+		return;
+	}
+	const Asset_Model *am = (const Asset_Model *)model_data;
+	assert(am->indices_offset + sizeof(GLuint)*am->num_indices <= model_entry->uncompressed_size);
+	assert(sizeof(Asset_Mesh_Table) + sizeof(Asset_Mesh)*mesh_table->num_meshes <= mesh_entry->uncompressed_size);
+	// Vertices and indices are used in place, either in the mapping or in the decompressed copy.
+	uint32_t num_meshes = mesh_table->num_meshes;
+	s->num_vertices = am->num_vertices;
+	s->num_indices = am->num_indices;
+	s->vertices = (const Model_Vertex *)(model_data + am->vertices_offset);
+	s->indices = (const GLuint *)(model_data + am->indices_offset);
+
+	Model_Asset *model = (Model_Asset *)mem_push(sizeof(Model_Asset) + (sizeof(Textured_Mesh)*num_meshes), &s->arena);
+	model->id = id;
+	model->num_meshes = num_meshes;
+	model->bounds = to_bounds(am->bounds);
+	uint32_t *mesh_num_indices = mem_alloc_array(uint32_t, num_meshes, &s->scratch);
+	uint32_t *mesh_first_index = mem_alloc_array(uint32_t, num_meshes, &s->scratch);
+	s->diffuse_textures = mem_alloc_array(uint32_t, num_meshes, &s->scratch);
+	s->specular_textures = mem_alloc_array(uint32_t, num_meshes, &s->scratch);
+	uint32_t *claimed = mem_alloc_array(uint32_t, 2*num_meshes, &s->scratch);
+	unsigned num_claimed = 0;
+	for (uint32_t i = 0; i < num_meshes; ++i) {
+		const Asset_Mesh *am_mesh = &mesh_table->meshes[i];
+		model->meshes[i].num_indices = am_mesh->num_indices;
+		model->meshes[i].first_index = am_mesh->first_index;
+		model->meshes[i].bounds = to_bounds(am_mesh->bounds);
+		mesh_num_indices[i] = am_mesh->num_indices;
+		mesh_first_index[i] = am_mesh->first_index;
+		s->diffuse_textures[i] = am_mesh->diffuse_texture;
+		s->specular_textures[i] = am_mesh->specular_texture;
+		if (am_mesh->diffuse_texture != ASSET_NO_TEXTURE && stream_claim_texture(am_mesh->diffuse_texture))
+			claimed[num_claimed++] = am_mesh->diffuse_texture;
+		if (am_mesh->specular_texture != ASSET_NO_TEXTURE && stream_claim_texture(am_mesh->specular_texture))
+			claimed[num_claimed++] = am_mesh->specular_texture;
+	}
+	if (num_claimed > 0) {
+		const Asset_Toc_Entry **texture_entries = mem_alloc_array(const Asset_Toc_Entry *, num_claimed, &s->scratch);
+		Scratch_Arena **texture_arenas = mem_alloc_array(Scratch_Arena *, num_claimed, &s->scratch);
+		char **texture_data = mem_alloc_array(char *, num_claimed, &s->scratch);
+		for (unsigned i = 0; i < num_claimed; ++i) {
+			texture_entries[i] = g_assets.texture_entries[claimed[i]];
+			texture_arenas[i] = &g_streamer.textures[claimed[i]].arena;
+		}
+		read_asset_entries(io, g_assets.file_handle, texture_entries, texture_arenas, texture_data, num_claimed);
+		Stream_Texture_Decode decode = { claimed, texture_data };
+		parallel_for(stream_decode_textures, &decode, num_claimed, 1);
+	}
+	model->bvh = make_mesh_bvh(s->vertices[0].position, sizeof(Model_Vertex), s->indices, mesh_num_indices, mesh_first_index, num_meshes, &s->arena, &s->scratch);
+	s->model = model;
+	atomic_store(&s->state, STREAM_DECODED);
+}
+
+static void
+stream_worker(void *)
+{
+	job_register_thread(JOB_BACKGROUND);
+	Platform_Async_Io io;
+	if (!platform_init_async_io(&io, STREAM_IO_QUEUE_DEPTH))
+		zabort("could not set up async file io for a stream worker");
+	debug_print("stream worker reading through %s\n", platform_async_io_backend(&io));
+	for (;;) {
+		platform_wait_semaphore(&g_streamer.queue_sem);
+		spin_lock(&g_streamer.queue_lock);
+		Model_ID id = g_streamer.queue[g_streamer.next_queued++];
+		spin_unlock(&g_streamer.queue_lock);
+		stream_decode_model(&io, id);
+	}
+}
+
+// Call once the GL caps are known, the workers decode for whichever texture path the driver supports.
+void
+stream_init()
+{
+	uint32_t num_textures = g_assets.header->num_mesh_textures;
+	g_streamer.textures = mem_alloc_array(Stream_Texture, num_textures, &g_static_render_memory);
+	for (uint32_t i = 0; i < num_textures; ++i)
+		g_streamer.textures[i].state = STREAM_NOT_LOADED;
+	platform_init_semaphore(&g_streamer.queue_sem, 0);
+	glGenBuffers(1, &g_streamer.pbo);
+	unsigned num_workers = _max(_min(platform_get_processor_count() - 1, MAX_STREAM_WORKERS), 1u);
+	for (unsigned i = 0; i < num_workers; ++i)
+		platform_create_thread(stream_worker, NULL);
+}
+
+// Returns the model if it's resident, otherwise NULL. The first call for a model queues it for loading.
 Model_Asset *
 get_model(Model_ID id)
 {
-	if (g_assets.lookup_table[id])
-		return (Model_Asset *)g_assets.lookup_table[id];
-	TIMED_BLOCK(load_model_from_disk);
-	// TODO: store this header instead of reading it in everytime.
-	Asset_File_Header af_header;
-	File_Handle af_handle = platform_open_file("assets.ahh", "");
-	DEFER(platform_close_file(af_handle));
-	platform_read(af_handle, sizeof(Asset_File_Header), &af_header);
-
-	Memory_Arena load_arena = mem_make_arena();
-	DEFER(mem_destroy_arena(&load_arena));
-	uint32_t af_model_ofs, num_verts, num_indices, num_meshes; 
-	platform_file_seek(af_handle, af_header.named_asset_offsets[id]);
-	platform_read(af_handle, sizeof(uint32_t), &num_verts);
-	float *vert_buf = mem_alloc_array(float, num_verts, &load_arena);
-	platform_read(af_handle, sizeof(uint32_t), &num_indices);
-	unsigned *ind_buf = mem_alloc_array(unsigned, num_indices, &load_arena);
-	platform_read(af_handle, sizeof(Model_Vertex)*num_verts, vert_buf);
-	platform_read(af_handle, sizeof(uint32_t)*num_indices, ind_buf);
-	platform_read(af_handle, sizeof(uint32_t), &num_meshes);
-
-	Model_Asset *model = (Model_Asset *)mem_push(sizeof(Model_Asset) + (sizeof(Textured_Mesh)*num_meshes), &g_assets.models);
-	model->num_meshes = num_meshes;
+	Stream_Model *s = &g_streamer.models[id];
+	uint32_t state = atomic_load(&s->state);
+	if (state == STREAM_RESIDENT)
+		return s->model;
+	if (state == STREAM_NOT_LOADED) {
+		atomic_store(&s->state, STREAM_LOADING);
+		s->requested = platform_get_time();
+		spin_lock(&g_streamer.queue_lock);
+		g_streamer.queue[g_streamer.num_queued++] = id;
+		spin_unlock(&g_streamer.queue_lock);
+		platform_post_semaphore(&g_streamer.queue_sem);
+	}
+	return NULL;
+}
 
-	for (int i = 0; i < num_meshes; ++i) {
-		// TODO: Should these be 32 bit or 64 bit?
-		uint32_t diff_index, spec_index;
-		platform_read(af_handle, sizeof(uint32_t), &model->meshes[i].num_indices);
-		platform_read(af_handle, sizeof(uint32_t), &model->meshes[i].base_vertex);
-		platform_read(af_handle, sizeof(uint32_t), &spec_index);
-		platform_read(af_handle, sizeof(uint32_t), &diff_index);
-		model->meshes[i].specular_id = get_mesh_texture(spec_index, GL_TEXTURE1, &load_arena);
-		model->meshes[i].diffuse_id = get_mesh_texture(diff_index, GL_TEXTURE0, &load_arena);
-/*
-		if (diffuse_asset_id == (uint64_t)-1) {
-			g_models.back().notex_meshes.emplace_back(mesh_num_indices, mesh_base_vert);
-			continue;
-		}
-		// We use texture target zero if we can't get a specular texture, which opengl says is "the default texture" in that texture unit.
-		// Is that ok? (I think so).
-		g_models.back().tex_meshes.emplace_back(mesh_num_indices, mesh_base_vert, get_tex_id(diffuse_asset_id, GL_TEXTURE0), get_tex_id(specular_asset_id, GL_TEXTURE1));
-*/
+static void
+upload_texture_level(Stream_Texture *t, uint32_t i, const void *pixels)
+{
+	const Stream_Texture_Level *level = &t->levels[i];
+	if (i == 0) {
+		glGenTextures(1, &t->id);
+		gl_bind_texture(GL_TEXTURE0, t->id);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, t->num_levels - 1);
+		if (g_gl_caps.texture_storage)
+			glTexStorage2D(GL_TEXTURE_2D, t->num_levels, t->format, t->width, t->height);
+	} else {
+		gl_bind_texture(GL_TEXTURE0, t->id);
+	}
+	if (t->format != GL_RGBA8) {
+		if (g_gl_caps.texture_storage)
+			glCompressedTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, level->width, level->height, t->format, level->size, pixels);
+		else
+			glCompressedTexImage2D(GL_TEXTURE_2D, i, t->format, level->width, level->height, 0, level->size, pixels);
+		return;
 	}
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, level->row_pixels);
+	if (g_gl_caps.texture_storage)
+		glTexSubImage2D(GL_TEXTURE_2D, i, 0, 0, level->width, level->height, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	else
+		glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA8, level->width, level->height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixels);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
 
-	// TODO: Worth it to load these up front?
-	GLuint ebo;
-	glGenVertexArrays(1, &model->vao);
-	glGenBuffers(1, &model->vbo);
-	glGenBuffers(1, &ebo);
-	glBindVertexArray(model->vao);
-	glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
-	glBufferData(GL_ARRAY_BUFFER, num_verts*sizeof(Model_Vertex), vert_buf, GL_STATIC_DRAW);
-
-	// TODO: Change these to offsetof()s.
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Model_Vertex), (GLvoid *)0);
-	glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Model_Vertex), (GLvoid *)(sizeof(GLfloat)*3));
-	glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Model_Vertex), (GLvoid*)(sizeof(GLfloat)*6));
+static GLuint
+get_stream_texture_id(uint32_t index)
+{
+	if (index == ASSET_NO_TEXTURE)
+		return 0;
+	// Failed textures are drawn with texture 0, like a mesh without one.
+	return atomic_load(&g_streamer.textures[index].state) == STREAM_RESIDENT ? g_streamer.textures[index].id : 0;
+}
 
-	glEnableVertexAttribArray(0);
-	glEnableVertexAttribArray(1);
-	glEnableVertexAttribArray(2);
+static bool
+stream_texture_done(uint32_t index)
+{
+	if (index == ASSET_NO_TEXTURE)
+		return true;
+	uint32_t state = atomic_load(&g_streamer.textures[index].state);
+	return state == STREAM_RESIDENT || state == STREAM_FAILED;
+}
 
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_indices*sizeof(GLuint), ind_buf, GL_STATIC_DRAW);
+static void
+stream_make_resident(Model_ID id)
+{
+	Stream_Model *s = &g_streamer.models[id];
+	Model_Asset *model = s->model;
+	for (GLuint i = 0; i < model->num_meshes; ++i) {
+		model->meshes[i].diffuse_id = get_stream_texture_id(s->diffuse_textures[i]);
+		model->meshes[i].specular_id = get_stream_texture_id(s->specular_textures[i]);
+	}
+	mem_destroy_scratch(&s->scratch);
+	atomic_store(&s->state, STREAM_RESIDENT);
+	// Instances added while the model was loading go into the scene now.
+	for (Model_Instance *inst = g_model_instances[id]; inst; inst = inst->next) {
+		if (inst->bvh_proxy < 0)
+			inst->bvh_proxy = bvh_insert(&g_scene_bvh, transform_aabb(model->bounds.center, model->bounds.extents, transform_world(&g_instance_transforms, inst->transform)), inst);
+	}
+	++g_streamer.num_made_resident;
+	g_streamer.max_resident_us = _max(g_streamer.max_resident_us, platform_time_diff(s->requested, platform_get_time(), 1000));
+}
 
-	glBindVertexArray(0);
-	g_assets.lookup_table[id] = model;
-	return model;
+// Render thread side. Uploads what the workers have finished, up to STREAM_UPLOAD_BUDGET bytes. Texture levels are staged in
+// the pixel unpack buffer, which is orphaned every frame so the driver never has to wait for last frame's copies. A level too
+// big for the buffer goes up directly, on its own, in a frame of its own.
+void
+stream_update()
+{
+	struct Staged_Level {
+		Stream_Texture *texture;
+		uint32_t level;
+		size_t offset;
+	};
+	Staged_Level staged[MAX_STREAM_LEVELS_PER_FRAME];
+	size_t num_staged = 0, budget_used = 0;
+	char *staging = NULL;
+	uint32_t num_textures = g_assets.header->num_mesh_textures;
+	for (uint32_t i = 0; i < num_textures; ++i) {
+		Stream_Texture *t = &g_streamer.textures[i];
+		if (atomic_load(&t->state) != STREAM_DECODED)
+			continue;
+		for (; t->next_level < t->num_levels; ++t->next_level) {
+			const Stream_Texture_Level *level = &t->levels[t->next_level];
+			size_t offset = (budget_used + 63) & ~(size_t)63;
+			if (level->size > STREAM_UPLOAD_BUDGET && budget_used == 0) {
+				upload_texture_level(t, t->next_level, level->data);
+				budget_used = STREAM_UPLOAD_BUDGET;
+				continue;
+			}
+			if (offset + level->size > STREAM_UPLOAD_BUDGET || num_staged == MAX_STREAM_LEVELS_PER_FRAME)
+				break;
+			if (!staging) {
+				gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, g_streamer.pbo);
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, STREAM_UPLOAD_BUDGET, NULL, GL_STREAM_DRAW);
+				staging = (char *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, STREAM_UPLOAD_BUDGET, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+			}
+			__builtin_memcpy(staging + offset, level->data, level->size);
+			staged[num_staged++] = { t, t->next_level, offset };
+			budget_used = offset + level->size;
+		}
+		if (budget_used >= STREAM_UPLOAD_BUDGET || num_staged == MAX_STREAM_LEVELS_PER_FRAME)
+			break;
+	}
+	if (staging) {
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		// With a buffer bound to GL_PIXEL_UNPACK_BUFFER, the pixel pointer is an offset into it.
+		for (size_t i = 0; i < num_staged; ++i)
+			upload_texture_level(staged[i].texture, staged[i].level, (const void *)staged[i].offset);
+		gl_bind_buffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	}
+	gl_bind_texture(GL_TEXTURE0, 0);
+	// Everything up to next_level has been copied out by now, so the decoded levels can go.
+	for (uint32_t i = 0; i < num_textures; ++i) {
+		Stream_Texture *t = &g_streamer.textures[i];
+		if (atomic_load(&t->state) == STREAM_DECODED && t->next_level == t->num_levels) {
+			mem_destroy_scratch(&t->arena);
+			atomic_store(&t->state, STREAM_RESIDENT);
+		}
+	}
+
+	for (int id = 0; id < NUM_MODEL_IDS; ++id) {
+		Stream_Model *s = &g_streamer.models[id];
+		if (atomic_load(&s->state) != STREAM_DECODED)
+			continue;
+		if (!s->geometry_uploaded) {
+			size_t size = sizeof(Model_Vertex)*s->num_vertices + sizeof(GLuint)*s->num_indices;
+			if (budget_used > 0 && budget_used + size > STREAM_UPLOAD_BUDGET)
+				continue;
+			GLuint model_first_index;
+			geometry_pool_add(s->vertices, s->num_vertices, s->indices, s->num_indices, &s->model->base_vertex, &model_first_index);
+			for (GLuint i = 0; i < s->model->num_meshes; ++i)
+				s->model->meshes[i].first_index += model_first_index;
+			s->geometry_uploaded = true;
+			budget_used += size;
+		}
+		bool textures_done = true;
+		for (GLuint i = 0; i < s->model->num_meshes; ++i)
+			textures_done = textures_done && stream_texture_done(s->diffuse_textures[i]) && stream_texture_done(s->specular_textures[i]);
+		if (textures_done)
+			stream_make_resident((Model_ID)id);
+	}
 }
 
 /*
@@ -520,60 +1119,420 @@ pack_font(const FT_Library &ft, const char *font_path, const Vec2u tex_dim, cons
 }
 */
 
+// Render queue.
+// Draws get pushed into a per-frame command buffer, each with a 64-bit sort key. Before submission the commands are sorted
+// so that commands sharing GL state end up next to each other and binds only happen when a key field changes.
+//
+// Key layout, most significant bits first (the fields most expensive to change go highest):
+//   program (8) | diffuse texture (11) | specular texture (11) | model (10) | mesh index (8) | depth bucket (16)
+// Every model lives in the geometry pool, so the model isn't GL state. It sits below the textures so that meshes of different
+// models that share textures land in the same multi-draw.
+
+constexpr int SORT_KEY_DEPTH_BITS = 16;
+constexpr int SORT_KEY_MESH_BITS = 8;
+constexpr int SORT_KEY_MODEL_BITS = 10;
+constexpr int SORT_KEY_SPECULAR_BITS = 11;
+constexpr int SORT_KEY_DIFFUSE_BITS = 11;
+constexpr int SORT_KEY_PROGRAM_BITS = 8;
+
+constexpr int SORT_KEY_DEPTH_SHIFT = 0;
+constexpr int SORT_KEY_MESH_SHIFT = SORT_KEY_DEPTH_SHIFT + SORT_KEY_DEPTH_BITS;
+constexpr int SORT_KEY_MODEL_SHIFT = SORT_KEY_MESH_SHIFT + SORT_KEY_MESH_BITS;
+constexpr int SORT_KEY_SPECULAR_SHIFT = SORT_KEY_MODEL_SHIFT + SORT_KEY_MODEL_BITS;
+constexpr int SORT_KEY_DIFFUSE_SHIFT = SORT_KEY_SPECULAR_SHIFT + SORT_KEY_SPECULAR_BITS;
+constexpr int SORT_KEY_PROGRAM_SHIFT = SORT_KEY_DIFFUSE_SHIFT + SORT_KEY_DIFFUSE_BITS;
+static_assert(SORT_KEY_PROGRAM_SHIFT + SORT_KEY_PROGRAM_BITS == 64, "sort key fields must fill 64 bits");
+
+#define SORT_KEY_FIELD(key, field) (GLuint)(((key) >> SORT_KEY_##field##_SHIFT) & ((1ull << SORT_KEY_##field##_BITS) - 1))
+// Commands with equal state bits can share a multi-draw, commands with equal batch bits can share an instanced draw.
+#define SORT_KEY_STATE_BITS(key) ((key) >> SORT_KEY_SPECULAR_SHIFT)
+#define SORT_KEY_BATCH_BITS(key) ((key) >> SORT_KEY_MESH_SHIFT)
+
+constexpr size_t MAX_RENDER_COMMANDS = 1 << 20;
+constexpr size_t MAX_RENDER_TRANSFORMS = 1 << 18;
+
+struct Render_Command {
+	uint64_t key;
+	const Textured_Mesh *mesh;
+	uint32_t transform;
+	GLint base_vertex;
+};
+
+// Layout is fixed by GL.
+struct Draw_Elements_Indirect_Command {
+	GLuint count;
+	GLuint instance_count;
+	GLuint first_index;
+	GLint base_vertex;
+	GLuint base_instance;
+};
+
+struct Render_Queue {
+	Render_Command *commands;
+	Render_Command *sort_buffer;
+	Mat3x4 *transforms;
+	Draw_Elements_Indirect_Command *batches;
+	uint64_t *batch_keys;
+	size_t num_commands;
+	size_t num_transforms;
+};
+
+// Reset every frame by render_sim(). The saved counts are the binds we would have made if every command set its own state.
+struct Render_Stats {
+	size_t num_instances_drawn;
+	size_t num_instances_culled;
+	size_t num_meshes_drawn;
+	size_t num_meshes_culled;
+	size_t num_commands;
+	size_t num_draw_calls;
+	size_t num_state_changes;
+	size_t num_state_changes_saved;
+	size_t num_transforms_updated;
+};
+
+static Render_Queue g_render_queue;
+Render_Stats g_render_stats;
+
+struct Instance_Buffer {
+	GLuint vbo;
+	size_t capacity;
+};
+
+// Holds the model matrices of every command in the frame, in sorted order.
+static Instance_Buffer g_instance_buffer;
+static GLuint g_indirect_buffer;
+static size_t g_indirect_buffer_capacity;
+static float g_far_plane;
+
+inline uint64_t
+make_sort_key(GLuint program, GLuint diffuse, GLuint specular, GLuint model, GLuint mesh, GLuint depth)
+{
+	assert(program < (1u << SORT_KEY_PROGRAM_BITS) && model < (1u << SORT_KEY_MODEL_BITS));
+	assert(diffuse < (1u << SORT_KEY_DIFFUSE_BITS) && specular < (1u << SORT_KEY_SPECULAR_BITS));
+	assert(mesh < (1u << SORT_KEY_MESH_BITS) && depth < (1u << SORT_KEY_DEPTH_BITS));
+	return ((uint64_t)program << SORT_KEY_PROGRAM_SHIFT)
+	     | ((uint64_t)diffuse << SORT_KEY_DIFFUSE_SHIFT)
+	     | ((uint64_t)specular << SORT_KEY_SPECULAR_SHIFT)
+	     | ((uint64_t)model << SORT_KEY_MODEL_SHIFT)
+	     | ((uint64_t)mesh << SORT_KEY_MESH_SHIFT)
+	     | ((uint64_t)depth << SORT_KEY_DEPTH_SHIFT);
+}
+
+// Quantizes view space distance so that opaque draws with the same state go front to back.
+inline GLuint
+depth_bucket(const Mat3x4 &transform)
+{
+	Mat4 view = g_matrices.view;
+	float z = view[2]*transform.m[3] + view[6]*transform.m[7] + view[10]*transform.m[11] + view[14];
+	float d = -z / g_far_plane;
+	if (d <= 0.0f)
+		return 0;
+	if (d >= 1.0f)
+		return (1 << SORT_KEY_DEPTH_BITS) - 1;
+	return (GLuint)(d * ((1 << SORT_KEY_DEPTH_BITS) - 1));
+}
+
+void
+render_queue_init()
+{
+	g_render_queue.commands = mem_alloc_array(Render_Command, MAX_RENDER_COMMANDS, &g_static_render_memory);
+	g_render_queue.sort_buffer = mem_alloc_array(Render_Command, MAX_RENDER_COMMANDS, &g_static_render_memory);
+	g_render_queue.transforms = mem_alloc_array(Mat3x4, MAX_RENDER_TRANSFORMS, &g_static_render_memory);
+	g_render_queue.batches = mem_alloc_array(Draw_Elements_Indirect_Command, MAX_RENDER_COMMANDS, &g_static_render_memory);
+	g_render_queue.batch_keys = mem_alloc_array(uint64_t, MAX_RENDER_COMMANDS, &g_static_render_memory);
+	g_render_queue.num_commands = 0;
+	g_render_queue.num_transforms = 0;
+
+	glGenBuffers(1, &g_indirect_buffer);
+	g_indirect_buffer_capacity = 0;
+
+	// The instance matrix is a Mat3x4, passed as three vec4 attributes, one per row. The indirect path picks each batch's range
+	// out of the buffer with base_instance; the fallback path moves these pointers per batch instead.
+	glGenBuffers(1, &g_instance_buffer.vbo);
+	g_instance_buffer.capacity = 0;
+	gl_bind_vertex_array(g_geometry_pool.vao);
+	gl_bind_buffer(GL_ARRAY_BUFFER, g_instance_buffer.vbo);
+	for (int i = 0; i < 3; ++i) {
+		glVertexAttribPointer(3 + i, 4, GL_FLOAT, GL_FALSE, sizeof(Mat3x4), (GLvoid *)(sizeof(Vec4f) * i));
+		glVertexAttribDivisor(3 + i, 1);
+		glEnableVertexAttribArray(3 + i);
+	}
+	gl_bind_vertex_array(0);
+}
+
+// Queues one command per mesh of the model, skipping meshes whose mesh_visible entry is false if it's given.
+// The transform is copied, so it only has to live until the call returns.
+void
+render_push_model(Model_Asset *model, const Mat3x4 &transform, const bool *mesh_visible = NULL)
+{
+	Render_Queue *q = &g_render_queue;
+	if (q->num_transforms == MAX_RENDER_TRANSFORMS || q->num_commands + model->num_meshes > MAX_RENDER_COMMANDS) {
+		zerror("render queue is full");
+		return;
+	}
+	uint32_t transform_ind = q->num_transforms++;
+	q->transforms[transform_ind] = transform;
+	GLuint program = g_instanced_rendering ? g_shaders.textured_mesh_instanced : g_shaders.textured_mesh;
+	GLuint depth = depth_bucket(transform);
+	for (GLuint i = 0; i < model->num_meshes; ++i) {
+		if (mesh_visible && !mesh_visible[i])
+			continue;
+		Render_Command *c = &q->commands[q->num_commands++];
+		c->key = make_sort_key(program, model->meshes[i].diffuse_id, model->meshes[i].specular_id, model->id, i, depth);
+		c->mesh = &model->meshes[i];
+		c->transform = transform_ind;
+		c->base_vertex = model->base_vertex;
+	}
+}
+
+// LSD radix sort on the full 64-bit key, eight bits per pass. Returns whichever of the two buffers holds the sorted result.
+static Render_Command *
+radix_sort(Render_Command *cmds, Render_Command *tmp, size_t n)
+{
+	size_t counts[8][256] = {};
+	for (size_t i = 0; i < n; ++i) {
+		uint64_t k = cmds[i].key;
+		for (int b = 0; b < 8; ++b)
+			++counts[b][(k >> (b * 8)) & 0xFF];
+	}
+	Render_Command *src = cmds, *dst = tmp;
+	for (int b = 0; b < 8; ++b) {
+		int shift = b * 8;
+		// Every key has the same byte here, so the pass wouldn't move anything.
+		if (n == 0 || counts[b][(src[0].key >> shift) & 0xFF] == n)
+			continue;
+		size_t ofs = 0;
+		for (int d = 0; d < 256; ++d) {
+			size_t c = counts[b][d];
+			counts[b][d] = ofs;
+			ofs += c;
+		}
+		for (size_t i = 0; i < n; ++i)
+			dst[counts[b][(src[i].key >> shift) & 0xFF]++] = src[i];
+		Render_Command *t = src;
+		src = dst;
+		dst = t;
+	}
+	return src;
+}
+
+// Writes the transforms of the sorted commands into the instance buffer, so that a run of commands is a contiguous range.
+static bool
+fill_instance_buffer(const Render_Command *cmds, size_t n)
+{
+	gl_bind_buffer(GL_ARRAY_BUFFER, g_instance_buffer.vbo);
+	if (n > g_instance_buffer.capacity) {
+		g_instance_buffer.capacity = n * 2;
+		glBufferData(GL_ARRAY_BUFFER, g_instance_buffer.capacity*sizeof(Mat3x4), NULL, GL_STREAM_DRAW);
+	}
+	// Invalidating lets the driver hand us fresh storage instead of stalling on last frame's draws.
+	Mat3x4 *dst = (Mat3x4 *)glMapBufferRange(GL_ARRAY_BUFFER, 0, n*sizeof(Mat3x4), GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	if (!dst) {
+		zerror("failed to map instance buffer");
+		return false;
+	}
+	for (size_t i = 0; i < n; ++i)
+		dst[i] = g_render_queue.transforms[cmds[i].transform];
+	glUnmapBuffer(GL_ARRAY_BUFFER);
+	return true;
+}
+
+// Collapses each run of sorted commands that draw the same mesh with the same state into one indirect draw command.
+// Run i covers instances [base_instance, base_instance + instance_count) of the instance buffer.
+static size_t
+build_batches(const Render_Command *cmds, size_t n)
+{
+	Render_Queue *q = &g_render_queue;
+	size_t num_batches = 0;
+	for (size_t i = 0; i < n;) {
+		size_t run_end = i + 1;
+		while (run_end < n && SORT_KEY_BATCH_BITS(cmds[run_end].key) == SORT_KEY_BATCH_BITS(cmds[i].key))
+			++run_end;
+		Draw_Elements_Indirect_Command *b = &q->batches[num_batches];
+		b->count = cmds[i].mesh->num_indices;
+		b->instance_count = run_end - i;
+		b->first_index = cmds[i].mesh->first_index;
+		b->base_vertex = cmds[i].base_vertex;
+		b->base_instance = i;
+		q->batch_keys[num_batches++] = cmds[i].key;
+		i = run_end;
+	}
+	return num_batches;
+}
+
+static void
+upload_batches(size_t num_batches)
+{
+	gl_bind_buffer(GL_DRAW_INDIRECT_BUFFER, g_indirect_buffer);
+	size_t nbytes = num_batches * sizeof(Draw_Elements_Indirect_Command);
+	if (nbytes > g_indirect_buffer_capacity) {
+		g_indirect_buffer_capacity = nbytes * 2;
+		glBufferData(GL_DRAW_INDIRECT_BUFFER, g_indirect_buffer_capacity, NULL, GL_STREAM_DRAW);
+	}
+	glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, nbytes, g_render_queue.batches);
+}
+
+// Binds whatever in the key's program and textures differs from the previous key. Returns the number of binds made.
+static size_t
+bind_key_state(uint64_t key, uint64_t prev_key, bool first)
+{
+	size_t num_state_changes = 0;
+	GLuint program = SORT_KEY_FIELD(key, PROGRAM), diffuse = SORT_KEY_FIELD(key, DIFFUSE), specular = SORT_KEY_FIELD(key, SPECULAR);
+	if (first || program != SORT_KEY_FIELD(prev_key, PROGRAM)) {
+		gl_use_program(program);
+		++num_state_changes;
+	}
+	if (first || diffuse != SORT_KEY_FIELD(prev_key, DIFFUSE)) {
+		gl_bind_texture(GL_TEXTURE0, diffuse);
+		++num_state_changes;
+	}
+	if (first || specular != SORT_KEY_FIELD(prev_key, SPECULAR)) {
+		gl_bind_texture(GL_TEXTURE1, specular);
+		++num_state_changes;
+	}
+	return num_state_changes;
+}
+
+// Sorts and submits everything queued this frame, then empties the queue.
+// With instancing, every run of batches that shares program and textures is a single glMultiDrawElementsIndirect. Without
+// indirect support each batch is its own instanced draw, and with instancing off each command is its own draw.
+void
+render_queue_flush()
+{
+	Render_Queue *q = &g_render_queue;
+	size_t n = q->num_commands;
+	DEFER(q->num_commands = 0; q->num_transforms = 0);
+	if (n == 0)
+		return;
+	Render_Command *cmds = radix_sort(q->commands, q->sort_buffer, n);
+	if (g_instanced_rendering && !fill_instance_buffer(cmds, n))
+		return;
+
+	gl_bind_vertex_array(g_geometry_pool.vao);
+	size_t num_state_changes = 1; // The pool VAO.
+	if (g_instanced_rendering) {
+		size_t num_batches = build_batches(cmds, n);
+		if (g_gl_caps.multi_draw_indirect)
+			upload_batches(num_batches);
+		for (size_t i = 0; i < num_batches;) {
+			num_state_changes += bind_key_state(q->batch_keys[i], i ? q->batch_keys[i - 1] : 0, i == 0);
+			size_t group_end = i + 1;
+			while (group_end < num_batches && SORT_KEY_STATE_BITS(q->batch_keys[group_end]) == SORT_KEY_STATE_BITS(q->batch_keys[i]))
+				++group_end;
+			if (g_gl_caps.multi_draw_indirect) {
+				glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (GLvoid *)(i * sizeof(Draw_Elements_Indirect_Command)), group_end - i, 0);
+				++g_render_stats.num_draw_calls;
+			} else {
+				gl_bind_buffer(GL_ARRAY_BUFFER, g_instance_buffer.vbo);
+				for (size_t j = i; j < group_end; ++j) {
+					const Draw_Elements_Indirect_Command *b = &q->batches[j];
+					for (int k = 0; k < 3; ++k)
+						glVertexAttribPointer(3 + k, 4, GL_FLOAT, GL_FALSE, sizeof(Mat3x4), (GLvoid *)(b->base_instance*sizeof(Mat3x4) + sizeof(Vec4f)*k));
+					glDrawElementsInstancedBaseVertex(GL_TRIANGLES, b->count, GL_UNSIGNED_INT, (GLvoid *)(b->first_index * sizeof(GLuint)), b->instance_count, b->base_vertex);
+					++g_render_stats.num_draw_calls;
+				}
+			}
+			i = group_end;
+		}
+	} else {
+		for (size_t i = 0; i < n; ++i) {
+			num_state_changes += bind_key_state(cmds[i].key, i ? cmds[i - 1].key : 0, i == 0);
+			Mat4 model = to_mat4(q->transforms[cmds[i].transform]);
+			glUniformMatrix4fv(g_uniform_locs.textured_mesh.model, 1, GL_FALSE, model.m);
+			glDrawElementsBaseVertex(GL_TRIANGLES, cmds[i].mesh->num_indices, GL_UNSIGNED_INT, (GLvoid *)(cmds[i].mesh->first_index * sizeof(GLuint)), cmds[i].base_vertex);
+			++g_render_stats.num_draw_calls;
+		}
+	}
+	// Program, VAO and two texture binds per command if nothing was shared.
+	g_render_stats.num_commands += n;
+	g_render_stats.num_state_changes += num_state_changes;
+	g_render_stats.num_state_changes_saved += (n * 4) - num_state_changes;
+}
+
+constexpr uint32_t CULL_INSTANCES_PER_JOB = 64;
+
+// Scratch space for culling. Instances come out of the scene BVH, then their meshes are culled in parallel, a batch of instances
+// per job, into one flag per mesh. The render queue is filled afterwards on the render thread, in BVH order. The flags and their
+// offsets come from the frame arena, sized to what's visible.
+struct Cull_Scratch {
+	Model_Instance **instances;
+	uint32_t *first_mesh; // Where each instance's flags start in mesh_visible.
+	bool *mesh_visible;
+	Frustum frustum;
+	volatile uint32_t num_meshes_visible;
+};
+
+static Cull_Scratch g_cull_scratch;
+
+void
+cull_scratch_init()
+{
+	g_cull_scratch.instances = mem_alloc_array(Model_Instance *, MAX_RENDER_TRANSFORMS, &g_static_render_memory);
+}
+
 void
 render_update_view(const Camera &cam)
 {
 	g_matrices.view = view_matrix(cam.pos, cam.front);
 
-	glBindBuffer(GL_UNIFORM_BUFFER, g_ubos.matrices);
+	gl_bind_buffer(GL_UNIFORM_BUFFER, g_ubos.matrices);
 	glBufferSubData(GL_UNIFORM_BUFFER, offsetof(Matrices, view), sizeof(g_matrices.view), &g_matrices.view);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 
 	// TODO: We could split this function up and avoid updating the view pos when only our facing direction changes
-	glUseProgram(g_shaders.textured_mesh);
-	glUniform3f(glGetUniformLocation(g_shaders.textured_mesh, "u_view_pos"), cam.pos.x, cam.pos.y, cam.pos.z);
-	glUseProgram(0);
+	gl_use_program(g_shaders.textured_mesh);
+	glUniform3f(g_uniform_locs.textured_mesh.view_pos, cam.pos.x, cam.pos.y, cam.pos.z);
+	gl_use_program(g_shaders.textured_mesh_instanced);
+	glUniform3f(g_uniform_locs.textured_mesh_instanced.view_pos, cam.pos.x, cam.pos.y, cam.pos.z);
 }
 
 void
 render_update_projection(const Camera &cam, const Vec2u &screen_dim)
 {
+	g_far_plane = cam.far;
 	g_matrices.perspective_proj = perspective_matrix(cam.fov, (float)screen_dim.x / (float)screen_dim.y, cam.near, cam.far);
 	g_matrices.ortho_proj = ortho_matrix(0.0f, 100.0f, 100.0f, 0.0f);
 	//g_matrices.ortho_proj = glm::ortho(0.0f, (float)screen_dim.x, (float)screen_dim.y, 0.0f);
-	glBindBuffer(GL_UNIFORM_BUFFER, g_ubos.matrices);
+	gl_bind_buffer(GL_UNIFORM_BUFFER, g_ubos.matrices);
 	// TODO: We could combine these calls (will break if Matrices changes)
 	glBufferSubData(GL_UNIFORM_BUFFER, offsetof(Matrices, perspective_proj), sizeof(g_matrices.perspective_proj), &g_matrices.perspective_proj);
 	glBufferSubData(GL_UNIFORM_BUFFER, offsetof(Matrices, ortho_proj), sizeof(g_matrices.ortho_proj), &g_matrices.ortho_proj);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
 }
 
 // Init.
 void
 render_init(const Camera &cam, const Vec2u &screen_dim)
 {
+	gl_state_init();
 	glEnable(GL_DEPTH_TEST);
 	glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
 	glViewport(0, 0, screen_dim.x, screen_dim.y);
 
-	for (int i = 0; i < NUM_MODEL_IDS; ++i) {
-		g_model_instances[i] = mem_make_arena();
-	}
+	MEM_NAME_ARENA(&g_static_render_memory, "static render");
+	bvh_init(&g_scene_bvh);
+	geometry_pool_init();
+	render_queue_init();
+	cull_scratch_init();
+	stream_init();
 
-	Memory_Arena init_arena = mem_make_arena();
-	DEFER(mem_destroy_arena(&init_arena));
+	Scratch_Mark init_mark = mem_mark(mem_frame_arena());
+	DEFER(mem_rewind(mem_frame_arena(), init_mark));
 
 	// init shaders
 	{
-		const char *vert = platform_read_entire_file("assets/shaders/shader.vert", &init_arena);
+		const char *vert = platform_read_entire_file("assets/shaders/shader.vert", mem_frame_arena());
 		assert(vert);
-		const char *frag = platform_read_entire_file("assets/shaders/shader.frag", &init_arena);
+		const char *frag = platform_read_entire_file("assets/shaders/shader.frag", mem_frame_arena());
 		assert(frag);
 
 		g_shaders.textured_mesh = make_gpu_program(vert, frag, "#define TEXTURED_MESH\n");
+		g_shaders.textured_mesh_instanced = make_gpu_program(vert, frag, "#define TEXTURED_MESH\n#define INSTANCED\n");
 		g_shaders.untextured_mesh = make_gpu_program(vert, frag, "#define UNTEXTURED_MESH\n");
 		g_shaders.ui = make_gpu_program(vert, frag, "#define UI\n");
 		g_shaders.text = make_gpu_program(vert, frag, "#define TEXT\n");
+
+		g_uniform_locs.textured_mesh = get_mesh_uniform_locs(g_shaders.textured_mesh);
+		g_uniform_locs.textured_mesh_instanced = get_mesh_uniform_locs(g_shaders.textured_mesh_instanced);
+		g_uniform_locs.untextured_mesh = get_mesh_uniform_locs(g_shaders.untextured_mesh);
 	}
 
 	auto set_bind_pt = [](const GLuint program, const char *name, const GLuint bind_pt) {
@@ -584,14 +1543,14 @@ render_init(const Camera &cam, const Vec2u &screen_dim)
 	// init matrix ubo
 	{
 		set_bind_pt(g_shaders.textured_mesh, "Matrices", 0);
+		set_bind_pt(g_shaders.textured_mesh_instanced, "Matrices", 0);
 		set_bind_pt(g_shaders.untextured_mesh, "Matrices", 0);
 		set_bind_pt(g_shaders.ui, "Matrices", 0);
 		glGenBuffers(1, &g_ubos.matrices);
 
-		glBindBuffer(GL_UNIFORM_BUFFER, g_ubos.matrices);
+		gl_bind_buffer(GL_UNIFORM_BUFFER, g_ubos.matrices);
 		glBufferData(GL_UNIFORM_BUFFER, sizeof(Matrices), 0, GL_STATIC_DRAW);
-		//glBindBuffer(GL_UNIFORM_BUFFER, 0);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 0, g_ubos.matrices);
+		gl_bind_buffer_base(GL_UNIFORM_BUFFER, 0, g_ubos.matrices);
 
 		render_update_view(cam);
 		render_update_projection(cam, screen_dim);
@@ -600,6 +1559,7 @@ render_init(const Camera &cam, const Vec2u &screen_dim)
 	// init light ubo
 	{
 		set_bind_pt(g_shaders.textured_mesh, "Lights", 1);
+		set_bind_pt(g_shaders.textured_mesh_instanced, "Lights", 1);
 		set_bind_pt(g_shaders.untextured_mesh, "Lights", 1);
 		glGenBuffers(1, &g_ubos.lights);
 
@@ -618,26 +1578,28 @@ render_init(const Camera &cam, const Vec2u &screen_dim)
 		for (int i = 0; i < MAX_PT_LIGHTS; ++i) {
 			g_lights.points[i].is_valid = false;
 		}
-		glBindBuffer(GL_UNIFORM_BUFFER, g_ubos.lights);
+		gl_bind_buffer(GL_UNIFORM_BUFFER, g_ubos.lights);
 		glBufferData(GL_UNIFORM_BUFFER, sizeof(Lights), &g_lights, GL_STATIC_DRAW);
-		glBindBuffer(GL_UNIFORM_BUFFER, 0);
-		glBindBufferBase(GL_UNIFORM_BUFFER, 1, g_ubos.lights);
+		gl_bind_buffer_base(GL_UNIFORM_BUFFER, 1, g_ubos.lights);
 	}
 
 	// init material uniform
 	{
-		glUseProgram(g_shaders.untextured_mesh);
-		glUniform3f(glGetUniformLocation(g_shaders.untextured_mesh, "mat.ambient"),  1.0f, 0.5f, 0.31f);
-		glUniform3f(glGetUniformLocation(g_shaders.untextured_mesh, "mat.diffuse"),  1.0f, 0.5f, 0.31f);
-		glUniform3f(glGetUniformLocation(g_shaders.untextured_mesh, "mat.specular"), 0.5f, 0.5f, 0.5f);
-		glUniform1f(glGetUniformLocation(g_shaders.untextured_mesh, "mat.shininess"), 64.0f);
-
-		glUseProgram(g_shaders.textured_mesh);
-		glUniform1i(glGetUniformLocation(g_shaders.textured_mesh, "mat.diffuse"), 0);
-		glUniform1i(glGetUniformLocation(g_shaders.textured_mesh, "mat.specular"), 1);
-		glUniform1f(glGetUniformLocation(g_shaders.textured_mesh, "mat.shininess"), 64.0f);
-
-		glUseProgram(0);
+		gl_use_program(g_shaders.untextured_mesh);
+		glUniform3f(g_uniform_locs.untextured_mesh.mat_ambient,  1.0f, 0.5f, 0.31f);
+		glUniform3f(g_uniform_locs.untextured_mesh.mat_diffuse,  1.0f, 0.5f, 0.31f);
+		glUniform3f(g_uniform_locs.untextured_mesh.mat_specular, 0.5f, 0.5f, 0.5f);
+		glUniform1f(g_uniform_locs.untextured_mesh.mat_shininess, 64.0f);
+
+		gl_use_program(g_shaders.textured_mesh);
+		glUniform1i(g_uniform_locs.textured_mesh.mat_diffuse, 0);
+		glUniform1i(g_uniform_locs.textured_mesh.mat_specular, 1);
+		glUniform1f(g_uniform_locs.textured_mesh.mat_shininess, 64.0f);
+
+		gl_use_program(g_shaders.textured_mesh_instanced);
+		glUniform1i(g_uniform_locs.textured_mesh_instanced.mat_diffuse, 0);
+		glUniform1i(g_uniform_locs.textured_mesh_instanced.mat_specular, 1);
+		glUniform1f(g_uniform_locs.textured_mesh_instanced.mat_shininess, 64.0f);
 	}
 
 /*
@@ -710,47 +1672,183 @@ render_init(const Camera &cam, const Vec2u &screen_dim)
 	//load_models();
 }
 
+// The instance goes into the scene BVH, and so is drawn and picked, on the next render_sim(), once its transform is composed.
+// If the model isn't resident yet it stays out until it is.
+Model_Instance *
+render_add_instance(Model_ID id, Vec3f pos, Quat rot = make_quat(), Vec3f scale = { 1.0f, 1.0f, 1.0f })
+{
+	Model_Instance *i = mem_slab_new(Model_Instance, &g_instance_slab);
+	i->transform = transform_alloc(&g_instance_transforms, i);
+	transform_set(&g_instance_transforms, i->transform, pos, rot, scale);
+	i->model = id;
+	i->bvh_proxy = -1;
+	i->prev = NULL;
+	i->next = g_model_instances[id];
+	if (i->next)
+		i->next->prev = i;
+	g_model_instances[id] = i;
+	++g_num_model_instances[id];
+	return i;
+}
+
 void
-render_add_instance(Model_ID id, Vec3f pos)
+render_remove_instance(Model_Instance *inst)
 {
-	Model_Instance *i = mem_alloc(Model_Instance, &g_model_instances[id]);
-	i->pos = translate(make_mat4(), pos);
+	if (inst->bvh_proxy >= 0)
+		bvh_remove(&g_scene_bvh, inst->bvh_proxy);
+	if (inst->prev)
+		inst->prev->next = inst->next;
+	else
+		g_model_instances[inst->model] = inst->next;
+	if (inst->next)
+		inst->next->prev = inst->prev;
+	--g_num_model_instances[inst->model];
+	transform_free(&g_instance_transforms, inst->transform);
+	mem_slab_free(&g_instance_slab, inst);
+}
+
+// Takes effect on the next render_sim(). Many instances can be moved at once through g_instance_transforms directly.
+void
+render_move_instance(Model_Instance *inst, Vec3f pos, Quat rot, Vec3f scale)
+{
+	transform_set(&g_instance_transforms, inst->transform, pos, rot, scale);
+}
+
+// Composes the transforms that changed and moves their instances in the scene BVH, or puts them in it if they're not yet and
+// their model is resident.
+static void
+update_instance_transforms()
+{
+	Transforms *t = &g_instance_transforms;
+	if (t->num_dirty == 0)
+		return;
+	uint32_t *moved = mem_alloc_array(uint32_t, t->num_dirty, mem_frame_arena());
+	size_t num_moved = transforms_update(t, moved);
+	for (size_t i = 0; i < num_moved; ++i) {
+		Model_Instance *inst = (Model_Instance *)t->user_data[moved[i]];
+		Model_Asset *model = get_model(inst->model);
+		if (!model)
+			continue;
+		Aabb box = transform_aabb(model->bounds.center, model->bounds.extents, transform_world(t, moved[i]));
+		if (inst->bvh_proxy >= 0)
+			bvh_move(&g_scene_bvh, inst->bvh_proxy, box);
+		else
+			inst->bvh_proxy = bvh_insert(&g_scene_bvh, box, inst);
+	}
+	g_render_stats.num_transforms_updated = num_moved;
+}
+
+struct Pick_Result {
+	Model_Instance *instance;
+	uint32_t mesh;
+	uint32_t triangle; // Within the mesh.
+	float u, v;        // Barycentrics of the triangle's second and third vertices.
+	float distance;
+	Vec3f point;
+};
+
+// Scene BVH leaf callback. The ray goes into the instance's local space unnormalized, so hit distances stay in world units and
+// can be compared across instances.
+static float
+pick_instance(void *user_data, Vec3f origin, Vec3f dir, float max_t, void *ctx)
+{
+	Model_Instance *inst = (Model_Instance *)user_data;
+	Mat4 to_local;
+	// An instance scaled to nothing along some axis has no area to hit.
+	if (!inverse(to_mat4(transform_world(&g_instance_transforms, inst->transform)), &to_local))
+		return -1.0f;
+	Vec4f local_origin = to_local * Vec4f{ origin.x, origin.y, origin.z, 1.0f };
+	Vec4f local_dir = to_local * Vec4f{ dir.x, dir.y, dir.z, 0.0f };
+	Mesh_Bvh_Hit hit;
+	if (!mesh_bvh_raycast(get_model(inst->model)->bvh, { local_origin.x, local_origin.y, local_origin.z }, { local_dir.x, local_dir.y, local_dir.z }, max_t, &hit))
+		return -1.0f;
+	// Only closer hits get this far, so this is the best so far.
+	Pick_Result *r = (Pick_Result *)ctx;
+	r->instance = inst;
+	r->mesh = hit.mesh;
+	r->triangle = hit.triangle;
+	r->u = hit.u;
+	r->v = hit.v;
+	return hit.t;
+}
+
+// Finds the closest triangle under the given window position.
+bool
+render_pick(Vec2i screen_pos, const Vec2u &screen_dim, Pick_Result *out)
+{
+	Vec3f origin, dir;
+	if (!screen_to_world_ray(screen_pos, screen_dim, &origin, &dir))
+		return false;
+	Pick_Result r = {};
+	float t;
+	if (!bvh_query_ray(&g_scene_bvh, origin, dir, g_far_plane, pick_instance, &r, &t))
+		return false;
+	r.distance = t;
+	r.point = origin + (t * dir);
+	*out = r;
+	return true;
 }
 
 // TODO:
 // - We handle untextured meshes which slows us down (extra gl calls, extra loops).
 //   Should make that a debug switch in the future and have a release build that just dies if there is no texture.
-// - Is it faster to draw all similar meshes at once (less texture switching but more model uniform switching)
 // - Might be better to have an "active_models" list that copies all models with instances. 
-// - Should put all instances into a single list with a model_id and just sort the list before render.
+// Job over a range of the instances that made it through the BVH query. Culls their meshes.
+static void
+cull_instances(void *, uint32_t begin, uint32_t end)
+{
+	Cull_Scratch *cs = &g_cull_scratch;
+	constexpr size_t MAX_MESHES = 1 << SORT_KEY_MESH_BITS;
+	float box_storage[6][MAX_MESHES];
+	Cull_Boxes boxes = { box_storage[0], box_storage[1], box_storage[2], box_storage[3], box_storage[4], box_storage[5], MAX_MESHES };
+	uint32_t num_meshes_visible = 0;
+	for (uint32_t i = begin; i < end; ++i) {
+		Model_Instance *inst = cs->instances[i];
+		Model_Asset *model = get_model(inst->model);
+		for (GLuint j = 0; j < model->num_meshes; ++j)
+			set_cull_box(&boxes, j, model->meshes[j].bounds.center, model->meshes[j].bounds.extents, transform_world(&g_instance_transforms, inst->transform));
+		num_meshes_visible += cull_boxes(cs->frustum, boxes, model->num_meshes, &cs->mesh_visible[cs->first_mesh[i]]);
+	}
+	atomic_fetch_add(&cs->num_meshes_visible, num_meshes_visible);
+}
+
 void
 render_sim()
 {
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-	// TODO: Put these locations in the Shader struct.
-	GLint tex_model_loc = glGetUniformLocation(g_shaders.textured_mesh, "u_model");
-	GLint notex_model_loc = glGetUniformLocation(g_shaders.untextured_mesh, "u_model");
-	for (int i = 0; i < NUM_MODEL_IDS; ++i) {
-		Model_Asset *model;
-		GLuint num_meshes;
-		if (mem_has_elems(&g_model_instances[i])) {
-			model = get_model((Model_ID)i);
-			glBindVertexArray(model->vao);
-			glBindBuffer(GL_ARRAY_BUFFER, model->vbo);
-			num_meshes = model->num_meshes;
-		}
-		for (Model_Instance *inst = (Model_Instance *)mem_start(&g_model_instances[i]); inst; inst = (Model_Instance *)mem_next(inst)) {
-			glUseProgram(g_shaders.textured_mesh);
-			glUniformMatrix4fv(tex_model_loc, 1, GL_FALSE, &inst->pos[0]);
-			for (int j = 0; j < num_meshes; ++j) {
-				glActiveTexture(GL_TEXTURE0);
-				glBindTexture(GL_TEXTURE_2D, model->meshes[j].diffuse_id);
-				glActiveTexture(GL_TEXTURE1);
-				glBindTexture(GL_TEXTURE_2D, model->meshes[j].specular_id);
-				glDrawElements(GL_TRIANGLES, model->meshes[j].num_indices, GL_UNSIGNED_INT, (GLvoid *)(model->meshes[j].base_vertex * sizeof(GLuint)));
-			}
+	g_render_stats = {};
+	update_instance_transforms();
+	stream_update();
+	Cull_Scratch *cs = &g_cull_scratch;
+	cs->frustum = make_frustum(g_matrices.perspective_proj * g_matrices.view);
+	size_t num_visible = bvh_query_frustum(&g_scene_bvh, cs->frustum, (void **)cs->instances, MAX_RENDER_TRANSFORMS);
+	size_t num_instances = 0;
+	for (int i = 0; i < NUM_MODEL_IDS; ++i)
+		num_instances += g_num_model_instances[i];
+	g_render_stats.num_instances_drawn = num_visible;
+	g_render_stats.num_instances_culled = num_instances - num_visible;
+	uint32_t num_meshes = 0;
+	cs->first_mesh = mem_alloc_array(uint32_t, num_visible, mem_frame_arena());
+	for (size_t i = 0; i < num_visible; ++i) {
+		uint32_t n = get_model(cs->instances[i]->model)->num_meshes;
+		if (num_meshes + n > MAX_RENDER_COMMANDS) {
+			zerror("render queue is full");
+			num_visible = i;
+			break;
 		}
+		cs->first_mesh[i] = num_meshes;
+		num_meshes += n;
+	}
+	cs->mesh_visible = mem_alloc_array(bool, num_meshes, mem_frame_arena());
+	cs->num_meshes_visible = 0;
+	parallel_for(cull_instances, NULL, num_visible, CULL_INSTANCES_PER_JOB);
+	g_render_stats.num_meshes_drawn = cs->num_meshes_visible;
+	g_render_stats.num_meshes_culled = num_meshes - cs->num_meshes_visible;
+	for (size_t i = 0; i < num_visible; ++i) {
+		Model_Instance *inst = cs->instances[i];
+		render_push_model(get_model(inst->model), transform_world(&g_instance_transforms, inst->transform), &cs->mesh_visible[cs->first_mesh[i]]);
 	}
+	render_queue_flush();
 }
 
 /*
@@ -0,0 +1,274 @@
+// Transforms.
+// Positions, rotations and scales are kept in structure-of-arrays form, one slot per object, and every slot caches its world
+// matrix as a Mat3x4. Setting a transform only marks its slot dirty. transforms_update() then composes all the dirty slots in one
+// pass spread over the job threads, with kernels that take 4 (SSE) or 8 (AVX) slots at a time straight from the arrays.
+// Slots are added 64 at a time, one dirty word's worth, and start out as the identity, so the kernels never see a partial group
+// or garbage, free slots included.
+
+constexpr uint32_t TRANSFORM_SLOTS_PER_WORD = 64;
+constexpr uint32_t TRANSFORM_WORDS_PER_JOB = 16;
+
+struct Transforms {
+	Array<float> px, py, pz;
+	Array<float> qx, qy, qz, qw;
+	Array<float> sx, sy, sz;
+	Array<Mat3x4> world;
+	Array<void *> user_data; // NULL for free slots.
+	Array<uint64_t> dirty;   // One bit per slot.
+	Array<uint32_t> free_slots;
+	uint32_t num_dirty;
+};
+
+static void
+add_transform_field(Array<float> *a, float value)
+{
+	float *p = array_alloc(a, TRANSFORM_SLOTS_PER_WORD);
+	for (uint32_t i = 0; i < TRANSFORM_SLOTS_PER_WORD; ++i)
+		p[i] = value;
+}
+
+static void
+add_transform_slots(Transforms *t)
+{
+	uint32_t first = t->px.size;
+	add_transform_field(&t->px, 0.0f);
+	add_transform_field(&t->py, 0.0f);
+	add_transform_field(&t->pz, 0.0f);
+	add_transform_field(&t->qx, 0.0f);
+	add_transform_field(&t->qy, 0.0f);
+	add_transform_field(&t->qz, 0.0f);
+	add_transform_field(&t->qw, 1.0f);
+	add_transform_field(&t->sx, 1.0f);
+	add_transform_field(&t->sy, 1.0f);
+	add_transform_field(&t->sz, 1.0f);
+	Mat3x4 *world = array_alloc(&t->world, TRANSFORM_SLOTS_PER_WORD);
+	void **user_data = array_alloc(&t->user_data, TRANSFORM_SLOTS_PER_WORD);
+	for (uint32_t i = 0; i < TRANSFORM_SLOTS_PER_WORD; ++i) {
+		world[i] = make_mat3x4({ 0.0f, 0.0f, 0.0f }, make_quat(), { 1.0f, 1.0f, 1.0f });
+		user_data[i] = NULL;
+	}
+	*array_alloc(&t->dirty) = 0;
+	// Backwards, so the lowest slot is handed out first.
+	for (uint32_t i = TRANSFORM_SLOTS_PER_WORD; i > 0; --i)
+		*array_alloc(&t->free_slots) = first + i - 1;
+}
+
+static inline void
+mark_transform_dirty(Transforms *t, uint32_t slot)
+{
+	uint64_t bit = 1ull << (slot % TRANSFORM_SLOTS_PER_WORD);
+	uint64_t *word = &t->dirty[slot / TRANSFORM_SLOTS_PER_WORD];
+	t->num_dirty += !(*word & bit);
+	*word |= bit;
+}
+
+// rot is expected to be a unit quaternion.
+void
+transform_set(Transforms *t, uint32_t slot, Vec3f pos, Quat rot, Vec3f scale)
+{
+	t->px[slot] = pos.x;
+	t->py[slot] = pos.y;
+	t->pz[slot] = pos.z;
+	t->qx[slot] = rot.x;
+	t->qy[slot] = rot.y;
+	t->qz[slot] = rot.z;
+	t->qw[slot] = rot.w;
+	t->sx[slot] = scale.x;
+	t->sy[slot] = scale.y;
+	t->sz[slot] = scale.z;
+	mark_transform_dirty(t, slot);
+}
+
+void
+transform_set_position(Transforms *t, uint32_t slot, Vec3f pos)
+{
+	t->px[slot] = pos.x;
+	t->py[slot] = pos.y;
+	t->pz[slot] = pos.z;
+	mark_transform_dirty(t, slot);
+}
+
+void
+transform_set_rotation(Transforms *t, uint32_t slot, Quat rot)
+{
+	t->qx[slot] = rot.x;
+	t->qy[slot] = rot.y;
+	t->qz[slot] = rot.z;
+	t->qw[slot] = rot.w;
+	mark_transform_dirty(t, slot);
+}
+
+// The slot starts out as the identity. user_data must not be NULL.
+uint32_t
+transform_alloc(Transforms *t, void *user_data)
+{
+	assert(user_data);
+	if (t->free_slots.size == 0)
+		add_transform_slots(t);
+	uint32_t slot = t->free_slots.elems[--t->free_slots.size];
+	t->user_data[slot] = user_data;
+	transform_set(t, slot, { 0.0f, 0.0f, 0.0f }, make_quat(), { 1.0f, 1.0f, 1.0f });
+	return slot;
+}
+
+void
+transform_free(Transforms *t, uint32_t slot)
+{
+	assert(t->user_data[slot]);
+	t->user_data[slot] = NULL;
+	*array_alloc(&t->free_slots) = slot;
+}
+
+// As of the last transforms_update().
+inline const Mat3x4 &
+transform_world(Transforms *t, uint32_t slot)
+{
+	return t->world[slot];
+}
+
+void
+transforms_destroy(Transforms *t)
+{
+	Array<float> *fields[] = { &t->px, &t->py, &t->pz, &t->qx, &t->qy, &t->qz, &t->qw, &t->sx, &t->sy, &t->sz };
+	for (Array<float> *a : fields)
+		array_destroy(a);
+	array_destroy(&t->world);
+	array_destroy(&t->user_data);
+	array_destroy(&t->dirty);
+	array_destroy(&t->free_slots);
+	t->num_dirty = 0;
+}
+
+// The kernels compose slots [begin, end), which are whole groups of 8.
+
+static void
+compose_transforms_scalar(Transforms *t, uint32_t begin, uint32_t end)
+{
+	for (uint32_t i = begin; i < end; ++i) {
+		t->world.elems[i] = make_mat3x4({ t->px.elems[i], t->py.elems[i], t->pz.elems[i] },
+		                                { t->qx.elems[i], t->qy.elems[i], t->qz.elems[i], t->qw.elems[i] },
+		                                { t->sx.elems[i], t->sy.elems[i], t->sz.elems[i] });
+	}
+}
+
+// Row r of four slots' matrices, one column per register, goes to out[0] through out[3].
+static inline void
+store_mat3x4_rows_sse(Mat3x4 *out, int r, __m128 c0, __m128 c1, __m128 c2, __m128 c3)
+{
+	_MM_TRANSPOSE4_PS(c0, c1, c2, c3);
+	_mm_store_ps(out[0].m + r*4, c0);
+	_mm_store_ps(out[1].m + r*4, c1);
+	_mm_store_ps(out[2].m + r*4, c2);
+	_mm_store_ps(out[3].m + r*4, c3);
+}
+
+// Same as make_mat3x4(), a lane per slot. The arrays start on a page, so the loads are aligned.
+static void
+compose_transforms_sse(Transforms *t, uint32_t begin, uint32_t end)
+{
+	const __m128 one = _mm_set1_ps(1.0f);
+	for (uint32_t i = begin; i < end; i += 4) {
+		__m128 qx = _mm_load_ps(t->qx.elems + i), qy = _mm_load_ps(t->qy.elems + i);
+		__m128 qz = _mm_load_ps(t->qz.elems + i), qw = _mm_load_ps(t->qw.elems + i);
+		__m128 x2 = _mm_add_ps(qx, qx), y2 = _mm_add_ps(qy, qy), z2 = _mm_add_ps(qz, qz);
+		__m128 xx = _mm_mul_ps(qx, x2), yy = _mm_mul_ps(qy, y2), zz = _mm_mul_ps(qz, z2);
+		__m128 xy = _mm_mul_ps(qx, y2), xz = _mm_mul_ps(qx, z2), yz = _mm_mul_ps(qy, z2);
+		__m128 wx = _mm_mul_ps(qw, x2), wy = _mm_mul_ps(qw, y2), wz = _mm_mul_ps(qw, z2);
+		__m128 sx = _mm_load_ps(t->sx.elems + i), sy = _mm_load_ps(t->sy.elems + i), sz = _mm_load_ps(t->sz.elems + i);
+		Mat3x4 *out = t->world.elems + i;
+		store_mat3x4_rows_sse(out, 0, _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(yy, zz)), sx), _mm_mul_ps(_mm_sub_ps(xy, wz), sy),
+		                      _mm_mul_ps(_mm_add_ps(xz, wy), sz), _mm_load_ps(t->px.elems + i));
+		store_mat3x4_rows_sse(out, 1, _mm_mul_ps(_mm_add_ps(xy, wz), sx), _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, zz)), sy),
+		                      _mm_mul_ps(_mm_sub_ps(yz, wx), sz), _mm_load_ps(t->py.elems + i));
+		store_mat3x4_rows_sse(out, 2, _mm_mul_ps(_mm_sub_ps(xz, wy), sx), _mm_mul_ps(_mm_add_ps(yz, wx), sy),
+		                      _mm_mul_ps(_mm_sub_ps(one, _mm_add_ps(xx, yy)), sz), _mm_load_ps(t->pz.elems + i));
+	}
+}
+
+// The transpose stays within each 128 bit half, so the low halves hold slots 0 to 3 and the high halves slots 4 to 7.
+__attribute__((target("avx"))) static inline void
+store_mat3x4_rows_avx(Mat3x4 *out, int r, __m256 c0, __m256 c1, __m256 c2, __m256 c3)
+{
+	__m256 t0 = _mm256_unpacklo_ps(c0, c1), t1 = _mm256_unpackhi_ps(c0, c1);
+	__m256 t2 = _mm256_unpacklo_ps(c2, c3), t3 = _mm256_unpackhi_ps(c2, c3);
+	__m256 rows[4] = {
+		_mm256_shuffle_ps(t0, t2, 0x44), _mm256_shuffle_ps(t0, t2, 0xEE),
+		_mm256_shuffle_ps(t1, t3, 0x44), _mm256_shuffle_ps(t1, t3, 0xEE),
+	};
+	for (int k = 0; k < 4; ++k) {
+		_mm_store_ps(out[k].m + r*4, _mm256_castps256_ps128(rows[k]));
+		_mm_store_ps(out[k + 4].m + r*4, _mm256_extractf128_ps(rows[k], 1));
+	}
+}
+
+__attribute__((target("avx"))) static void
+compose_transforms_avx(Transforms *t, uint32_t begin, uint32_t end)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	for (uint32_t i = begin; i < end; i += 8) {
+		__m256 qx = _mm256_load_ps(t->qx.elems + i), qy = _mm256_load_ps(t->qy.elems + i);
+		__m256 qz = _mm256_load_ps(t->qz.elems + i), qw = _mm256_load_ps(t->qw.elems + i);
+		__m256 x2 = _mm256_add_ps(qx, qx), y2 = _mm256_add_ps(qy, qy), z2 = _mm256_add_ps(qz, qz);
+		__m256 xx = _mm256_mul_ps(qx, x2), yy = _mm256_mul_ps(qy, y2), zz = _mm256_mul_ps(qz, z2);
+		__m256 xy = _mm256_mul_ps(qx, y2), xz = _mm256_mul_ps(qx, z2), yz = _mm256_mul_ps(qy, z2);
+		__m256 wx = _mm256_mul_ps(qw, x2), wy = _mm256_mul_ps(qw, y2), wz = _mm256_mul_ps(qw, z2);
+		__m256 sx = _mm256_load_ps(t->sx.elems + i), sy = _mm256_load_ps(t->sy.elems + i), sz = _mm256_load_ps(t->sz.elems + i);
+		Mat3x4 *out = t->world.elems + i;
+		store_mat3x4_rows_avx(out, 0, _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(yy, zz)), sx), _mm256_mul_ps(_mm256_sub_ps(xy, wz), sy),
+		                      _mm256_mul_ps(_mm256_add_ps(xz, wy), sz), _mm256_load_ps(t->px.elems + i));
+		store_mat3x4_rows_avx(out, 1, _mm256_mul_ps(_mm256_add_ps(xy, wz), sx), _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, zz)), sy),
+		                      _mm256_mul_ps(_mm256_sub_ps(yz, wx), sz), _mm256_load_ps(t->py.elems + i));
+		store_mat3x4_rows_avx(out, 2, _mm256_mul_ps(_mm256_sub_ps(xz, wy), sx), _mm256_mul_ps(_mm256_add_ps(yz, wx), sy),
+		                      _mm256_mul_ps(_mm256_sub_ps(one, _mm256_add_ps(xx, yy)), sz), _mm256_load_ps(t->pz.elems + i));
+	}
+}
+
+// Picks the kernel by the level math_init() settled on.
+static void
+compose_transforms(Transforms *t, uint32_t begin, uint32_t end)
+{
+	switch (g_math_kernels.level) {
+	case SIMD_SCALAR: compose_transforms_scalar(t, begin, end); break;
+	case SIMD_SSE: compose_transforms_sse(t, begin, end); break;
+	case SIMD_AVX: compose_transforms_avx(t, begin, end); break;
+	}
+}
+
+// Job over a range of dirty words. Each run of 8 slot groups with a dirty slot in them is composed in one go, clean slots and
+// all, which is cheaper than picking them out.
+static void
+compose_dirty_transforms(void *data, uint32_t begin, uint32_t end)
+{
+	Transforms *t = (Transforms *)data;
+	for (uint32_t w = begin; w < end; ++w) {
+		uint64_t bits = t->dirty.elems[w];
+		while (bits) {
+			uint32_t run_begin = __builtin_ctzll(bits) & ~7u, run_end = run_begin + 8;
+			while (run_end < TRANSFORM_SLOTS_PER_WORD && ((bits >> run_end) & 0xFF))
+				run_end += 8;
+			compose_transforms(t, w*TRANSFORM_SLOTS_PER_WORD + run_begin, w*TRANSFORM_SLOTS_PER_WORD + run_end);
+			bits = run_end == TRANSFORM_SLOTS_PER_WORD ? 0 : bits & (~0ull << run_end);
+		}
+	}
+}
+
+// Composes the world matrix of every slot set since the last call. If moved isn't NULL, the slots still in use among them are
+// written to it, and it needs room for num_dirty of them. Returns how many were written.
+size_t
+transforms_update(Transforms *t, uint32_t *moved)
+{
+	if (t->num_dirty == 0)
+		return 0;
+	parallel_for(compose_dirty_transforms, t, t->dirty.size, TRANSFORM_WORDS_PER_JOB);
+	size_t num_moved = 0;
+	for (uint32_t w = 0; w < t->dirty.size; ++w) {
+		for (uint64_t bits = t->dirty.elems[w]; bits && moved; bits &= bits - 1) {
+			uint32_t slot = w*TRANSFORM_SLOTS_PER_WORD + __builtin_ctzll(bits);
+			if (t->user_data.elems[slot])
+				moved[num_moved++] = slot;
+		}
+		t->dirty.elems[w] = 0;
+	}
+	t->num_dirty = 0;
+	return num_moved;
+}